@@ -6,14 +6,22 @@ set includepath=%osgeopath%\include
 set libpath=%osgeopath%\lib
 
 set CFLAGS=/nologo /Z7 /I%includepath%
-set INFILES=dr2osm.c
-set LIBS=sqlite3_i.lib proj.lib
+set LIBRARY_INFILES=src\converter.c
+set INFILES=src\dr2osm.c
+set LIBS=sqlite3_i.lib proj.lib zlib.lib
 set LDFLAGS=/incremental:no /subsystem:console /libpath:%libpath%
 
 if "%1" == "release" (
 	set CFLAGS=%CFLAGS% /O2 /DRELEASE_BUILD
 )
 
-cl %CFLAGS% /Fedr2osm.exe %INFILES% %LIBS% /link %LDFLAGS%
+if "%2" == "notrace" (
+	set CFLAGS=%CFLAGS% /DDR2OSM_NO_TRACE
+)
+
+cl %CFLAGS% /c /Foconverter.obj %LIBRARY_INFILES% || goto end
+lib /nologo /out:dr2osm.lib converter.obj || goto end
+cl %CFLAGS% /Fedr2osm.exe %INFILES% dr2osm.lib %LIBS% /link %LDFLAGS%
 
+:end
 popd
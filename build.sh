@@ -1,11 +1,12 @@
 #!/bin/sh
 
 SRC_DIR="src"
+LIBRARY_INFILES="$SRC_DIR/converter.c"
 INFILES="$SRC_DIR/dr2osm.c"
-LIBS="-lsqlite3 -lproj"
+LIBS="-lsqlite3 -lproj -lz -lpthread -lm"
 
 # Default flags
-CFLAGS="-pg"
+CFLAGS=""
 LDFLAGS=""
 
 # Detect platform
@@ -21,10 +22,28 @@ elif [ "$UNAME" = "Linux" ]; then
     :
 fi
 
-# Release flags
+# Optional zstd support
+if pkg-config --exists libzstd 2>/dev/null; then
+    CFLAGS="$CFLAGS -DHAVE_ZSTD $(pkg-config --cflags libzstd)"
+    LIBS="$LIBS $(pkg-config --libs libzstd)"
+fi
+
+# Release flags. Only development builds are instrumented for gprof, as
+# releases are traced with --trace instead.
 if [ "$1" = "release" ]; then
     CFLAGS="-O3 -DRELEASE_BUILD $CFLAGS"
+else
+    CFLAGS="-pg $CFLAGS"
 fi
 
-# Compile
-cc $CFLAGS $LDFLAGS -o dr2osm $INFILES $LIBS
+# Leaves the trace points out, see --trace
+if [ "$2" = "notrace" ]; then
+    CFLAGS="$CFLAGS -DDR2OSM_NO_TRACE"
+fi
+
+# Compile the conversion library
+cc $CFLAGS -c -o converter.o $LIBRARY_INFILES || exit 1
+ar rcs libdr2osm.a converter.o || exit 1
+
+# Compile the executable
+cc $CFLAGS $LDFLAGS -o dr2osm $INFILES libdr2osm.a $LIBS
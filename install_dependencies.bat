@@ -8,7 +8,7 @@ osgeo4w-setup.exe ^
 	--local-package-dir "%TEMP%" ^
 	--no-desktop ^
 	--no-shortcuts ^
-	--packages sqlite3-devel,proj-devel ^
+	--packages sqlite3-devel,proj-devel,zlib-devel ^
 	--quiet-mode ^
 	--root "%root%" ^
 	--site "%site%"
@@ -1,9 +1,32 @@
+/* Memory is committed to a buffer in steps that double from COMMIT_BLOCK_SIZE
+ * up to MAX_COMMIT_SIZE, so that a large buffer takes few system calls while
+ * a small one does not commit much more than it uses. */
 #define COMMIT_BLOCK_SIZE (16 * 1024)
+#define MAX_COMMIT_SIZE (64 * 1024 * 1024)
 
-static Growable_Buffer way_buffer, node_buffer;
-static Node *node_tree_root;
+/* Large buffers are aligned to huge pages where they are supported, as the
+ * node index is accessed randomly and suffers from TLB misses with small
+ * pages. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-static jmp_buf out_of_memory;
+/* Returns the number of bytes to commit next to buffer. */
+static intptr_t
+get_commit_size(Growable_Buffer *buffer)
+{
+	intptr_t result = buffer->commit_threshold_offset;
+
+	if (result < COMMIT_BLOCK_SIZE) {
+		result = COMMIT_BLOCK_SIZE;
+	} else if (result > MAX_COMMIT_SIZE) {
+		result = MAX_COMMIT_SIZE;
+	}
+
+	if (result > buffer->size - buffer->commit_threshold_offset) {
+		result = buffer->size - buffer->commit_threshold_offset;
+	}
+
+	return result;
+}
 
 #if defined(_WIN32)
 
@@ -19,11 +42,13 @@ reserve_memory(intptr_t size)
 static int
 commit_memory(Growable_Buffer *buffer)
 {
+	intptr_t size = get_commit_size(buffer);
 	int result = !!VirtualAlloc(buffer->start + buffer->commit_threshold_offset,
-			COMMIT_BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+			size, MEM_COMMIT, PAGE_READWRITE);
 
 	if (result) {
-		buffer->commit_threshold_offset += COMMIT_BLOCK_SIZE;
+		buffer->commit_threshold_offset += size;
+		buffer->num_commits++;
 	}
 
 	return result;
@@ -41,6 +66,20 @@ get_memory_error_message()
 	return result;
 }
 
+/* Returns the number of page faults of the process so far. */
+static int64_t
+get_page_faults()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+			sizeof(counters))) {
+		return 0;
+	}
+
+	return counters.PageFaultCount;
+}
+
 #else
 
 /* On POSIX use mmap to reserve an address range and mprotect to commit memory
@@ -49,6 +88,37 @@ get_memory_error_message()
 static void *
 reserve_memory(intptr_t size)
 {
+#if defined(MADV_HUGEPAGE)
+	/* Reserve extra room to align the range to a huge page and unmap the
+	 * rest, and ask for transparent huge pages. The kernel ignores the
+	 * advice if they are disabled. */
+	if (size >= HUGE_PAGE_SIZE) {
+		intptr_t padded_size = size + HUGE_PAGE_SIZE;
+		char *padded = mmap(0, padded_size, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (padded == MAP_FAILED) {
+			return 0;
+		}
+
+		char *result = (char *)(((uintptr_t)padded + HUGE_PAGE_SIZE - 1)
+				& ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		char *end = result + size;
+
+		if (result > padded) {
+			munmap(padded, result - padded);
+		}
+
+		if (padded + padded_size > end) {
+			munmap(end, padded + padded_size - end);
+		}
+
+		madvise(result, size, MADV_HUGEPAGE);
+
+		return result;
+	}
+#endif
+
 	void *result = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
 	return result == MAP_FAILED ? 0 : result;
@@ -57,11 +127,13 @@ reserve_memory(intptr_t size)
 static int
 commit_memory(Growable_Buffer *buffer)
 {
+	intptr_t size = get_commit_size(buffer);
 	int result = !mprotect(buffer->start + buffer->commit_threshold_offset,
-			COMMIT_BLOCK_SIZE, PROT_READ | PROT_WRITE);
+			size, PROT_READ | PROT_WRITE);
 
 	if (result) {
-		buffer->commit_threshold_offset += COMMIT_BLOCK_SIZE;
+		buffer->commit_threshold_offset += size;
+		buffer->num_commits++;
 	}
 
 	return result;
@@ -73,13 +145,26 @@ get_memory_error_message()
 	return strerror(errno);
 }
 
+/* Returns the number of page faults of the process so far. */
+static int64_t
+get_page_faults()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return 0;
+	}
+
+	return (int64_t)usage.ru_minflt + usage.ru_majflt;
+}
+
 #endif
 
-/* On error the various memory functions longjmp to out_of_memory, which is set
- * in the main function. */
+/* On error the various memory functions longjmp to the out_of_memory jump
+ * buffer passed to init_buffer. */
 
 static int
-init_buffer(Growable_Buffer *buffer, intptr_t size)
+init_buffer(Growable_Buffer *buffer, intptr_t size, jmp_buf *out_of_memory)
 {
 	assert(size >= 0);
 
@@ -96,10 +181,28 @@ init_buffer(Growable_Buffer *buffer, intptr_t size)
 	buffer->first_in_offset = 0;
 	buffer->next_in_offset = 0;
 	buffer->commit_threshold_offset = 0;
+	buffer->num_commits = 0;
+	buffer->out_of_memory = out_of_memory;
 
 	return 1;
 }
 
+static void
+free_buffer(Growable_Buffer *buffer)
+{
+	if (!buffer->start) {
+		return;
+	}
+
+#if defined(_WIN32)
+	VirtualFree(buffer->start, 0, MEM_RELEASE);
+#else
+	munmap(buffer->start, buffer->size);
+#endif
+
+	buffer->start = 0;
+}
+
 /* Pushes to the end of the buffer, committing more memory if needed. */
 static void *
 buffer_push(Growable_Buffer *buffer, intptr_t size)
@@ -108,17 +211,18 @@ buffer_push(Growable_Buffer *buffer, intptr_t size)
 
 	if (buffer->size - buffer->next_in_offset < size) {
 		fprintf(stderr, "Ran out of buffer space.\n");
-		longjmp(out_of_memory, 1);
+		longjmp(*buffer->out_of_memory, 1);
 	}
 
 	char *result = buffer->start + buffer->next_in_offset;
 	buffer->next_in_offset += size;
 
-	if (buffer->next_in_offset > buffer->commit_threshold_offset
-			&& !commit_memory(buffer)) {
-		fprintf(stderr, "Unable to commit memory to buffer: %s\n",
-				get_memory_error_message());
-		longjmp(out_of_memory, 1);
+	while (buffer->next_in_offset > buffer->commit_threshold_offset) {
+		if (!commit_memory(buffer)) {
+			fprintf(stderr, "Unable to commit memory to buffer: %s\n",
+					get_memory_error_message());
+			longjmp(*buffer->out_of_memory, 1);
+		}
 	}
 
 	return result;
@@ -139,9 +243,9 @@ buffer_pop(Growable_Buffer *buffer, intptr_t size)
 }
 
 static int *
-way_buffer_push_int(int value)
+buffer_push_int(Growable_Buffer *buffer, int value)
 {
-	int *result = buffer_push(&way_buffer, sizeof(int));
+	int *result = buffer_push(buffer, sizeof(int));
 	*result = value;
 
 	return result;
@@ -150,7 +254,7 @@ way_buffer_push_int(int value)
 /* Strings are buffered as zero-terminated 8 bit character sequences padded to
  * the next 4 byte boundary. */
 static void
-way_buffer_push_string(const char *value)
+buffer_push_string(Growable_Buffer *buffer, const char *value)
 {
 	char chunk[4];
 
@@ -160,14 +264,14 @@ way_buffer_push_string(const char *value)
 			value += !!*value;
 		}
 
-		way_buffer_push_int(*(int *)chunk);
+		buffer_push_int(buffer, *(int *)chunk);
 	} while (chunk[3]);
 }
 
 static int
-way_buffer_pop_int()
+buffer_pop_int(Growable_Buffer *buffer)
 {
-	int *presult = buffer_pop(&way_buffer, sizeof(int));
+	int *presult = buffer_pop(buffer, sizeof(int));
 
 	assert(presult);
 
@@ -175,57 +279,16 @@ way_buffer_pop_int()
 }
 
 static char *
-way_buffer_pop_string()
+buffer_pop_string(Growable_Buffer *buffer)
 {
-	char *result = buffer_pop(&way_buffer, 0);
+	char *result = buffer_pop(buffer, 0);
 
 	int buf;
 	char *chunk = (char *)&buf;
 
 	do {
-		buf = way_buffer_pop_int();
+		buf = buffer_pop_int(buffer);
 	} while (chunk[3]);
 
 	return result;
 }
-
-static Node *
-alloc_node()
-{
-	return buffer_push(&node_buffer, sizeof(Node));
-}
-
-/* Buffers nodes (as coordinate pairs) into a quad tree. If a node with
- * identical coordinates has already been buffered, returns a pointer to the
- * previously seen node. Otherwise allocates a new node with its id field
- * initialized to 0 and returns a pointer to it. */
-static Node *
-node_upsert(int x, int y)
-{
-	Node *current = node_tree_root;
-
-	while (1) {
-		if (x == current->x && y == current->y) {
-			return current;
-		}
-
-		int east = (x > current->x);
-		int north = (y > current->y);
-		int child_index = east | (north << 1);
-
-		if (current->child_node_offsets[child_index] == 0) {
-			Node *new = alloc_node();
-			intptr_t offset = new - current;
-
-			assert(offset > 0 && offset < INT_MAX);
-
-			current->child_node_offsets[child_index] = (int)offset;
-			new->x = x;
-			new->y = y;
-
-			return new;
-		}
-
-		current += current->child_node_offsets[child_index];
-	}
-}
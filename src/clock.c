@@ -0,0 +1,32 @@
+/* Returns the time in seconds from an arbitrary starting point. The clock is
+ * monotonic, so it is only useful for measuring intervals. */
+#if defined(_WIN32)
+
+static double
+get_time()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	QueryPerformanceCounter(&counter);
+
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+#else
+
+static double
+get_time()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+#endif
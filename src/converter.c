@@ -0,0 +1,3289 @@
+/* Standard library. */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* System. */
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Third-party libraries. */
+#include <proj.h>
+#include <sqlite3.h>
+#include <zlib.h>
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+/* Project code. */
+#include "platform.h"
+#include "dr2osm.h"
+#include "types.h"
+#include "buffer.c"
+#include "thread.c"
+#include "node_index.c"
+#include "clock.c"
+#include "trace.c"
+#include "stream.c"
+#include "snapshot.c"
+#include "external_sort.c"
+#include "grid.c"
+#include "linear_reference.c"
+#include "merge_pbf.c"
+
+#define ICE_ROAD_SPEED_LIMIT 30
+
+/* Checkpoints are written at most every checkpoint_interval seconds, and so
+ * that writing them takes at most 1 / CHECKPOINT_MAX_OVERHEAD of the time. */
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+#define CHECKPOINT_MAX_OVERHEAD 20
+#define CHECKPOINT_CHECK_ROWS 1024
+
+#define HIGHWAY                      \
+	X(HW_NONE, "")                   \
+	X(HW_FOOTWAY, "footway")         \
+	X(HW_MOTORWAY, "motorway")       \
+	X(HW_TRUNK, "trunk")             \
+	X(HW_PRIMARY, "primary")         \
+	X(HW_SECONDARY, "secondary")     \
+	X(HW_TERTIARY, "tertiary")       \
+	X(HW_RESIDENTIAL, "residential") \
+	X(HW_UNCLASSIFIED, "unclassified") \
+	X(HW_CYCLEWAY, "cycleway")
+
+#define ROUTE      \
+	X(RT_NONE, "") \
+	X(RT_FERRY, "ferry")
+
+#define ONEWAY     \
+	X(OW_NONE, "") \
+	X(OW_NO, "no") \
+	X(OW_YES, "yes")
+
+#define ADDITIONAL_TAGS X(AT_ICE_ROAD, "ice_road")
+
+enum
+{
+#define X(IDENT, STRING) IDENT,
+	HIGHWAY ROUTE ONEWAY ADDITIONAL_TAGS
+#undef X
+		STRING_COUNT
+};
+
+static char *osm_strings[STRING_COUNT] = {
+#define X(IDENT, STRING) STRING,
+	HIGHWAY ROUTE ONEWAY ADDITIONAL_TAGS
+#undef X
+};
+
+/* A link with several rows in the attribute tables is joined to every
+ * combination of them, so the rows are grouped back into one per link, with
+ * the distinct ranges of each attribute listed as "value start end" separated
+ * by commas, see linear_reference.c. */
+#define ATTRIBUTE_RANGES(TABLE)                                          \
+	"COALESCE(group_concat(DISTINCT " TABLE ".arvo || ' ' || "          \
+	"COALESCE(" TABLE ".alkum, 0) || ' ' || "                            \
+	"COALESCE(" TABLE ".loppum, 1e9)), '')"
+
+static char input_sql_query[] =
+	"SELECT l.geom AS geom,"
+	ATTRIBUTE_RANGES("n") " AS speed_limits,"
+	"COALESCE(l.toiminn_lk, 0) AS class,"
+	"COALESCE(l.linkkityyp, 0) AS type,"
+	"COALESCE(l.ajosuunta, 0) AS direction,"
+	"COALESCE(l.tienimi_su, l.tienimi_ru, l.tienim_psa, l.tienim_ksa, "
+	"l.tienim_isa, '') AS name,"
+	ATTRIBUTE_RANGES("h") " AS heights_cm,"
+	ATTRIBUTE_RANGES("w") " AS weights_kg,"
+	"COALESCE(l.kuntakoodi, 0) AS municipality,"
+	"COUNT(*) AS num_rows,"
+	"l.rowid AS source_rowid\n"
+	"FROM dr_linkki_k AS l\n"
+	"LEFT OUTER JOIN dr_nopeusrajoitus_k AS n USING (segm_id)\n"
+	"LEFT OUTER JOIN dr_suurin_sallittu_korkeus_k AS h USING (segm_id)\n"
+	"LEFT OUTER JOIN dr_suurin_sallittu_massa_k AS w USING (segm_id)\n"
+	"WHERE l.rowid > ?1 GROUP BY l.rowid ORDER BY l.rowid;\n";
+
+static char mml_iceroads_sql_query[] =
+	"SELECT geom,"
+	"COALESCE(yksisuuntaisuus, -1) AS direction,"
+	"COALESCE("
+	"nimi_suomi, nimi_ruotsi, nimi_inarinsaame, nimi_koltansaame, "
+	"nimi_pohjoissaame, ''"
+	") AS name,"
+	"rowid AS source_rowid\n"
+	"FROM iceroads\n"
+	"WHERE rowid > ?1 ORDER BY rowid;";
+
+/* Opens the sqlite3 database at path and returns the database handle.
+ * Returns 0 on error. */
+static sqlite3 *open_database(const Unicode_Character *path)
+{
+	sqlite3 *result;
+	int rc;
+
+#if defined(_WIN32)
+	rc = sqlite3_open16(path, &result);
+#else
+	rc = sqlite3_open_v2(path, &result, SQLITE_OPEN_READONLY, 0);
+#endif
+
+	if (rc != SQLITE_OK)
+	{
+		fprintf(stderr,
+				"Unable to open \"" FORMAT_UNICODE_STRING "\" for reading: %s\n",
+				path, sqlite3_errmsg(result));
+		sqlite3_close(result);
+		return 0;
+	}
+
+	return result;
+}
+
+/* Prepares in the database db the sql statement in the string sql.
+ * Returns 0 on error. */
+static sqlite3_stmt *prepare_statement(sqlite3 *db, char *sql)
+{
+	sqlite3_stmt *result = 0;
+
+	int rc = sqlite3_prepare_v2(db, sql, -1, &result, 0);
+
+	if (rc != SQLITE_OK)
+	{
+		fprintf(stderr, "Unable to read data from input: %s\n", sqlite3_errstr(rc));
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return 0;
+	}
+
+	return result;
+}
+
+/* Prepares and executes a query counting the number of ways in the Digiroad
+ * database opened in the database db, and returns the result.
+ * Returns 0 on error. */
+static int get_num_ways(sqlite3 *db)
+{
+	sqlite3_stmt *statement =
+		prepare_statement(db, "SELECT COUNT(*) FROM dr_linkki_k;");
+
+	if (!statement)
+	{
+		return 0;
+	}
+
+	int result = 0;
+	int rc;
+
+	do
+	{
+		rc = sqlite3_step(statement);
+
+		assert(rc != SQLITE_MISUSE);
+
+		switch (rc)
+		{
+		case SQLITE_BUSY:
+			break;
+
+		case SQLITE_ROW:
+			result = sqlite3_column_int(statement, 0);
+
+			if (!result)
+			{
+				fprintf(stderr, "Input does not contain any ways.\n");
+			}
+
+			break;
+
+		default:
+			fprintf(stderr, "Unable to read data from input: %s\n",
+					sqlite3_errstr(rc));
+			fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+			break;
+		}
+	} while (rc == SQLITE_BUSY);
+
+	sqlite3_finalize(statement);
+
+	return result;
+}
+
+/* Return a unique ID number for a node or way.
+ * Please don't call this more than INT_MAX times. <3 */
+static int generate_id(Dr2osm_Converter *converter)
+{
+	int result = ++converter->last_id;
+	assert(result > 0); /* TODO handle this properly. */
+	return result;
+}
+
+/* Returns the number of worker threads to use according to the options of
+ * converter, at most 64. */
+static int get_num_threads(Dr2osm_Converter *converter)
+{
+	int result = converter->options.num_threads;
+
+	if (result <= 0)
+	{
+		result = get_processor_count();
+	}
+
+	return result < 64 ? result : 64;
+}
+
+/* Parses and validates the Geopackage geometry of geom_size bytes at
+ * geom_header, which must be a line string. On success the number of points
+ * is stored in num_points and the number of coordinates per point in
+ * point_stride.
+ * Returns a pointer to the coordinates of the first point, or 0 if the
+ * geometry is invalid. */
+static double *get_line_string_points(const Geopackage_Binary_Header *geom_header,
+									  int geom_size, int *num_points,
+									  int *point_stride)
+{
+	/* Parse geometry headers and validate the geometry headers.
+	 * This includes the Geopackage binary header
+	 * https://docs.ogc.org/is/12-128r17/12-128r17.html#gpb_format
+	 * and the well known binary header
+	 * https://portal.ogc.org/files/?artifact_id=25355 */
+
+	if ((geom_size -= sizeof(Geopackage_Binary_Header)) < 0)
+	{
+		return 0;
+	}
+
+	int envelope_indicator = (geom_header->flags >> 1) & 7;
+
+	if (envelope_indicator > 4)
+	{
+		return 0;
+	}
+
+	static int envelope_sizes[] = {0, 32, 48, 48, 64};
+
+	int envelope_size = envelope_sizes[envelope_indicator];
+
+	if ((geom_size -= envelope_size + sizeof(Wkb_Line_String_Any)) < 0)
+	{
+		return 0;
+	}
+
+	Wkb_Line_String_Any *line_string =
+		(Wkb_Line_String_Any *)(geom_header->envelope + envelope_size);
+
+	if (line_string->byte_order != 1)
+	{
+		return 0;
+	}
+
+	switch (line_string->type)
+	{
+	case 2: /* wkbLineString */
+		*point_stride = 2;
+		break;
+
+	case 1002: /* wkbLineStringZ */
+	case 2002: /* wkbLineStringM */
+		*point_stride = 3;
+		break;
+
+	case 3002: /* wkbLineStringZM */
+		*point_stride = 4;
+		break;
+
+	default:
+		return 0;
+	}
+
+	if ((geom_size -= line_string->num_points * *point_stride * sizeof(double)) <
+		0)
+	{
+		return 0;
+	}
+
+	*num_points = line_string->num_points;
+
+	return line_string->points;
+}
+
+/* Rounds the num_points points of point_stride coordinates at points to
+ * integers and pushes them to output as x and y, leaving out consecutive
+ * duplicates. If reverse_node_order is nonzero the points are pushed in
+ * reverse. If snap_grid is not 0, the endpoints are moved onto the nearest
+ * node in it within the snapping distance.
+ * Returns the number of points pushed. */
+static int round_points(Growable_Buffer *output, const double *points,
+						int num_points, int point_stride,
+						int reverse_node_order, const Node_Grid *snap_grid,
+						Dr2osm_Converter *converter)
+{
+	int prev_x = INT_MIN;
+	int prev_y = INT_MIN;
+	int result = 0;
+
+	const double *p = points;
+
+	if (reverse_node_order)
+	{
+		p += (num_points - 1) * point_stride;
+		point_stride = -point_stride;
+	}
+
+	for (int i = 0; i < num_points; i++)
+	{
+		int x = (int)(p[0] + 0.5);
+		int y = (int)(p[1] + 0.5);
+
+		p += point_stride;
+
+		if (snap_grid && (i == 0 || i == num_points - 1))
+		{
+			const Grid_Node *nearest = find_nearest_node(
+				snap_grid, x, y, converter->options.snap_iceroads);
+
+			converter->num_iceroad_endpoints++;
+
+			if (nearest)
+			{
+				x = nearest->x;
+				y = nearest->y;
+				converter->num_snapped_endpoints++;
+			}
+		}
+
+		if (x == prev_x && y == prev_y)
+		{
+			continue;
+		}
+
+		prev_x = x;
+		prev_y = y;
+
+		buffer_push_int(output, x);
+		buffer_push_int(output, y);
+		result++;
+	}
+
+	return result;
+}
+
+/* Returns the ID of the node ref of the node index, giving it the next ID if
+ * it has none yet. */
+static int resolve_node_id(Dr2osm_Converter *converter, uint32_t ref)
+{
+	Node *node = get_node(&converter->node_index, ref);
+
+	if (!node->id)
+	{
+		node->id = generate_id(converter);
+		order_node(&converter->node_index, ref);
+	}
+
+	return node->id;
+}
+
+/* Buffers into the way buffer the first part of the data for a single way,
+ * i.e. the way ID followed by a zero-terminated list of associated node IDs,
+ * for the num_points points at points. */
+static void buffer_way_ids(Dr2osm_Converter *converter, const int *points,
+						   int num_points)
+{
+	/* If a node with identical coordinates has been encountered before,
+	 * buffer the ID of the previously seen node with the way data. Otherwise
+	 * generate a new node ID. When deduplicating externally, the IDs are only
+	 * filled in by resolve_node_file. */
+
+	int external = !!converter->node_occurrences.buffer;
+	int *way_id = buffer_push_int(&converter->way_buffer, 0);
+
+	TRACE_BEGIN(node_upsert);
+
+	for (int i = 0; i < num_points; i++)
+	{
+		int x = points[2 * i];
+		int y = points[2 * i + 1];
+
+		if (external)
+		{
+			int *node_id = buffer_push_int(&converter->way_buffer, -1);
+
+			Node_Occurrence occurrence;
+			occurrence.x = x;
+			occurrence.y = y;
+			occurrence.offset = (char *)node_id - converter->way_buffer.start;
+
+			sorter_push(&converter->node_occurrences, &occurrence);
+			continue;
+		}
+
+		uint32_t ref = node_upsert(&converter->node_index,
+								   &converter->node_cache, x, y);
+
+		buffer_push_int(&converter->way_buffer, resolve_node_id(converter, ref));
+	}
+
+	TRACE_END(node_upsert);
+
+	buffer_push_int(&converter->way_buffer, 0);
+
+	if (!external)
+	{
+		*way_id = generate_id(converter);
+	}
+}
+
+/* Buffers into the way buffer the IDs of a way whose nodes a reader has
+ * already inserted into the node index, given as the num_points node
+ * references at refs, like buffer_way_ids does. */
+static void buffer_way_refs(Dr2osm_Converter *converter, const uint32_t *refs,
+							int num_points)
+{
+	int *way_id = buffer_push_int(&converter->way_buffer, 0);
+
+	for (int i = 0; i < num_points; i++)
+	{
+		buffer_push_int(&converter->way_buffer,
+						resolve_node_id(converter, refs[i]));
+	}
+
+	buffer_push_int(&converter->way_buffer, 0);
+	*way_id = generate_id(converter);
+}
+
+/* Buffers the IDs of the way with the num_points points of point_stride
+ * coordinates at points, see round_points and buffer_way_ids. */
+static void buffer_ids(const double *points, int num_points, int point_stride,
+					   int reverse_node_order, const Node_Grid *snap_grid,
+					   Query_Context *context)
+{
+	TRACE_BEGIN(buffer_ids);
+
+	Dr2osm_Converter *converter = context->converter;
+	Growable_Buffer *point_buffer = &converter->point_buffer;
+
+	point_buffer->next_in_offset = 0;
+	num_points = round_points(point_buffer, points, num_points, point_stride,
+							  reverse_node_order, snap_grid, converter);
+	buffer_way_ids(converter, (int *)point_buffer->start, num_points);
+
+	TRACE_END(buffer_ids);
+}
+
+/* Buffers the attributes of a way after its IDs. The attributes are buffered
+ * as they appear in the source data and only turned into tags when the way is
+ * popped, so that buffered ways can be tagged with different options. */
+static void buffer_attributes(Growable_Buffer *way_buffer,
+							  const Way_Attributes *attributes)
+{
+	buffer_push_int(way_buffer, attributes->source);
+	buffer_push_int(way_buffer, attributes->class);
+	buffer_push_int(way_buffer, attributes->type);
+	buffer_push_int(way_buffer, attributes->direction);
+	buffer_push_int(way_buffer, attributes->speed_limit);
+	buffer_push_int(way_buffer, attributes->height_cm);
+	buffer_push_int(way_buffer, attributes->weight_kg);
+	buffer_push_int(way_buffer, attributes->municipality);
+	buffer_push_string(way_buffer, attributes->name);
+}
+
+/* Pops the attributes of a way buffered with buffer_attributes. */
+static void pop_attributes(Growable_Buffer *way_buffer,
+						   Way_Attributes *attributes)
+{
+	attributes->source = buffer_pop_int(way_buffer);
+	attributes->class = buffer_pop_int(way_buffer);
+	attributes->type = buffer_pop_int(way_buffer);
+	attributes->direction = buffer_pop_int(way_buffer);
+	attributes->speed_limit = buffer_pop_int(way_buffer);
+	attributes->height_cm = buffer_pop_int(way_buffer);
+	attributes->weight_kg = buffer_pop_int(way_buffer);
+	attributes->municipality = buffer_pop_int(way_buffer);
+	attributes->name = buffer_pop_string(way_buffer);
+}
+
+/* Pushes the way with the num_points points of point_stride coordinates at
+ * points and attributes to the buffer of the reader of context as a parsed
+ * way, see Input_Reader, or an invalid way if points is 0. The points are
+ * inserted into the node index right away, and replay_parsed_ways gives the
+ * new nodes their IDs later. If the nodes are deduplicated externally, the
+ * points are kept as they are instead. A Way_Function.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+static int buffer_parsed_way(const double *points, int num_points,
+							 int point_stride, int reverse_node_order,
+							 const Way_Attributes *attributes,
+							 Query_Context *context)
+{
+	Growable_Buffer *ways = &context->reader->ways;
+
+	memcpy(buffer_push(ways, sizeof(int64_t)), &context->rowid,
+		   sizeof(int64_t));
+
+	if (!points)
+	{
+		buffer_push_int(ways, -1);
+		context->reader->complete_offset = ways->next_in_offset;
+		return 0;
+	}
+
+	int *num_rounded = buffer_push_int(ways, 0);
+	Dr2osm_Converter *converter = context->converter;
+	int *rounded_points = (int *)(ways->start + ways->next_in_offset);
+
+	*num_rounded = round_points(ways, points, num_points, point_stride,
+								reverse_node_order, 0, converter);
+
+	/* Replace the points with their node references in place, which frees
+	 * the second half of them. */
+	if (!converter->node_occurrences.buffer)
+	{
+		uint32_t *refs = (uint32_t *)rounded_points;
+
+		TRACE_BEGIN(node_upsert);
+
+		for (int i = 0; i < *num_rounded; i++)
+		{
+			refs[i] = node_upsert_shared(&converter->node_index,
+										 &context->reader->node_cache,
+										 rounded_points[2 * i],
+										 rounded_points[2 * i + 1],
+										 &context->reader->out_of_memory);
+		}
+
+		TRACE_END(node_upsert);
+
+		ways->next_in_offset -= *num_rounded * sizeof(int);
+	}
+
+	buffer_attributes(ways, attributes);
+	context->reader->complete_offset = ways->next_in_offset;
+
+	return 1;
+}
+
+/* Reads the geometry of a row of the Digiroad query into geom_header and
+ * geom_size, its attributes into attributes and its attribute ranges into
+ * ranges. The ranged attributes in attributes are left for the stretches.
+ * Returns the number of joined rows the row was grouped from. */
+static int read_digiroad_row(sqlite3_stmt *statement,
+							 const Geopackage_Binary_Header **geom_header,
+							 int *geom_size, Way_Attributes *attributes,
+							 Link_Ranges *ranges)
+{
+	assert(!strcmp(sqlite3_column_name(statement, 0), "geom"));
+	assert(!strcmp(sqlite3_column_name(statement, 1), "speed_limits"));
+	assert(!strcmp(sqlite3_column_name(statement, 2), "class"));
+	assert(!strcmp(sqlite3_column_name(statement, 3), "type"));
+	assert(!strcmp(sqlite3_column_name(statement, 4), "direction"));
+	assert(!strcmp(sqlite3_column_name(statement, 5), "name"));
+	assert(!strcmp(sqlite3_column_name(statement, 6), "heights_cm"));
+	assert(!strcmp(sqlite3_column_name(statement, 7), "weights_kg"));
+	assert(!strcmp(sqlite3_column_name(statement, 8), "municipality"));
+	assert(!strcmp(sqlite3_column_name(statement, 9), "num_rows"));
+	assert(!strcmp(sqlite3_column_name(statement, 10), "source_rowid"));
+
+	assert(sqlite3_column_type(statement, 0) == SQLITE_BLOB);
+	assert(sqlite3_column_type(statement, 1) == SQLITE_TEXT);
+	assert(sqlite3_column_type(statement, 2) == SQLITE_INTEGER);
+	assert(sqlite3_column_type(statement, 3) == SQLITE_INTEGER);
+	assert(sqlite3_column_type(statement, 4) == SQLITE_INTEGER);
+	assert(sqlite3_column_type(statement, 5) == SQLITE_TEXT);
+	assert(sqlite3_column_type(statement, 6) == SQLITE_TEXT);
+	assert(sqlite3_column_type(statement, 7) == SQLITE_TEXT);
+	assert(sqlite3_column_type(statement, 8) == SQLITE_INTEGER);
+	assert(sqlite3_column_type(statement, 9) == SQLITE_INTEGER);
+
+	*geom_header = sqlite3_column_blob(statement, 0);
+	*geom_size = sqlite3_column_bytes(statement, 0);
+
+	attributes->source = WAY_SOURCE_DIGIROAD;
+	attributes->speed_limit = 0;
+	attributes->class = sqlite3_column_int(statement, 2);
+	attributes->type = sqlite3_column_int(statement, 3);
+	attributes->direction = sqlite3_column_int(statement, 4);
+	attributes->name = sqlite3_column_text(statement, 5);
+	attributes->height_cm = 0;
+	attributes->weight_kg = 0;
+	attributes->municipality = sqlite3_column_int(statement, 8);
+
+	ranges->num_ranges[RANGED_SPEED_LIMIT] = parse_attribute_ranges(
+		sqlite3_column_text(statement, 1),
+		ranges->ranges[RANGED_SPEED_LIMIT]);
+	ranges->num_ranges[RANGED_HEIGHT] = parse_attribute_ranges(
+		sqlite3_column_text(statement, 6), ranges->ranges[RANGED_HEIGHT]);
+	ranges->num_ranges[RANGED_WEIGHT] = parse_attribute_ranges(
+		sqlite3_column_text(statement, 7), ranges->ranges[RANGED_WEIGHT]);
+
+	return sqlite3_column_int(statement, 9);
+}
+
+/* Reads a row of the Digiroad query, splits its link into stretches with
+ * split_link and passes each of them to way_function as a way of its own. A
+ * link along which nothing changes is passed on whole.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+static int split_digiroad_row(sqlite3_stmt *statement,
+							  Way_Function *way_function,
+							  Query_Context *context)
+{
+	const Geopackage_Binary_Header *geom_header;
+	int geom_size;
+	Way_Attributes attributes;
+	Link_Ranges ranges;
+
+	context->num_duplicate_rows += read_digiroad_row(
+		statement, &geom_header, &geom_size, &attributes, &ranges) - 1;
+
+	int reverse_node_order = (attributes.direction == 3);
+	int num_points, point_stride;
+	const double *points = get_line_string_points(geom_header, geom_size,
+												  &num_points, &point_stride);
+
+	if (!points)
+	{
+		return way_function(0, 0, 0, reverse_node_order, &attributes, context);
+	}
+
+	Link_Stretch stretches[MAX_LINK_STRETCHES];
+	int num_stretches = split_link(
+		get_line_string_length(points, num_points, point_stride), &ranges,
+		stretches);
+	Growable_Buffer *stretch_points = context->reader
+										  ? &context->reader->stretch_points
+										  : &context->converter->stretch_points;
+
+	for (int i = 0; i < num_stretches; i++)
+	{
+		attributes.speed_limit = stretches[i].values[RANGED_SPEED_LIMIT];
+		attributes.height_cm = stretches[i].values[RANGED_HEIGHT];
+		attributes.weight_kg = stretches[i].values[RANGED_WEIGHT];
+
+		if (num_stretches == 1)
+		{
+			way_function(points, num_points, point_stride, reverse_node_order,
+						 &attributes, context);
+			break;
+		}
+
+		stretch_points->next_in_offset = 0;
+
+		double *cut_points =
+			buffer_push(stretch_points, (num_points + 2) * 2 * sizeof(double));
+		int num_cut_points =
+			cut_line_string(points, num_points, point_stride,
+							stretches[i].start, stretches[i].end, cut_points);
+
+		way_function(cut_points, num_cut_points, 2, reverse_node_order,
+					 &attributes, context);
+	}
+
+	/* run_query counts the row as one way. */
+	context->num_valid += num_stretches - 1;
+
+	return 1;
+}
+
+/* Buffers the IDs and attributes of a way of the Digiroad query in the way
+ * buffer. A Way_Function.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+static int buffer_digiroad_way(const double *points, int num_points,
+							   int point_stride, int reverse_node_order,
+							   const Way_Attributes *attributes,
+							   Query_Context *context)
+{
+	if (!points)
+	{
+		return 0;
+	}
+
+	buffer_ids(points, num_points, point_stride, reverse_node_order, 0,
+			   context);
+	buffer_attributes(&context->converter->way_buffer, attributes);
+
+	return 1;
+}
+
+/* Callback function passed to run_query to handle the rows of the Digiroad
+ * query.
+ * Returns nonzero on valid row, 0 on invalid row. */
+static int digiroad_row(sqlite3_stmt *statement, Query_Context *context)
+{
+	/* The format of a single way in the way buffer:
+	 *
+	 * int way_id
+	 * int... node_ids
+	 * int node_ids_terminator = 0
+	 * int source
+	 * int class
+	 * int type
+	 * int direction
+	 * int speed_limit
+	 * int height_cm
+	 * int weight_kg
+	 * int municipality
+	 * string name
+	 *
+	 * way_id corresponds to the <way> tag's id attribute. Each element
+	 * of node_ids corresponds to the ref attribute of a distinct <nd> tag
+	 * within the way element. source is one of the WAY_SOURCE_ constants
+	 * and tells how the rest of the attributes, which are copied from the
+	 * row, are to be interpreted by tag_way. */
+
+	return split_digiroad_row(
+		statement, context->reader ? buffer_parsed_way : buffer_digiroad_way,
+		context);
+}
+
+/* Reads the geometry of a row of the ice road query into geom_header and
+ * geom_size and its attributes into attributes. */
+static void read_mml_iceroads_row(sqlite3_stmt *statement,
+								  const Geopackage_Binary_Header **geom_header,
+								  int *geom_size, Way_Attributes *attributes)
+{
+	assert(!strcmp(sqlite3_column_name(statement, 0), "geom"));
+	assert(!strcmp(sqlite3_column_name(statement, 1), "direction"));
+	assert(!strcmp(sqlite3_column_name(statement, 2), "name"));
+	assert(!strcmp(sqlite3_column_name(statement, 3), "source_rowid"));
+
+	assert(sqlite3_column_type(statement, 0) == SQLITE_BLOB);
+	assert(sqlite3_column_type(statement, 1) == SQLITE_INTEGER);
+	assert(sqlite3_column_type(statement, 2) == SQLITE_TEXT);
+
+	*geom_header = sqlite3_column_blob(statement, 0);
+	*geom_size = sqlite3_column_bytes(statement, 0);
+
+	memset(attributes, 0, sizeof(Way_Attributes));
+	attributes->source = WAY_SOURCE_MML_ICEROAD;
+	attributes->direction = sqlite3_column_int(statement, 1);
+	attributes->name = sqlite3_column_text(statement, 2);
+	attributes->speed_limit = ICE_ROAD_SPEED_LIMIT;
+}
+
+/* Callback function passed to run_query to handle the rows of the ice road
+ * query.
+ * Returns nonzero on valid row, 0 on invalid row. */
+static int mml_iceroads_row(sqlite3_stmt *statement, Query_Context *context)
+{
+	const Geopackage_Binary_Header *geom_header;
+	int geom_size;
+	Way_Attributes attributes;
+
+	read_mml_iceroads_row(statement, &geom_header, &geom_size, &attributes);
+
+	int num_points, point_stride;
+	const double *points = get_line_string_points(geom_header, geom_size,
+												  &num_points, &point_stride);
+
+	if (!points)
+	{
+		return 0;
+	}
+
+	int reverse_node_order = (attributes.direction == 2);
+	Dr2osm_Converter *converter = context->converter;
+	const Node_Grid *snap_grid =
+		converter->snap_grid.nodes ? &converter->snap_grid : 0;
+
+	buffer_ids(points, num_points, point_stride, reverse_node_order, snap_grid,
+			   context);
+
+	buffer_attributes(&context->converter->way_buffer, &attributes);
+
+	return 1;
+}
+
+/* Writes a checkpoint of the input processed so far by the query of context,
+ * or of all input if context is 0. The checkpoint is first written to a
+ * temporary file and then moved over the previous checkpoint, so a failure
+ * while writing it leaves the previous checkpoint intact.
+ * Returns nonzero on success, 0 on error. */
+static int write_checkpoint(Dr2osm_Converter *converter,
+							const Query_Context *context)
+{
+	double start_time = get_time();
+
+	if (!write_snapshot(converter, converter->checkpoint_temporary_path,
+						context))
+	{
+		return 0;
+	}
+
+	if (UNICODE_RENAME(converter->checkpoint_temporary_path,
+					   converter->checkpoint_path))
+	{
+		fprintf(stderr,
+				"Unable to replace checkpoint \"" FORMAT_UNICODE_STRING "\".\n",
+				converter->checkpoint_path);
+		return 0;
+	}
+
+	converter->num_checkpoints++;
+	converter->checkpoint_seconds += get_time() - start_time;
+
+	return 1;
+}
+
+/* Makes the ways parsed so far by reader available to replay_parsed_ways.
+ * Returns nonzero to continue, 0 if the reader has been cancelled. */
+static int publish_parsed_ways(Input_Reader *reader)
+{
+	lock_mutex(&reader->mutex);
+
+	reader->published_offset = reader->complete_offset;
+	broadcast_condition(&reader->published);
+
+	int result = !reader->cancelled;
+
+	unlock_mutex(&reader->mutex);
+
+	return result;
+}
+
+/* Writes a checkpoint if checkpoints are enabled and enough time has passed
+ * since the previous one. The interval is stretched if writing checkpoints
+ * takes long, which bounds their overhead.
+ * Returns nonzero on success, 0 on error. */
+static int update_checkpoint(Query_Context *context)
+{
+	Dr2osm_Converter *converter = context->converter;
+
+	if ((!converter->checkpoint_path && !context->reader)
+		|| --context->rows_until_check > 0)
+	{
+		return 1;
+	}
+
+	context->rows_until_check = CHECKPOINT_CHECK_ROWS;
+
+	/* Readers publish their parsed ways at the same points instead, and
+	 * the checkpoints are written while the ways are replayed. */
+	if (context->reader)
+	{
+		return publish_parsed_ways(context->reader);
+	}
+
+	double interval = converter->options.checkpoint_interval
+						  ? converter->options.checkpoint_interval
+						  : DEFAULT_CHECKPOINT_INTERVAL;
+	double time = get_time();
+
+	if (!context->next_checkpoint_time)
+	{
+		context->next_checkpoint_time = time + interval;
+	}
+
+	if (time < context->next_checkpoint_time)
+	{
+		return 1;
+	}
+
+	if (!write_checkpoint(converter, context))
+	{
+		return 0;
+	}
+
+	double end_time = get_time();
+	double write_time = end_time - time;
+
+	if (interval < write_time * (CHECKPOINT_MAX_OVERHEAD - 1))
+	{
+		interval = write_time * (CHECKPOINT_MAX_OVERHEAD - 1);
+	}
+
+	context->next_checkpoint_time = end_time + interval;
+
+	return 1;
+}
+
+/* Steps statement until completion and passes it to callback together with
+ * context for each row returned. The last column of the rows is the rowid of
+ * the source row, which the rows are ordered by.
+ * Returns nonzero on success, 0 on error. */
+static int run_query(sqlite3_stmt *statement, Row_Function *callback,
+					 Query_Context *context)
+{
+	int rowid_column = sqlite3_column_count(statement) - 1;
+	int result = 1;
+	int rc;
+
+	TRACE_BEGIN(run_query);
+
+	do
+	{
+		rc = sqlite3_step(statement);
+
+		assert(rc != SQLITE_MISUSE);
+
+		switch (rc)
+		{
+		case SQLITE_DONE:
+		case SQLITE_BUSY:
+			break;
+
+		case SQLITE_ROW:
+		{
+			int64_t rowid = sqlite3_column_int64(statement, rowid_column);
+
+			/* Checkpoints are only written between source rows, as a source
+			 * row can be split into several ways. */
+			if (rowid != context->rowid)
+			{
+				if (!update_checkpoint(context))
+				{
+					result = 0;
+					break;
+				}
+
+				context->rowid = rowid;
+			}
+
+			TRACE_BEGIN(row);
+
+			int valid = callback(statement, context);
+
+			TRACE_END(row);
+
+			if (valid)
+			{
+				context->num_valid++;
+			}
+			else
+			{
+				context->num_invalid++;
+			}
+
+			if (context->failed)
+			{
+				result = 0;
+			}
+
+			break;
+		}
+
+		default:
+			fprintf(stderr, "sqlite3_step: %s\n%s\n%s\n", sqlite3_errstr(rc),
+					sqlite3_sql(statement),
+					sqlite3_errmsg(sqlite3_db_handle(statement)));
+			result = 0;
+		}
+	} while (result && rc != SQLITE_DONE);
+
+	TRACE_END(run_query);
+
+	return result;
+}
+
+/* Prepares sql in db and runs it with callback, starting after the source
+ * row context->rowid.
+ * Returns nonzero on success, 0 on error. */
+static int run_input(sqlite3 *db, char *sql, Row_Function *callback,
+					 Query_Context *context)
+{
+	sqlite3_stmt *statement = prepare_statement(db, sql);
+
+	if (!statement)
+	{
+		return 0;
+	}
+
+	sqlite3_bind_int64(statement, 1, context->rowid);
+
+	int result = run_query(statement, callback, context);
+
+	sqlite3_finalize(statement);
+
+	return result;
+}
+
+/* Thread function of an Input_Reader, which runs the Digiroad query and
+ * publishes all of its parsed ways. */
+static void read_input(void *argument)
+{
+	Input_Reader *reader = argument;
+
+	/* Running out of memory leaves result at 0 and the way being pushed
+	 * unpublished. */
+	if (!setjmp(reader->out_of_memory))
+	{
+		reader->result = run_input(reader->db, input_sql_query, digiroad_row,
+								   &reader->context);
+	}
+
+	lock_mutex(&reader->mutex);
+
+	reader->published_offset = reader->complete_offset;
+	reader->done = 1;
+	broadcast_condition(&reader->published);
+
+	unlock_mutex(&reader->mutex);
+}
+
+/* Cancels and waits for the readers of converter and frees them. */
+static void stop_readers(Dr2osm_Converter *converter)
+{
+	for (int i = 0; i < converter->num_readers; i++)
+	{
+		Input_Reader *reader = &converter->readers[i];
+
+		lock_mutex(&reader->mutex);
+		reader->cancelled = 1;
+		unlock_mutex(&reader->mutex);
+
+		if (reader->started)
+		{
+			join_thread(&reader->thread);
+		}
+
+		converter->node_cache.num_lookups += reader->node_cache.num_lookups;
+		converter->node_cache.num_hits += reader->node_cache.num_hits;
+
+		destroy_mutex(&reader->mutex);
+		destroy_condition(&reader->published);
+		free_buffer(&reader->ways);
+		free_buffer(&reader->stretch_points);
+	}
+
+	free(converter->readers);
+	converter->readers = 0;
+	converter->num_readers = 0;
+}
+
+/* Starts a reader for each of the Digiroad inputs of converter from
+ * context->input on, the first of which continues after the source row
+ * context->rowid.
+ * Returns nonzero on success, 0 on error. */
+static int start_readers(Dr2osm_Converter *converter,
+						 const Query_Context *context)
+{
+	int num_readers = converter->num_inputs - context->input;
+
+	converter->readers = calloc(num_readers, sizeof(Input_Reader));
+
+	if (!converter->readers)
+	{
+		fprintf(stderr, "Unable to allocate input readers: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	for (int i = 0; i < num_readers; i++)
+	{
+		Input_Reader *reader = &converter->readers[i];
+
+		if (!init_buffer(&reader->ways, (intptr_t)40 * 1024 * 1024 * 1024,
+						 &reader->out_of_memory)
+			|| !init_buffer(&reader->stretch_points, (intptr_t)1 << 30,
+							&reader->out_of_memory))
+		{
+			return 0;
+		}
+
+		init_node_cache(&reader->node_cache);
+		init_mutex(&reader->mutex);
+		init_condition(&reader->published);
+		converter->num_readers++;
+
+		reader->db = converter->digiroad_dbs[context->input + i];
+		reader->context.converter = converter;
+		reader->context.stage = SNAPSHOT_STAGE_DIGIROAD;
+		reader->context.input = context->input + i;
+		reader->context.rowid = i ? 0 : context->rowid;
+		reader->context.reader = reader;
+
+		reader->started = start_thread(&reader->thread, read_input, reader);
+
+		if (!reader->started)
+		{
+			fprintf(stderr, "Unable to start input reader thread.\n");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Deduplicates the nodes of the ways parsed by reader and buffers the ways in
+ * the way buffer as they are published, writing checkpoints between source
+ * rows as run_query does.
+ * Returns nonzero on success, 0 on error. */
+static int replay_parsed_ways(Input_Reader *reader, Query_Context *context)
+{
+	Dr2osm_Converter *converter = context->converter;
+	intptr_t offset = 0;
+
+	while (1)
+	{
+		lock_mutex(&reader->mutex);
+
+		while (!reader->done && reader->published_offset == offset)
+		{
+			wait_condition(&reader->published, &reader->mutex);
+		}
+
+		intptr_t end_offset = reader->published_offset;
+		int done = reader->done;
+
+		unlock_mutex(&reader->mutex);
+
+		/* Only the published part of the reader's buffer is read, through a
+		 * buffer of its own, as the reader keeps pushing to it. */
+		Growable_Buffer ways = {0};
+		ways.start = reader->ways.start;
+		ways.size = reader->ways.size;
+		ways.first_in_offset = offset;
+		ways.next_in_offset = end_offset;
+		ways.commit_threshold_offset = end_offset;
+		ways.out_of_memory = &converter->out_of_memory;
+
+		while (ways.first_in_offset < ways.next_in_offset)
+		{
+			int64_t rowid;
+
+			memcpy(&rowid, buffer_pop(&ways, sizeof(int64_t)), sizeof(int64_t));
+
+			if (rowid != context->rowid)
+			{
+				if (!update_checkpoint(context))
+				{
+					return 0;
+				}
+
+				context->rowid = rowid;
+			}
+
+			int num_points = buffer_pop_int(&ways);
+
+			if (num_points < 0)
+			{
+				context->num_invalid++;
+				continue;
+			}
+
+			Way_Attributes attributes;
+
+			if (converter->node_occurrences.buffer)
+			{
+				const int *points =
+					buffer_pop(&ways, num_points * 2 * sizeof(int));
+
+				pop_attributes(&ways, &attributes);
+				buffer_way_ids(converter, points, num_points);
+			}
+			else
+			{
+				const uint32_t *refs =
+					buffer_pop(&ways, num_points * sizeof(uint32_t));
+
+				pop_attributes(&ways, &attributes);
+				buffer_way_refs(converter, refs, num_points);
+			}
+
+			buffer_attributes(&converter->way_buffer, &attributes);
+			context->num_valid++;
+		}
+
+		offset = end_offset;
+
+		if (done)
+		{
+			return reader->result;
+		}
+	}
+}
+
+/* Runs the Digiroad query on all inputs of converter from context->input on,
+ * reading them concurrently and buffering their ways in input order.
+ * Returns nonzero on success, 0 on error. */
+static int run_inputs(Dr2osm_Converter *converter, Query_Context *context)
+{
+	int result = start_readers(converter, context);
+
+	for (int i = 0; result && i < converter->num_readers; i++)
+	{
+		if (i)
+		{
+			context->input++;
+			context->rowid = 0;
+		}
+
+		/* Once replayed, the reader has finished and its memory is no longer
+		 * needed. */
+		if ((result = replay_parsed_ways(&converter->readers[i], context)))
+		{
+			free_buffer(&converter->readers[i].ways);
+		}
+
+		context->num_duplicate_rows +=
+			converter->readers[i].context.num_duplicate_rows;
+	}
+
+	stop_readers(converter);
+
+	return result;
+}
+
+/* Pops the next way from the way buffer. The attributes of the way are
+ * stored in attributes and its IDs in way, which is not yet tagged. */
+static void pop_way(Growable_Buffer *way_buffer, Dr2osm_Way *way,
+					Way_Attributes *attributes)
+{
+	way->id = buffer_pop_int(way_buffer);
+	way->node_ids = (int *)buffer_pop(way_buffer, 0);
+	way->num_node_ids = 0;
+
+	while (buffer_pop_int(way_buffer))
+	{
+		way->num_node_ids++;
+	}
+
+	pop_attributes(way_buffer, attributes);
+
+	way->num_tags = 0;
+	way->tags = 0;
+}
+
+/* Writes size nodes from chunk to the node file output.
+ * Returns nonzero on success, 0 on error. */
+static int write_node_chunk(FILE *output, const Snapshot_Node *chunk, int size)
+{
+	if (size && fwrite(chunk, size * sizeof(Snapshot_Node), 1, output) != 1)
+	{
+		fprintf(stderr, "Unable to write temporary file: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int compare_coordinates(const void *a, const void *b)
+{
+	const Node_Occurrence *occurrence_a = a;
+	const Node_Occurrence *occurrence_b = b;
+
+	if (occurrence_a->x != occurrence_b->x)
+	{
+		return occurrence_a->x < occurrence_b->x ? -1 : 1;
+	}
+
+	if (occurrence_a->y != occurrence_b->y)
+	{
+		return occurrence_a->y < occurrence_b->y ? -1 : 1;
+	}
+
+	return (occurrence_a->offset > occurrence_b->offset)
+		   - (occurrence_a->offset < occurrence_b->offset);
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+	const Node_Occurrence *occurrence_a = a;
+	const Node_Occurrence *occurrence_b = b;
+
+	return (occurrence_a->offset > occurrence_b->offset)
+		   - (occurrence_a->offset < occurrence_b->offset);
+}
+
+/* Deduplicates the nodes whose occurrences were collected by buffer_ids and
+ * fills in the IDs of the nodes and ways in the way buffer. The IDs come out
+ * the same as with the node index.
+ *
+ * The occurrences are sorted by coordinates, so that the occurrences of each
+ * node are adjacent and the first one in the way buffer comes first. The
+ * other occurrences are pointed to the first one. The first occurrences are
+ * sorted again by their position in the way buffer, which is the order in
+ * which the node index would have created the nodes. A pass over the way
+ * buffer then generates the IDs in the same order as buffer_ids, and writes
+ * the new nodes to the node file in the order of their IDs.
+ * Returns nonzero on success, 0 on error. */
+static int resolve_node_file(Dr2osm_Converter *converter)
+{
+	External_Sorter *occurrences = &converter->node_occurrences;
+	External_Sorter first_occurrences;
+	int64_t memory_limit = converter->options.node_memory_limit / 2;
+
+	if (!finish_sorter(occurrences)
+		|| !init_sorter(&first_occurrences, sizeof(Node_Occurrence),
+						compare_offsets, memory_limit, get_num_threads(converter)))
+	{
+		return 0;
+	}
+
+	Growable_Buffer *way_buffer = &converter->way_buffer;
+	int *slots = (int *)way_buffer->start;
+	const Node_Occurrence *occurrence;
+	Node_Occurrence first = {0};
+	int64_t num_occurrences = 0;
+	int64_t num_nodes = 0;
+
+	/* First occurrences keep -1 in their slot, the others get the index of
+	 * the slot of the first one. */
+	while ((occurrence = sorter_next(occurrences)))
+	{
+		if (num_occurrences++ && occurrence->x == first.x
+			&& occurrence->y == first.y)
+		{
+			assert(first.offset / sizeof(int) < INT_MAX);
+			slots[occurrence->offset / sizeof(int)] =
+				(int)(first.offset / sizeof(int));
+		}
+		else
+		{
+			first = *occurrence;
+			sorter_push(&first_occurrences, &first);
+			num_nodes++;
+		}
+	}
+
+	int result = !occurrences->failed && finish_sorter(&first_occurrences);
+
+	if (converter->options.print_stats)
+	{
+		fprintf(stderr,
+				"Sorted %lld node occurrences in %d runs and %lld nodes in %d "
+				"runs.\n",
+				(long long)num_occurrences, occurrences->num_runs,
+				(long long)num_nodes,
+				first_occurrences.num_runs);
+	}
+
+	free_sorter(occurrences);
+
+	if (result && !(converter->node_file = tmpfile()))
+	{
+		fprintf(stderr, "Unable to create temporary file: %s\n",
+				strerror(errno));
+		result = 0;
+	}
+
+	intptr_t first_in_offset = way_buffer->first_in_offset;
+	Snapshot_Node chunk[4096];
+	int chunk_size = 0;
+
+	for (int i = 0; result && i < converter->num_ways; i++)
+	{
+		Dr2osm_Way way;
+		Way_Attributes attributes;
+
+		pop_way(way_buffer, &way, &attributes);
+
+		int *node_ids = (int *)way.node_ids;
+
+		for (int j = 0; result && j < way.num_node_ids; j++)
+		{
+			if (node_ids[j] >= 0)
+			{
+				node_ids[j] = slots[node_ids[j]];
+				continue;
+			}
+
+			occurrence = sorter_next(&first_occurrences);
+
+			if (!occurrence)
+			{
+				result = 0;
+				break;
+			}
+
+			assert(occurrence->offset == (char *)&node_ids[j] - way_buffer->start);
+
+			node_ids[j] = generate_id(converter);
+
+			chunk[chunk_size].x = occurrence->x;
+			chunk[chunk_size].y = occurrence->y;
+			chunk[chunk_size].id = node_ids[j];
+			converter->num_file_nodes++;
+
+			if (++chunk_size == 4096)
+			{
+				result = write_node_chunk(converter->node_file, chunk,
+										  chunk_size);
+				chunk_size = 0;
+			}
+		}
+
+		/* The way ID precedes the node IDs. */
+		node_ids[-1] = generate_id(converter);
+	}
+
+	way_buffer->first_in_offset = first_in_offset;
+
+	result = result && write_node_chunk(converter->node_file, chunk, chunk_size);
+
+	free_sorter(&first_occurrences);
+
+	return result;
+}
+
+/* Classifies a way by the attributes of its source data according to the tag
+ * mapping rules of profile. On return highway, route and oneway hold indices
+ * into osm_strings.
+ * Returns nonzero if the way is included in the output of the profile, 0 if
+ * the profile drops it. */
+static int classify_way(const Way_Attributes *attributes,
+						Dr2osm_Profile profile, int *highway, int *route,
+						int *oneway)
+{
+	int class = attributes->class;
+	int type = attributes->type;
+
+	*highway = HW_NONE;
+	*route = RT_NONE;
+	*oneway = OW_NONE;
+
+	if (attributes->source == WAY_SOURCE_MML_ICEROAD)
+	{
+		*highway = HW_UNCLASSIFIED;
+
+		switch (attributes->direction)
+		{
+		case 0:
+			*oneway = OW_NO;
+			break;
+
+		case 1:
+		case 2:
+			*oneway = OW_YES;
+			break;
+
+		default:
+			break;
+		}
+	}
+	else
+	{
+		if (type == 8 || type == 9 || class == 8)
+		{
+			*highway = HW_FOOTWAY;
+		}
+		else if (type != 21)
+		{
+			switch (class)
+			{
+			case 1:
+				*highway = HW_MOTORWAY;
+				break;
+
+			case 2:
+				*highway = HW_TRUNK;
+				break;
+
+			case 3:
+				*highway = HW_PRIMARY;
+				break;
+
+			case 4:
+				*highway = HW_SECONDARY;
+				break;
+
+			case 5:
+				*highway = HW_TERTIARY;
+				break;
+
+			default:
+				*highway = HW_RESIDENTIAL;
+				break;
+			}
+		}
+
+		if (type == 21 && class != 8)
+		{
+			*route = RT_FERRY;
+		}
+
+		switch (attributes->direction)
+		{
+		case 2:
+			*oneway = OW_NO;
+			break;
+
+		case 3:
+		case 4:
+			*oneway = OW_YES;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	switch (profile)
+	{
+	case DR2OSM_PROFILE_CAR:
+		/* Pedestrian and bicycle paths are not routable by car. */
+		return *highway != HW_FOOTWAY;
+
+	case DR2OSM_PROFILE_BICYCLE:
+		/* Digiroad does not separate footways from combined footways and
+		 * cycleways, so all of them are made available for cycling. */
+		if (*highway == HW_FOOTWAY)
+		{
+			*highway = HW_CYCLEWAY;
+		}
+
+		return *highway != HW_MOTORWAY;
+
+	case DR2OSM_PROFILE_FOOT:
+		return *highway != HW_MOTORWAY && *highway != HW_TRUNK;
+
+	default:
+		return 1;
+	}
+}
+
+/* Turns the attributes of a way into the OSM tags of way according to
+ * options and the tag mapping rules of profile. The tag array and the
+ * strings the tags point to are stored in storage.
+ * Returns nonzero if the way is included in the output of the profile, 0 if
+ * the profile drops it, in which case way is left untagged. */
+static int tag_way(const Way_Attributes *attributes,
+				   const Dr2osm_Options *options, Dr2osm_Profile profile,
+				   Dr2osm_Way *way, Way_Tag_Storage *storage)
+{
+	int highway, route, oneway;
+	int speed_limit = attributes->speed_limit;
+
+	if (!classify_way(attributes, profile, &highway, &route, &oneway))
+	{
+		return 0;
+	}
+
+	if (options->default_speed_limits && !speed_limit)
+	{
+		switch (highway)
+		{
+		case HW_MOTORWAY:
+			speed_limit = 80;
+			break;
+
+		case HW_TRUNK:
+			speed_limit = 70;
+			break;
+
+		case HW_PRIMARY:
+			speed_limit = 60;
+			break;
+
+		case HW_SECONDARY:
+			speed_limit = 50;
+			break;
+
+		case HW_TERTIARY:
+			speed_limit = 40;
+			break;
+
+		case HW_UNCLASSIFIED:
+		case HW_RESIDENTIAL:
+			speed_limit = 30;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	Dr2osm_Tag *tag = storage->tags;
+
+	snprintf(storage->maxspeed, sizeof(storage->maxspeed), "%d", speed_limit);
+
+	*tag++ = (Dr2osm_Tag){"highway", osm_strings[highway]};
+	*tag++ = (Dr2osm_Tag){"route", osm_strings[route]};
+	*tag++ = (Dr2osm_Tag){"oneway", osm_strings[oneway]};
+	*tag++ = (Dr2osm_Tag){"maxspeed", storage->maxspeed};
+	*tag++ = (Dr2osm_Tag){"name", attributes->name};
+
+	if (attributes->height_cm > 0)
+	{
+		snprintf(storage->maxheight, sizeof(storage->maxheight), "%.1f",
+				 attributes->height_cm / 100.0);
+		*tag++ = (Dr2osm_Tag){"maxheight", storage->maxheight};
+	}
+
+	if (attributes->weight_kg > 0)
+	{
+		snprintf(storage->maxweight, sizeof(storage->maxweight), "%.0f",
+				 attributes->weight_kg / 1000.0);
+		*tag++ = (Dr2osm_Tag){"maxweight", storage->maxweight};
+	}
+
+	if (attributes->source == WAY_SOURCE_MML_ICEROAD)
+	{
+		*tag++ = (Dr2osm_Tag){osm_strings[AT_ICE_ROAD], "yes"};
+	}
+
+	assert(tag <= storage->tags + MAX_WAY_TAGS);
+
+	way->tags = storage->tags;
+	way->num_tags = (int)(tag - storage->tags);
+
+	return 1;
+}
+
+/* Returns an array indexed by node ID, in which bit i of each element is set
+ * if outputs[i] includes a way referencing the node. The ways are left in the
+ * way buffer.
+ * Returns 0 on error. */
+static uint8_t *mark_referenced_nodes(Dr2osm_Converter *converter,
+									  const Dr2osm_Output *outputs,
+									  int num_outputs)
+{
+	uint8_t *result = calloc((size_t)converter->last_id + 1, 1);
+
+	if (!result)
+	{
+		fprintf(stderr, "Unable to allocate node reference array: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	Growable_Buffer *way_buffer = &converter->way_buffer;
+	intptr_t first_in_offset = way_buffer->first_in_offset;
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		Dr2osm_Way way;
+		Way_Attributes attributes;
+		int highway, route, oneway;
+
+		pop_way(way_buffer, &way, &attributes);
+
+		for (int j = 0; j < num_outputs; j++)
+		{
+			if (classify_way(&attributes, outputs[j].profile, &highway,
+							 &route, &oneway))
+			{
+				for (int k = 0; k < way.num_node_ids; k++)
+				{
+					result[way.node_ids[k]] |= 1 << j;
+				}
+			}
+		}
+	}
+
+	way_buffer->first_in_offset = first_in_offset;
+
+	return result;
+}
+
+/* Projects the node id at x, y to WGS 84 and passes it to the sinks of
+ * outputs. If node_masks is not 0, the node is only passed to the outputs
+ * whose bit is set in its element, see mark_referenced_nodes.
+ * Returns nonzero on success, 0 on error. */
+static int emit_node(Dr2osm_Converter *converter, const Dr2osm_Output *outputs,
+					 int num_outputs, const uint8_t *node_masks, int x, int y,
+					 int id)
+{
+	int mask = node_masks ? node_masks[id] : 0xff;
+
+	if (!mask)
+	{
+		return 1;
+	}
+
+	TRACE_BEGIN(project);
+
+	PJ_COORD fin = proj_coord((double)x, (double)y, 0, 0);
+	PJ_COORD wgs = proj_trans(converter->projection, PJ_FWD, fin);
+
+	TRACE_END(project);
+
+	Dr2osm_Node output_node;
+	output_node.id = id;
+	output_node.lat = wgs.xy.x;
+	output_node.lon = wgs.xy.y;
+
+	for (int i = 0; i < num_outputs; i++)
+	{
+		const Dr2osm_Sink *sink = &outputs[i].sink;
+
+		if ((mask & (1 << i)) && !sink->node(sink->user_data, &output_node))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Passes the nodes in the node file to the sinks of outputs.
+ * Returns nonzero on success, 0 on error. */
+static int emit_file_nodes(Dr2osm_Converter *converter,
+						   const Dr2osm_Output *outputs, int num_outputs,
+						   const uint8_t *node_masks)
+{
+	Snapshot_Node chunk[4096];
+
+	rewind(converter->node_file);
+
+	for (int i = 0; i < converter->num_file_nodes;)
+	{
+		int chunk_size = converter->num_file_nodes - i < 4096
+							 ? converter->num_file_nodes - i
+							 : 4096;
+
+		if (fread(chunk, chunk_size * sizeof(Snapshot_Node), 1,
+				  converter->node_file) != 1)
+		{
+			fprintf(stderr, "Unable to read temporary file: %s\n",
+					strerror(errno));
+			return 0;
+		}
+
+		for (int j = 0; j < chunk_size; j++)
+		{
+			if (!emit_node(converter, outputs, num_outputs, node_masks,
+						   chunk[j].x, chunk[j].y, chunk[j].id))
+			{
+				return 0;
+			}
+		}
+
+		i += chunk_size;
+	}
+
+	return 1;
+}
+
+/* Passes the nodes in the node index to the sinks of outputs in the order of
+ * their IDs.
+ * Returns nonzero on success, 0 on error. */
+static int emit_nodes(Dr2osm_Converter *converter, const Dr2osm_Output *outputs,
+					  int num_outputs, const uint8_t *node_masks)
+{
+	if (converter->node_file)
+	{
+		return emit_file_nodes(converter, outputs, num_outputs, node_masks);
+	}
+
+	Node_Index *index = &converter->node_index;
+
+	for (int i = 0; i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+
+		if (!emit_node(converter, outputs, num_outputs, node_masks, node->x,
+					   node->y, node->id))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Finds the WGS 84 bounding box of the converted nodes, extended by margin
+ * metres, as minimum and maximum latitude and longitude in box. The edges of
+ * the box in the projection of the input are curved in WGS 84, so points
+ * along them are projected.
+ * Returns 0 if there are no converted nodes. */
+static int get_node_box(Dr2osm_Converter *converter, int margin, double box[4])
+{
+	Node_Index *index = &converter->node_index;
+	int min_x = INT_MAX, min_y = INT_MAX;
+	int max_x = INT_MIN, max_y = INT_MIN;
+
+	for (int i = 0; i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+
+		min_x = node->x < min_x ? node->x : min_x;
+		min_y = node->y < min_y ? node->y : min_y;
+		max_x = node->x > max_x ? node->x : max_x;
+		max_y = node->y > max_y ? node->y : max_y;
+	}
+
+	if (min_x > max_x)
+	{
+		return 0;
+	}
+
+	double left = (double)min_x - margin, right = (double)max_x + margin;
+	double bottom = (double)min_y - margin, top = (double)max_y + margin;
+
+	box[0] = 90;
+	box[1] = 180;
+	box[2] = -90;
+	box[3] = -180;
+
+	for (int i = 0; i <= 16; i++)
+	{
+		double x = left + (right - left) * i / 16;
+		double y = bottom + (top - bottom) * i / 16;
+		double edge_points[4][2] = {
+			{x, bottom}, {x, top}, {left, y}, {right, y}};
+
+		for (int j = 0; j < 4; j++)
+		{
+			PJ_COORD fin = proj_coord(edge_points[j][0], edge_points[j][1], 0, 0);
+			PJ_COORD wgs = proj_trans(converter->projection, PJ_FWD, fin);
+
+			box[0] = wgs.xy.x < box[0] ? wgs.xy.x : box[0];
+			box[1] = wgs.xy.y < box[1] ? wgs.xy.y : box[1];
+			box[2] = wgs.xy.x > box[2] ? wgs.xy.x : box[2];
+			box[3] = wgs.xy.y > box[3] ? wgs.xy.y : box[3];
+		}
+	}
+
+	return 1;
+}
+
+/* Passes the nodes of the merged files to the sinks of all outputs in the
+ * order of their original IDs, giving them new IDs after those of the
+ * converted data. Nodes in several files are only output once. If the
+ * snap_merged option is set, the merged nodes at most that many metres from
+ * a converted node are entered into merge_snaps with the nearest one, unless
+ * node_masks, as in emit_node, drops it from some output.
+ * Returns nonzero on success, 0 on error. */
+static int emit_merged_nodes(Dr2osm_Converter *converter,
+							 const Dr2osm_Output *outputs, int num_outputs,
+							 const uint8_t *node_masks)
+{
+	if (!converter->num_merge_inputs)
+	{
+		return 1;
+	}
+
+	if (!init_buffer(&converter->merged_node_ids, sizeof(int64_t) << 31,
+					 &converter->out_of_memory)
+		|| !init_buffer(&converter->merge_snaps, sizeof(Merge_Snap) << 28,
+						&converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	/* Only nodes inside the box around the converted nodes are projected
+	 * to look for a node to snap to. */
+	int snap_distance = converter->options.snap_merged;
+	int all_outputs = (1 << num_outputs) - 1;
+	Node_Grid grid = {0};
+	double box[4] = {0};
+
+	if (snap_distance
+		&& (!get_node_box(converter, snap_distance + 1000, box)
+			|| !build_node_grid(&grid, &converter->node_index, snap_distance)))
+	{
+		snap_distance = 0;
+	}
+
+	int result = 1;
+
+	for (int i = 0; result && i < converter->num_merge_inputs; i++)
+	{
+		result = pbf_start(&converter->merge_readers[i], 0);
+	}
+
+	int64_t previous_id = INT64_MIN;
+	converter->first_merged_id = converter->last_id + 1;
+
+	while (result)
+	{
+		Pbf_Reader *next = 0;
+
+		for (int i = 0; i < converter->num_merge_inputs; i++)
+		{
+			Pbf_Reader *reader = &converter->merge_readers[i];
+
+			if (!reader->at_end
+				&& (!next
+					|| reader->nodes[reader->current].id
+						   < next->nodes[next->current].id))
+			{
+				next = reader;
+			}
+		}
+
+		if (!next)
+		{
+			break;
+		}
+
+		const Pbf_Node *node = &next->nodes[next->current];
+
+		if (node->id != previous_id)
+		{
+			previous_id = node->id;
+			*(int64_t *)buffer_push(&converter->merged_node_ids,
+									sizeof(int64_t)) = node->id;
+			converter->num_merged_nodes++;
+
+			Dr2osm_Node output_node;
+			output_node.id = generate_id(converter);
+			output_node.lat = node->lat;
+			output_node.lon = node->lon;
+
+			for (int i = 0; result && i < num_outputs; i++)
+			{
+				const Dr2osm_Sink *sink = &outputs[i].sink;
+
+				result = sink->node(sink->user_data, &output_node);
+			}
+
+			if (snap_distance && node->lat >= box[0] && node->lon >= box[1]
+				&& node->lat <= box[2] && node->lon <= box[3])
+			{
+				PJ_COORD wgs = proj_coord(node->lat, node->lon, 0, 0);
+				PJ_COORD fin = proj_trans(converter->projection, PJ_INV, wgs);
+				const Grid_Node *nearest =
+					find_nearest_node(&grid, (int)(fin.xy.x + 0.5),
+									  (int)(fin.xy.y + 0.5), snap_distance);
+
+				if (nearest
+					&& (!node_masks
+						|| (node_masks[nearest->id] & all_outputs)
+							   == all_outputs))
+				{
+					Merge_Snap *snap =
+						buffer_push(&converter->merge_snaps, sizeof(Merge_Snap));
+					snap->id = node->id;
+					snap->node_id = nearest->id;
+				}
+			}
+		}
+
+		result = result && pbf_advance(next);
+	}
+
+	free_node_grid(&grid);
+
+	return result;
+}
+
+/* Returns the new ID of the merged node with the original ID id, or 0 if it
+ * is not in any of the merged files. */
+static int find_merged_node(Dr2osm_Converter *converter, int64_t id)
+{
+	const int64_t *ids = (const int64_t *)converter->merged_node_ids.start;
+	size_t low = 0, high = (size_t)converter->num_merged_nodes;
+
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+
+		if (ids[middle] < id)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low < (size_t)converter->num_merged_nodes && ids[low] == id
+			   ? converter->first_merged_id + (int)low
+			   : 0;
+}
+
+/* Returns the ID of the converted node that way endpoints at the merged node
+ * with the original ID id are snapped to, or 0 if there is none. */
+static int find_merge_snap(Dr2osm_Converter *converter, int64_t id)
+{
+	const Merge_Snap *snaps = (const Merge_Snap *)converter->merge_snaps.start;
+	size_t low = 0;
+	size_t high =
+		(size_t)converter->merge_snaps.next_in_offset / sizeof(Merge_Snap);
+	size_t num_snaps = high;
+
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+
+		if (snaps[middle].id < id)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low < num_snaps && snaps[low].id == id ? snaps[low].node_id : 0;
+}
+
+/* Passes the ways of the merged files to the sinks of all outputs in the
+ * order of their original IDs, with their tags as they are, after
+ * emit_merged_nodes has passed the nodes. Ways in several files are only
+ * output once. References to nodes missing from the files are dropped, and
+ * endpoints are moved onto the converted nodes found by emit_merged_nodes.
+ * Returns nonzero on success, 0 on error. */
+static int emit_merged_ways(Dr2osm_Converter *converter,
+							const Dr2osm_Output *outputs, int num_outputs)
+{
+	if (!converter->num_merge_inputs)
+	{
+		return 1;
+	}
+
+	int result = 1;
+
+	for (int i = 0; result && i < converter->num_merge_inputs; i++)
+	{
+		result = pbf_start(&converter->merge_readers[i], 1);
+	}
+
+	Growable_Buffer *point_buffer = &converter->point_buffer;
+	int64_t previous_id = INT64_MIN;
+
+	while (result)
+	{
+		Pbf_Reader *next = 0;
+
+		for (int i = 0; i < converter->num_merge_inputs; i++)
+		{
+			Pbf_Reader *reader = &converter->merge_readers[i];
+
+			if (!reader->at_end
+				&& (!next
+					|| reader->ways[reader->current].id
+						   < next->ways[next->current].id))
+			{
+				next = reader;
+			}
+		}
+
+		if (!next)
+		{
+			break;
+		}
+
+		const Pbf_Way *pbf_way = &next->ways[next->current];
+
+		if (pbf_way->id != previous_id)
+		{
+			const int64_t *refs = next->refs + pbf_way->first_ref;
+			int num_node_ids = 0;
+			int num_snapped = 0;
+
+			previous_id = pbf_way->id;
+			point_buffer->next_in_offset = 0;
+
+			int *node_ids =
+				buffer_push(point_buffer, pbf_way->num_refs * sizeof(int));
+
+			for (size_t i = 0; i < pbf_way->num_refs; i++)
+			{
+				int node_id = 0;
+
+				if (i == 0 || i == pbf_way->num_refs - 1)
+				{
+					node_id = find_merge_snap(converter, refs[i]);
+					num_snapped += !!node_id;
+				}
+
+				if (!node_id)
+				{
+					node_id = find_merged_node(converter, refs[i]);
+				}
+
+				if (node_id
+					&& (!num_node_ids || node_ids[num_node_ids - 1] != node_id))
+				{
+					node_ids[num_node_ids++] = node_id;
+				}
+			}
+
+			if (num_node_ids >= 2)
+			{
+				Dr2osm_Way way;
+				way.id = generate_id(converter);
+				way.node_ids = node_ids;
+				way.num_node_ids = num_node_ids;
+				way.tags = next->tags + pbf_way->first_tag;
+				way.num_tags = (int)pbf_way->num_tags;
+
+				for (int i = 0; result && i < num_outputs; i++)
+				{
+					const Dr2osm_Sink *sink = &outputs[i].sink;
+
+					result = sink->way(sink->user_data, &way);
+				}
+
+				converter->num_merged_ways++;
+				converter->num_snapped_merge_endpoints += num_snapped;
+			}
+		}
+
+		result = result && pbf_advance(next);
+	}
+
+	if (result && converter->options.print_stats)
+	{
+		fprintf(stderr,
+				"Merged %d nodes and %d ways from %d files, snapping %d way "
+				"endpoints.\n",
+				converter->num_merged_nodes, converter->num_merged_ways,
+				converter->num_merge_inputs,
+				converter->num_snapped_merge_endpoints);
+	}
+
+	return result;
+}
+
+/* Sizing pass of emit_ways_mapped. Computes the total size of the formatted
+ * ways of the job. */
+static void size_ways(void *argument)
+{
+	Way_Fill_Job *job = argument;
+	const Dr2osm_Sink *sink = &job->output->sink;
+
+	/* Each thread pops ways through its own copy of the way buffer. */
+	Growable_Buffer way_buffer = job->converter->way_buffer;
+	Way_Attributes attributes;
+	Way_Tag_Storage storage;
+
+	job->size = 0;
+
+	for (int i = job->first_way; i < job->end_way; i++)
+	{
+		Dr2osm_Way way;
+
+		way_buffer.first_in_offset = job->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		if (tag_way(&attributes, &job->converter->options, job->output->profile,
+					&way, &storage))
+		{
+			job->size += sink->format_way(sink->user_data, &way, 0, 0);
+		}
+	}
+}
+
+/* Fill pass of emit_ways_mapped. Formats the ways of the job into the mapped
+ * output starting at its destination. */
+static void fill_ways(void *argument)
+{
+	Way_Fill_Job *job = argument;
+	const Dr2osm_Sink *sink = &job->output->sink;
+
+	Growable_Buffer way_buffer = job->converter->way_buffer;
+	Way_Attributes attributes;
+	Way_Tag_Storage storage;
+	char *destination = job->destination;
+	char *end = job->destination + job->size;
+
+	for (int i = job->first_way; i < job->end_way; i++)
+	{
+		Dr2osm_Way way;
+
+		way_buffer.first_in_offset = job->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		if (tag_way(&attributes, &job->converter->options, job->output->profile,
+					&way, &storage))
+		{
+			destination += sink->format_way(sink->user_data, &way, destination,
+											end - destination);
+		}
+	}
+
+	assert(destination == end);
+}
+
+/* Returns an array of the offsets of the buffered ways in the way buffer, so
+ * that they can be accessed in parallel.
+ * Returns 0 on error. */
+static intptr_t *index_ways(Dr2osm_Converter *converter)
+{
+	intptr_t *result = malloc((converter->num_ways + 1) * sizeof(intptr_t));
+
+	if (!result)
+	{
+		fprintf(stderr, "Unable to allocate way index: %s\n", strerror(errno));
+		return 0;
+	}
+
+	Growable_Buffer way_buffer = converter->way_buffer;
+	Way_Attributes attributes;
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		Dr2osm_Way way;
+
+		result[i] = way_buffer.first_in_offset;
+		pop_way(&way_buffer, &way, &attributes);
+	}
+
+	return result;
+}
+
+enum
+{
+	EMIT_FAILED,
+	EMIT_DONE,
+	EMIT_NOT_MAPPABLE,
+};
+
+/* Formats the buffered ways for output on several threads directly into a
+ * region of the output mapped with the sink's map_output. The size of each
+ * thread's range of ways is computed first, and a prefix sum over them gives
+ * where in the region each thread writes.
+ * Returns one of the EMIT_ constants. */
+static int emit_ways_mapped(Dr2osm_Converter *converter,
+							const Dr2osm_Output *output,
+							const intptr_t *way_offsets)
+{
+	const Dr2osm_Sink *sink = &output->sink;
+
+	if (!sink->can_map_output(sink->user_data))
+	{
+		return EMIT_NOT_MAPPABLE;
+	}
+
+	Way_Fill_Job jobs[64];
+	int num_jobs = get_num_threads(converter);
+
+	if (num_jobs > converter->num_ways)
+	{
+		num_jobs = converter->num_ways > 0 ? converter->num_ways : 1;
+	}
+
+	for (int i = 0; i < num_jobs; i++)
+	{
+		jobs[i].converter = converter;
+		jobs[i].output = output;
+		jobs[i].way_offsets = way_offsets;
+		jobs[i].first_way = (int)((int64_t)converter->num_ways * i / num_jobs);
+		jobs[i].end_way = (int)((int64_t)converter->num_ways * (i + 1) / num_jobs);
+	}
+
+	run_jobs(size_ways, jobs, num_jobs, sizeof(Way_Fill_Job));
+
+	int64_t total_size = 0;
+
+	for (int i = 0; i < num_jobs; i++)
+	{
+		total_size += jobs[i].size;
+	}
+
+	char *mapping = total_size ? sink->map_output(sink->user_data, total_size) : 0;
+
+	if (!mapping)
+	{
+		return total_size ? EMIT_NOT_MAPPABLE : EMIT_DONE;
+	}
+
+	for (int i = 0; i < num_jobs; i++)
+	{
+		jobs[i].destination = mapping;
+		mapping += jobs[i].size;
+	}
+
+	run_jobs(fill_ways, jobs, num_jobs, sizeof(Way_Fill_Job));
+
+	return sink->unmap_output(sink->user_data) ? EMIT_DONE : EMIT_FAILED;
+}
+
+/* Handles a way of the two-pass mode, see run_two_pass. In the first pass
+ * the nodes of the way are deduplicated and given IDs, and an ID is generated
+ * for the way, exactly like buffer_way_ids does, but nothing is buffered. In
+ * the second pass the IDs of the nodes are looked up in the node index and the
+ * way is tagged and passed to the sinks right away. The way has the
+ * num_points points of point_stride coordinates at points, or an invalid
+ * geometry if points is 0.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+static int stream_way(const double *points, int num_points, int point_stride,
+					  int reverse_node_order, const Node_Grid *snap_grid,
+					  const Way_Attributes *attributes, Query_Context *context)
+{
+	if (!points)
+	{
+		return 0;
+	}
+
+	Dr2osm_Converter *converter = context->converter;
+	Growable_Buffer *point_buffer = &converter->point_buffer;
+
+	point_buffer->next_in_offset = 0;
+	num_points = round_points(point_buffer, points, num_points, point_stride,
+							  reverse_node_order, snap_grid, converter);
+
+	/* The IDs of the nodes follow their points in the point buffer. */
+	const int *rounded_points = (int *)point_buffer->start;
+	int *node_ids = buffer_push(point_buffer, num_points * sizeof(int));
+
+	TRACE_BEGIN(node_upsert);
+
+	for (int i = 0; i < num_points; i++)
+	{
+		uint32_t ref = node_upsert(&converter->node_index,
+								   &converter->node_cache, rounded_points[2 * i],
+								   rounded_points[2 * i + 1]);
+
+		assert(context->pass == TWO_PASS_NODES
+			   || get_node(&converter->node_index, ref)->id);
+		node_ids[i] = resolve_node_id(converter, ref);
+	}
+
+	TRACE_END(node_upsert);
+
+	if (context->pass == TWO_PASS_NODES)
+	{
+		generate_id(converter);
+
+		if (!context->node_masks)
+		{
+			return 1;
+		}
+
+		/* Extend the masks to cover the new IDs. */
+		Growable_Buffer *node_masks = context->node_masks;
+		intptr_t num_new_ids = converter->last_id + 1 - node_masks->next_in_offset;
+
+		memset(buffer_push(node_masks, num_new_ids), 0, num_new_ids);
+
+		int mask = 0;
+		int highway, route, oneway;
+
+		for (int i = 0; i < context->num_outputs; i++)
+		{
+			if (classify_way(attributes, context->outputs[i].profile, &highway,
+							 &route, &oneway))
+			{
+				mask |= 1 << i;
+			}
+		}
+
+		for (int i = 0; i < num_points; i++)
+		{
+			node_masks->start[node_ids[i]] |= mask;
+		}
+
+		return 1;
+	}
+
+	/* The nodes first seen in a way got IDs above those of all earlier ways
+	 * and their nodes, and the way the ID following them. */
+	for (int i = 0; i < num_points; i++)
+	{
+		if (node_ids[i] > context->last_id)
+		{
+			context->last_id = node_ids[i];
+		}
+	}
+
+	Dr2osm_Way way;
+	Way_Tag_Storage storage;
+
+	way.id = ++context->last_id;
+	way.num_node_ids = num_points;
+	way.node_ids = node_ids;
+
+	for (int i = 0; !context->failed && i < context->num_outputs; i++)
+	{
+		const Dr2osm_Sink *sink = &context->outputs[i].sink;
+
+		if (tag_way(attributes, &converter->options, context->outputs[i].profile,
+					&way, &storage)
+			&& !sink->way(sink->user_data, &way))
+		{
+			context->failed = 1;
+		}
+	}
+
+	return 1;
+}
+
+/* Streams a way of the Digiroad query with stream_way. A Way_Function.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+static int stream_digiroad_way(const double *points, int num_points,
+							   int point_stride, int reverse_node_order,
+							   const Way_Attributes *attributes,
+							   Query_Context *context)
+{
+	return stream_way(points, num_points, point_stride, reverse_node_order, 0,
+					  attributes, context);
+}
+
+/* Callback function passed to run_query to handle the rows of the Digiroad
+ * query in the two-pass mode.
+ * Returns nonzero on valid row, 0 on invalid row. */
+static int stream_digiroad_row(sqlite3_stmt *statement, Query_Context *context)
+{
+	return split_digiroad_row(statement, stream_digiroad_way, context);
+}
+
+/* Callback function passed to run_query to handle the rows of the ice road
+ * query in the two-pass mode.
+ * Returns nonzero on valid row, 0 on invalid row. */
+static int stream_mml_iceroads_row(sqlite3_stmt *statement,
+								   Query_Context *context)
+{
+	const Geopackage_Binary_Header *geom_header;
+	int geom_size;
+	Way_Attributes attributes;
+
+	read_mml_iceroads_row(statement, &geom_header, &geom_size, &attributes);
+
+	int num_points, point_stride;
+	const double *points = get_line_string_points(geom_header, geom_size,
+												  &num_points, &point_stride);
+	Dr2osm_Converter *converter = context->converter;
+	const Node_Grid *snap_grid =
+		converter->snap_grid.nodes ? &converter->snap_grid : 0;
+
+	return stream_way(points, num_points, point_stride,
+					  attributes.direction == 2, snap_grid, &attributes,
+					  context);
+}
+
+Dr2osm_Converter *dr2osm_create(void)
+{
+	Dr2osm_Converter *result = calloc(1, sizeof(Dr2osm_Converter));
+
+	if (!result)
+	{
+		fprintf(stderr, "Unable to allocate converter: %s\n", strerror(errno));
+		return 0;
+	}
+
+	result->projection =
+		proj_create_crs_to_crs(0, "EPSG:3067", "EPSG:4326", 0);
+
+	if (!result->projection)
+	{
+		fprintf(stderr, "proj_create_crs_to_crs: %s\n",
+				proj_errno_string(proj_errno(0)));
+		free(result);
+		return 0;
+	}
+
+	return result;
+}
+
+void dr2osm_destroy(Dr2osm_Converter *converter)
+{
+	if (!converter)
+	{
+		return;
+	}
+
+	stop_readers(converter);
+
+	for (int i = 0; i < converter->num_inputs; i++)
+	{
+		sqlite3_close(converter->digiroad_dbs[i]);
+	}
+
+	sqlite3_close(converter->mml_iceroads_db);
+
+	if (converter->snapshot_input)
+	{
+		fclose(converter->snapshot_input);
+	}
+
+	free(converter->snapshot_output_path);
+	free(converter->checkpoint_path);
+	free(converter->checkpoint_temporary_path);
+	proj_destroy(converter->projection);
+	free_buffer(&converter->way_buffer);
+	free_node_index(&converter->node_index);
+	free_buffer(&converter->point_buffer);
+	free_buffer(&converter->stretch_points);
+	free_sorter(&converter->node_occurrences);
+	free_node_grid(&converter->snap_grid);
+
+	if (converter->node_file)
+	{
+		fclose(converter->node_file);
+	}
+
+	for (int i = 0; i < converter->num_merge_inputs; i++)
+	{
+		free_pbf_reader(&converter->merge_readers[i]);
+	}
+
+	free_buffer(&converter->merged_node_ids);
+	free_buffer(&converter->merge_snaps);
+	free(converter);
+}
+
+int dr2osm_open_input(Dr2osm_Converter *converter,
+					  const Unicode_Character *path)
+{
+	while (converter->num_inputs > 0)
+	{
+		sqlite3_close(converter->digiroad_dbs[--converter->num_inputs]);
+	}
+
+	if (converter->snapshot_input)
+	{
+		fclose(converter->snapshot_input);
+		converter->snapshot_input = 0;
+	}
+
+	if (open_snapshot(path, &converter->snapshot_input,
+					  &converter->snapshot_header))
+	{
+		return 1;
+	}
+
+	return dr2osm_add_input(converter, path);
+}
+
+int dr2osm_add_input(Dr2osm_Converter *converter,
+					 const Unicode_Character *path)
+{
+	if (converter->snapshot_input)
+	{
+		fprintf(stderr, "A snapshot cannot be combined with other inputs.\n");
+		return 0;
+	}
+
+	if (converter->num_inputs == DR2OSM_MAX_INPUTS)
+	{
+		fprintf(stderr, "At most %d inputs can be opened.\n",
+				DR2OSM_MAX_INPUTS);
+		return 0;
+	}
+
+	sqlite3 *db = open_database(path);
+
+	if (!db)
+	{
+		return 0;
+	}
+
+	converter->digiroad_dbs[converter->num_inputs++] = db;
+
+	return 1;
+}
+
+int dr2osm_add_merge_input(Dr2osm_Converter *converter,
+						   const Unicode_Character *path)
+{
+	if (converter->num_merge_inputs == DR2OSM_MAX_INPUTS)
+	{
+		fprintf(stderr, "At most %d files can be merged.\n",
+				DR2OSM_MAX_INPUTS);
+		return 0;
+	}
+
+	if (!open_pbf_reader(&converter->merge_readers[converter->num_merge_inputs],
+						 path))
+	{
+		return 0;
+	}
+
+	converter->num_merge_inputs++;
+
+	return 1;
+}
+
+int dr2osm_open_mml_iceroads(Dr2osm_Converter *converter,
+							 const Unicode_Character *path)
+{
+	sqlite3_close(converter->mml_iceroads_db);
+	converter->mml_iceroads_db = open_database(path);
+
+	return !!converter->mml_iceroads_db;
+}
+
+void dr2osm_set_options(Dr2osm_Converter *converter,
+						const Dr2osm_Options *options)
+{
+	converter->options = *options;
+}
+
+/* Returns a newly allocated copy of path with suffix appended to it.
+ * Returns 0 on error. */
+static Unicode_Character *copy_path(const Unicode_Character *path,
+									const char *suffix)
+{
+	size_t path_size = 0;
+	size_t suffix_size = strlen(suffix);
+
+	while (path[path_size])
+	{
+		path_size++;
+	}
+
+	Unicode_Character *result =
+		malloc((path_size + suffix_size + 1) * sizeof(Unicode_Character));
+
+	if (!result)
+	{
+		fprintf(stderr, "Unable to allocate path: %s\n", strerror(errno));
+		return 0;
+	}
+
+	memcpy(result, path, path_size * sizeof(Unicode_Character));
+
+	for (size_t i = 0; i <= suffix_size; i++)
+	{
+		result[path_size + i] = suffix[i];
+	}
+
+	return result;
+}
+
+int dr2osm_set_snapshot_output(Dr2osm_Converter *converter,
+							   const Unicode_Character *path)
+{
+	free(converter->snapshot_output_path);
+	converter->snapshot_output_path = 0;
+
+	if (!path)
+	{
+		return 1;
+	}
+
+	converter->snapshot_output_path = copy_path(path, "");
+
+	return !!converter->snapshot_output_path;
+}
+
+int dr2osm_set_checkpoint(Dr2osm_Converter *converter,
+						  const Unicode_Character *path, int resume)
+{
+	free(converter->checkpoint_path);
+	free(converter->checkpoint_temporary_path);
+	converter->checkpoint_path = 0;
+	converter->checkpoint_temporary_path = 0;
+	converter->resume = 0;
+
+	if (!path)
+	{
+		return 1;
+	}
+
+	converter->checkpoint_path = copy_path(path, "");
+	converter->checkpoint_temporary_path = copy_path(path, ".tmp");
+	converter->resume = resume;
+
+	return converter->checkpoint_path && converter->checkpoint_temporary_path;
+}
+
+/* Prints the hit rate of cache to stderr. */
+static void print_node_cache_stats(const Node_Cache *cache)
+{
+	if (cache->num_lookups)
+	{
+		fprintf(stderr,
+				"The node cache answered %lld of %lld node lookups "
+				"(%.1f%%).\n",
+				(long long)cache->num_hits, (long long)cache->num_lookups,
+				100.0 * cache->num_hits / cache->num_lookups);
+	}
+}
+
+/* Prints to stderr how many rows the attribute joins of the Digiroad query
+ * returned in addition to one per link. */
+static void print_duplicate_row_stats(int64_t num_duplicate_rows)
+{
+	if (num_duplicate_rows)
+	{
+		fprintf(stderr,
+				"Grouped %lld duplicate rows of the attribute joins into "
+				"their links.\n",
+				(long long)num_duplicate_rows);
+	}
+}
+
+/* Checks that converter has an input and sets up its buffers and its node
+ * index for processing it.
+ * Returns nonzero on success, 0 on error. */
+static int init_processing(Dr2osm_Converter *converter)
+{
+	if (!converter->num_inputs && !converter->snapshot_input)
+	{
+		fprintf(stderr, "No input has been opened.\n");
+		return 0;
+	}
+
+	if (!init_buffer(&converter->way_buffer, (intptr_t)40 * 1024 * 1024 * 1024,
+					 &converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	if (!init_node_index(&converter->node_index, &converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	init_node_cache(&converter->node_cache);
+
+	if (!init_buffer(&converter->point_buffer, (intptr_t)1 << 30,
+					 &converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	if (!init_buffer(&converter->stretch_points, (intptr_t)1 << 30,
+					 &converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Processes the opened inputs of converter into its node index and way
+ * buffer, continuing from a checkpoint or a snapshot if there is one. The
+ * caller must have set up the out_of_memory jump of converter.
+ * Returns nonzero on success, 0 on error. */
+static int process_input(Dr2osm_Converter *converter)
+{
+	if (!init_processing(converter))
+	{
+		return 0;
+	}
+
+	if (converter->options.node_memory_limit)
+	{
+		if (converter->snapshot_input || converter->checkpoint_path
+			|| converter->options.snap_iceroads
+			|| (converter->num_merge_inputs && converter->options.snap_merged))
+		{
+			fprintf(stderr,
+					"External node deduplication cannot be combined with "
+					"snapshot input, checkpoints or snapping.\n");
+			return 0;
+		}
+
+		if (!init_sorter(&converter->node_occurrences, sizeof(Node_Occurrence),
+						 compare_coordinates,
+						 converter->options.node_memory_limit / 2,
+						 get_num_threads(converter)))
+		{
+			return 0;
+		}
+	}
+
+	/* Process ways and nodes from the inputs, continuing from a checkpoint or
+	 * a snapshot if there is one. */
+
+	double start_time = get_time();
+	int64_t start_page_faults = get_page_faults();
+
+	Query_Context context = {0};
+	context.converter = converter;
+	context.stage = SNAPSHOT_STAGE_DIGIROAD;
+
+	FILE *checkpoint;
+	Snapshot_Header checkpoint_header;
+	int resumed = converter->resume
+				  && open_snapshot(converter->checkpoint_path, &checkpoint,
+								   &checkpoint_header);
+
+	if (resumed)
+	{
+		int loaded = load_snapshot(converter, checkpoint, &checkpoint_header);
+
+		fclose(checkpoint);
+
+		if (!loaded)
+		{
+			return 0;
+		}
+
+		context.stage = checkpoint_header.stage;
+		context.input = checkpoint_header.input;
+		context.rowid = checkpoint_header.last_rowid;
+		context.num_invalid = checkpoint_header.num_invalid;
+
+		if ((context.stage == SNAPSHOT_STAGE_DIGIROAD
+			 && context.input >= converter->num_inputs)
+			|| (context.stage == SNAPSHOT_STAGE_MML_ICEROADS
+				&& !converter->mml_iceroads_db))
+		{
+			fprintf(stderr, "The checkpoint was written with different inputs.\n");
+			return 0;
+		}
+	}
+	else if (converter->snapshot_input)
+	{
+		if (converter->snapshot_header.stage != SNAPSHOT_STAGE_COMPLETE)
+		{
+			fprintf(stderr,
+					"The snapshot is a checkpoint of an unfinished run, "
+					"which can only be resumed.\n");
+			return 0;
+		}
+
+		if (!load_snapshot(converter, converter->snapshot_input,
+						   &converter->snapshot_header))
+		{
+			return 0;
+		}
+
+		context.stage = SNAPSHOT_STAGE_MML_ICEROADS;
+	}
+
+	if (context.stage == SNAPSHOT_STAGE_DIGIROAD)
+	{
+		/* A single input is processed directly on this thread. */
+		int processed =
+			converter->num_inputs > 1
+				? run_inputs(converter, &context)
+				: run_input(converter->digiroad_dbs[0], input_sql_query,
+							digiroad_row, &context);
+
+		if (!processed)
+		{
+			return 0;
+		}
+
+		context.stage = SNAPSHOT_STAGE_MML_ICEROADS;
+		context.input = 0;
+		context.rowid = 0;
+	}
+
+	double iceroads_start_time = get_time();
+
+	if (context.stage == SNAPSHOT_STAGE_MML_ICEROADS
+		&& converter->mml_iceroads_db)
+	{
+		/* Ice roads are snapped to the nodes of the Digiroad ways only. */
+		if (converter->options.snap_iceroads
+			&& !build_node_grid(&converter->snap_grid, &converter->node_index,
+								converter->options.snap_iceroads))
+		{
+			return 0;
+		}
+
+		if (!run_input(converter->mml_iceroads_db, mml_iceroads_sql_query,
+					   mml_iceroads_row, &context))
+		{
+			return 0;
+		}
+
+		free_node_grid(&converter->snap_grid);
+	}
+
+	double iceroads_seconds = get_time() - iceroads_start_time;
+
+	converter->num_ways += context.num_valid;
+
+	if (converter->node_occurrences.buffer && !resolve_node_file(converter))
+	{
+		return 0;
+	}
+
+	/* The final checkpoint lets a failed run skip straight to the output. */
+	if (converter->checkpoint_path
+		&& !(resumed && checkpoint_header.stage == SNAPSHOT_STAGE_COMPLETE)
+		&& !write_checkpoint(converter, 0))
+	{
+		return 0;
+	}
+
+	if (converter->options.print_stats)
+	{
+		double seconds = get_time() - start_time;
+		int node_index_commits;
+		intptr_t node_index_committed =
+			get_node_index_committed(&converter->node_index,
+									 &node_index_commits);
+
+		fprintf(stderr, "Processed the input in %.2f s.\n", seconds);
+		fprintf(stderr,
+				"Committed %.1f MiB to the way buffer in %d commits and "
+				"%.1f MiB to the node index in %d commits, with %lld page "
+				"faults.\n",
+				converter->way_buffer.commit_threshold_offset / 1048576.0,
+				converter->way_buffer.num_commits,
+				node_index_committed / 1048576.0, node_index_commits,
+				(long long)(get_page_faults() - start_page_faults));
+		print_node_cache_stats(&converter->node_cache);
+		print_duplicate_row_stats(context.num_duplicate_rows);
+
+		if (converter->num_iceroad_endpoints)
+		{
+			fprintf(stderr,
+					"Processed the ice roads in %.3f s, snapping %d of %d "
+					"endpoints.\n",
+					iceroads_seconds, converter->num_snapped_endpoints,
+					converter->num_iceroad_endpoints);
+		}
+
+		if (converter->num_checkpoints)
+		{
+			fprintf(stderr,
+					"Wrote %d checkpoints in %.2f s (%.1f%% of the time).\n",
+					converter->num_checkpoints, converter->checkpoint_seconds,
+					100 * converter->checkpoint_seconds / seconds);
+		}
+	}
+
+	if (context.num_invalid > 0)
+	{
+		fprintf(stderr,
+				"Input contained %d ways with geometries that "
+				"could not be parsed and were skipped.\n",
+				context.num_invalid);
+	}
+
+	return !converter->snapshot_output_path
+		   || write_snapshot(converter, converter->snapshot_output_path, 0);
+}
+
+/* Runs the queries of the inputs of converter for a pass of the two-pass
+ * mode, see run_two_pass.
+ * Returns nonzero on success, 0 on error. */
+static int run_pass(Dr2osm_Converter *converter, Query_Context *context)
+{
+	context->stage = SNAPSHOT_STAGE_DIGIROAD;
+
+	for (int i = 0; i < converter->num_inputs; i++)
+	{
+		context->input = i;
+		context->rowid = 0;
+
+		if (!run_input(converter->digiroad_dbs[i], input_sql_query,
+					   stream_digiroad_row, context))
+		{
+			return 0;
+		}
+	}
+
+	if (!converter->mml_iceroads_db)
+	{
+		return 1;
+	}
+
+	/* Ice roads are snapped to the nodes of the Digiroad ways only, so the
+	 * grid is built in the first pass and kept for the second. */
+	if (converter->options.snap_iceroads && context->pass == TWO_PASS_NODES
+		&& !build_node_grid(&converter->snap_grid, &converter->node_index,
+							converter->options.snap_iceroads))
+	{
+		return 0;
+	}
+
+	context->stage = SNAPSHOT_STAGE_MML_ICEROADS;
+	context->input = 0;
+	context->rowid = 0;
+
+	return run_input(converter->mml_iceroads_db, mml_iceroads_sql_query,
+					 stream_mml_iceroads_row, context);
+}
+
+/* Implements dr2osm_run_outputs in the two-pass mode, which reads the inputs
+ * twice instead of buffering the ways: the first pass deduplicates the nodes,
+ * which are then passed to the sinks, and the second pass runs the queries
+ * again and passes each way to the sinks as soon as it has been read. The
+ * rows come in the same order both times, so the IDs and the output are the
+ * same as with a single pass. The second pass mostly reads pages the first
+ * one left in the page cache, so the databases are read through a memory
+ * mapping to avoid copying them.
+ * Returns nonzero on success, 0 on error. */
+static int run_two_pass(Dr2osm_Converter *converter,
+						const Dr2osm_Output *outputs, int num_outputs)
+{
+	if (converter->snapshot_input || converter->snapshot_output_path
+		|| converter->checkpoint_path || converter->options.node_memory_limit)
+	{
+		fprintf(stderr,
+				"The two-pass mode cannot be combined with snapshots, "
+				"checkpoints or external node deduplication.\n");
+		return 0;
+	}
+
+	if (!init_processing(converter))
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < converter->num_inputs; i++)
+	{
+		sqlite3_exec(converter->digiroad_dbs[i], "PRAGMA mmap_size = "
+					 "1099511627776;", 0, 0, 0);
+	}
+
+	if (converter->mml_iceroads_db)
+	{
+		sqlite3_exec(converter->mml_iceroads_db, "PRAGMA mmap_size = "
+					 "1099511627776;", 0, 0, 0);
+	}
+
+	/* If any of the profiles drops ways, the first pass marks which nodes
+	 * are still referenced in each output. */
+	Growable_Buffer node_masks = {0};
+	int drops_ways = 0;
+
+	for (int i = 0; i < num_outputs; i++)
+	{
+		drops_ways |= outputs[i].profile != DR2OSM_PROFILE_DEFAULT;
+	}
+
+	if (drops_ways
+		&& !init_buffer(&node_masks, (intptr_t)1 << 31,
+						&converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	double start_time = get_time();
+
+	Query_Context context = {0};
+	context.converter = converter;
+	context.pass = TWO_PASS_NODES;
+	context.outputs = outputs;
+	context.num_outputs = num_outputs;
+	context.node_masks = drops_ways ? &node_masks : 0;
+
+	int result = run_pass(converter, &context);
+
+	double nodes_seconds = get_time() - start_time;
+	int num_snapped_endpoints = converter->num_snapped_endpoints;
+	int num_iceroad_endpoints = converter->num_iceroad_endpoints;
+
+	for (int i = 0; result && i < num_outputs; i++)
+	{
+		result = outputs[i].sink.begin(outputs[i].sink.user_data);
+	}
+
+	result = result
+			 && emit_nodes(converter, outputs, num_outputs,
+						   drops_ways ? (uint8_t *)node_masks.start : 0)
+			 && emit_merged_nodes(converter, outputs, num_outputs,
+								  drops_ways ? (uint8_t *)node_masks.start
+											 : 0);
+
+	free_buffer(&node_masks);
+
+	int num_invalid = context.num_invalid;
+	int64_t num_duplicate_rows = context.num_duplicate_rows;
+
+	context.pass = TWO_PASS_WAYS;
+	context.num_valid = 0;
+	context.num_invalid = 0;
+
+	result = result && run_pass(converter, &context);
+
+	/* The endpoints were snapped again in the second pass. */
+	converter->num_snapped_endpoints = num_snapped_endpoints;
+	converter->num_iceroad_endpoints = num_iceroad_endpoints;
+	free_node_grid(&converter->snap_grid);
+
+	result = result && emit_merged_ways(converter, outputs, num_outputs);
+
+	for (int i = 0; result && i < num_outputs; i++)
+	{
+		result = outputs[i].sink.end(outputs[i].sink.user_data);
+	}
+
+	if (result && converter->options.print_stats)
+	{
+		int node_index_commits;
+
+		fprintf(stderr,
+				"Read the nodes in %.2f s and streamed %d ways in %.2f s, "
+				"with %.1f MiB committed to the node index.\n",
+				nodes_seconds, context.num_valid,
+				get_time() - start_time - nodes_seconds,
+				get_node_index_committed(&converter->node_index,
+										 &node_index_commits)
+					/ 1048576.0);
+		print_node_cache_stats(&converter->node_cache);
+		print_duplicate_row_stats(num_duplicate_rows);
+
+		if (num_iceroad_endpoints)
+		{
+			fprintf(stderr, "Snapped %d of %d ice road endpoints.\n",
+					num_snapped_endpoints, num_iceroad_endpoints);
+		}
+	}
+
+	if (result && num_invalid > 0)
+	{
+		fprintf(stderr,
+				"Input contained %d ways with geometries that "
+				"could not be parsed and were skipped.\n",
+				num_invalid);
+	}
+
+	return result;
+}
+
+int dr2osm_run_outputs(Dr2osm_Converter *converter,
+					   const Dr2osm_Output *outputs, int num_outputs)
+{
+	if (num_outputs < 1 || num_outputs > DR2OSM_MAX_OUTPUTS)
+	{
+		fprintf(stderr, "The number of outputs must be from 1 to %d.\n",
+				DR2OSM_MAX_OUTPUTS);
+		return 0;
+	}
+
+	if (setjmp(converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	if (converter->options.two_pass)
+	{
+		return run_two_pass(converter, outputs, num_outputs);
+	}
+
+	if (!process_input(converter))
+	{
+		return 0;
+	}
+
+	/* If any of the profiles drops ways, find out which nodes are still
+	 * referenced in each output. */
+
+	int drops_ways = 0;
+
+	for (int i = 0; i < num_outputs; i++)
+	{
+		drops_ways |= outputs[i].profile != DR2OSM_PROFILE_DEFAULT;
+	}
+
+	uint8_t *node_masks = 0;
+
+	if (drops_ways)
+	{
+		node_masks = mark_referenced_nodes(converter, outputs, num_outputs);
+
+		if (!node_masks)
+		{
+			return 0;
+		}
+	}
+
+	/* Pass the nodes and then the buffered ways to the sinks, each followed
+	 * by those of the merged files. */
+
+	int result = 1;
+
+	for (int i = 0; result && i < num_outputs; i++)
+	{
+		result = outputs[i].sink.begin(outputs[i].sink.user_data);
+	}
+
+	result = result && emit_nodes(converter, outputs, num_outputs, node_masks)
+			 && emit_merged_nodes(converter, outputs, num_outputs, node_masks);
+
+	free(node_masks);
+
+	/* Outputs whose sinks can be mapped get their ways formatted in
+	 * parallel, the rest are passed the ways one by one. */
+
+	int emitted[DR2OSM_MAX_OUTPUTS] = {0};
+	int num_emitted = 0;
+	intptr_t *way_offsets = 0;
+
+	for (int i = 0; result && i < num_outputs; i++)
+	{
+		const Dr2osm_Sink *sink = &outputs[i].sink;
+
+		if (!sink->format_way || !sink->can_map_output || !sink->map_output
+			|| !sink->unmap_output)
+		{
+			continue;
+		}
+
+		if (!way_offsets && !(way_offsets = index_ways(converter)))
+		{
+			result = 0;
+			break;
+		}
+
+		switch (emit_ways_mapped(converter, &outputs[i], way_offsets))
+		{
+		case EMIT_FAILED:
+			result = 0;
+			break;
+
+		case EMIT_DONE:
+			emitted[i] = 1;
+			num_emitted++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	free(way_offsets);
+
+	Way_Attributes attributes;
+	Way_Tag_Storage storage;
+
+	for (int i = 0; result && num_emitted < num_outputs && i < converter->num_ways;
+		 i++)
+	{
+		Dr2osm_Way way;
+
+		pop_way(&converter->way_buffer, &way, &attributes);
+
+		for (int j = 0; result && j < num_outputs; j++)
+		{
+			const Dr2osm_Sink *sink = &outputs[j].sink;
+
+			if (!emitted[j]
+				&& tag_way(&attributes, &converter->options, outputs[j].profile,
+						   &way, &storage))
+			{
+				result = sink->way(sink->user_data, &way);
+			}
+		}
+	}
+
+	result = result && emit_merged_ways(converter, outputs, num_outputs);
+
+	for (int i = 0; result && i < num_outputs; i++)
+	{
+		result = outputs[i].sink.end(outputs[i].sink.user_data);
+	}
+
+	if (result && converter->checkpoint_path)
+	{
+		UNICODE_REMOVE(converter->checkpoint_path);
+	}
+
+	return result;
+}
+
+int dr2osm_run(Dr2osm_Converter *converter, const Dr2osm_Sink *sink)
+{
+	Dr2osm_Output output;
+	output.profile = DR2OSM_PROFILE_DEFAULT;
+	output.sink = *sink;
+
+	return dr2osm_run_outputs(converter, &output, 1);
+}
+
+#include "output_xml.c"
+#include "output_o5m.c"
+#include "output_graph.c"
+#include "server.c"
@@ -1,120 +1,76 @@
 /* Standard library. */
-#include <errno.h>
-#include <limits.h>
-#include <setjmp.h>
-#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* System. */
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#else
-#include <sys/mman.h>
-#include <unistd.h>
-#endif
-
-/* Third-party libraries. */
-#include <proj.h>
-#include <sqlite3.h>
-
-#if defined(RELEASE_BUILD)
-#define assert(P) 0
-#elif defined(_WIN32)
-#define assert(P)         \
-	do                    \
-	{                     \
-		if (!(P))         \
-			DebugBreak(); \
-	} while (0)
-#else
-#define assert(P)             \
-	do                        \
-	{                         \
-		if (!(P))             \
-			__builtin_trap(); \
-	} while (0)
 #endif
 
 /* Project code. */
-#include "types.h"
-#include "buffer.c"
-
-#define ICE_ROAD_SPEED_LIMIT 30
-
-#if defined(_WIN32)
-#define FORMAT_UNICODE_STRING "%ls"
-#define UNICODE_STRCMP(A, B) wcscmp(A, L##B)
-#define UNICODE_FOPEN(FILENAME, MODE) _wfopen(FILENAME, L##MODE)
-#else
-#define FORMAT_UNICODE_STRING "%s"
-#define UNICODE_STRCMP(A, B) strcmp(A, B)
-#define UNICODE_FOPEN(FILENAME, MODE) fopen(FILENAME, MODE)
-#endif
-
-#define HIGHWAY                      \
-	X(HW_NONE, "")                   \
-	X(HW_FOOTWAY, "footway")         \
-	X(HW_MOTORWAY, "motorway")       \
-	X(HW_TRUNK, "trunk")             \
-	X(HW_PRIMARY, "primary")         \
-	X(HW_SECONDARY, "secondary")     \
-	X(HW_TERTIARY, "tertiary")       \
-	X(HW_RESIDENTIAL, "residential") \
-	X(HW_UNCLASSIFIED, "unclassified")
-
-#define ROUTE      \
-	X(RT_NONE, "") \
-	X(RT_FERRY, "ferry")
-
-#define ONEWAY     \
-	X(OW_NONE, "") \
-	X(OW_NO, "no") \
-	X(OW_YES, "yes")
-
-#define ADDITIONAL_TAGS X(AT_ICE_ROAD, "ice_road")
-
-enum
+#include "platform.h"
+#include "dr2osm.h"
+
+typedef struct {
+	Dr2osm_Profile profile;
+	Unicode_Character *path;
+	int graph;
+} Output_Configuration;
+
+typedef enum {
+	OUTPUT_FORMAT_XML,
+	OUTPUT_FORMAT_O5M,
+} Output_Format;
+
+typedef struct {
+	Unicode_Character *input_path;
+	Unicode_Character *extra_input_paths[DR2OSM_MAX_INPUTS - 1];
+	int num_extra_inputs;
+	Unicode_Character *merge_paths[DR2OSM_MAX_INPUTS];
+	int num_merge_inputs;
+	Output_Configuration outputs[DR2OSM_MAX_OUTPUTS];
+	int num_outputs;
+	Unicode_Character *mml_iceroads_path;
+	Unicode_Character *snapshot_path;
+	Unicode_Character *checkpoint_path;
+	Unicode_Character *socket_path;
+	Unicode_Character *trace_path;
+	int resume;
+	Output_Format format;
+	Dr2osm_Options options;
+} Program_Configuration;
+
+/* Reads the profile named name into profile.
+ * Returns nonzero on success, 0 on error. */
+static int parse_profile(const Unicode_Character *name, Dr2osm_Profile *profile)
 {
-#define X(IDENT, STRING) IDENT,
-	HIGHWAY ROUTE ONEWAY ADDITIONAL_TAGS
-#undef X
-		STRING_COUNT
-};
-
-static char *osm_strings[STRING_COUNT] = {
-#define X(IDENT, STRING) STRING,
-	HIGHWAY ROUTE ONEWAY ADDITIONAL_TAGS
-#undef X
-};
-
-static char input_sql_query[] =
-	"SELECT COALESCE(n.geom, l.geom) as geom,"
-	"COALESCE(n.arvo, 0) AS speed_limit,"
-	"COALESCE(l.toiminn_lk, 0) AS class,"
-	"COALESCE(l.linkkityyp, 0) AS type,"
-	"COALESCE(l.ajosuunta, 0) AS direction,"
-	"COALESCE(l.tienimi_su, l.tienimi_ru, l.tienim_psa, l.tienim_ksa, "
-	"l.tienim_isa, '') AS name,"
-	"COALESCE(h.arvo, 0) AS height_cm,"
-	"COALESCE(w.arvo, 0) AS weight_kg\n"
-	"FROM dr_linkki_k AS l\n"
-	"LEFT OUTER JOIN dr_nopeusrajoitus_k AS n USING (segm_id)\n"
-	"LEFT OUTER JOIN dr_suurin_sallittu_korkeus_k AS h USING (segm_id)\n"
-	"LEFT OUTER JOIN dr_suurin_sallittu_massa_k AS w USING (segm_id);\n";
-//"WHERE l.kuntakoodi=91;";
-
-static char mml_iceroads_sql_query[] =
-	"SELECT geom,"
-	"COALESCE(yksisuuntaisuus, -1) AS direction,"
-	"COALESCE("
-	"nimi_suomi, nimi_ruotsi, nimi_inarinsaame, nimi_koltansaame, "
-	"nimi_pohjoissaame, ''"
-	") AS name\n"
-	"FROM iceroads;";
-
-static int last_id = 0;
+	if (!UNICODE_STRCMP(name, "default"))
+	{
+		*profile = DR2OSM_PROFILE_DEFAULT;
+	}
+	else if (!UNICODE_STRCMP(name, "car"))
+	{
+		*profile = DR2OSM_PROFILE_CAR;
+	}
+	else if (!UNICODE_STRCMP(name, "bicycle"))
+	{
+		*profile = DR2OSM_PROFILE_BICYCLE;
+	}
+	else if (!UNICODE_STRCMP(name, "foot"))
+	{
+		*profile = DR2OSM_PROFILE_FOOT;
+	}
+	else
+	{
+		fprintf(stderr, "Unknown profile \"" FORMAT_UNICODE_STRING "\".\n",
+				name);
+		return 0;
+	}
+
+	return 1;
+}
 
 /* When passed the argc and argv arguments of the main function, reads the
  * commandline arguments and fills in the configuration struct pointed to by
@@ -134,7 +90,18 @@ static int parse_commandline_arguments(Program_Configuration *config, int argc,
 		argc--;
 		argv++;
 
-		if (!UNICODE_STRCMP(argument, "--mml-iceroads"))
+		if (!UNICODE_STRCMP(argument, "--input"))
+		{
+			if (argc < 1 || config->num_extra_inputs == DR2OSM_MAX_INPUTS - 1)
+			{
+				return 0;
+			}
+
+			config->extra_input_paths[config->num_extra_inputs++] = argv[0];
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--mml-iceroads"))
 		{
 			if (argc < 1)
 			{
@@ -145,520 +112,288 @@ static int parse_commandline_arguments(Program_Configuration *config, int argc,
 			argc--;
 			argv++;
 		}
-		else if (!UNICODE_STRCMP(argument, "--default-speed-limits"))
+		else if (!UNICODE_STRCMP(argument, "--merge"))
 		{
-			config->default_speed_limits = 1;
+			if (argc < 1 || config->num_merge_inputs == DR2OSM_MAX_INPUTS)
+			{
+				return 0;
+			}
+
+			config->merge_paths[config->num_merge_inputs++] = argv[0];
+			argc--;
+			argv++;
 		}
-		else
+		else if (!UNICODE_STRCMP(argument, "--snapshot"))
 		{
-			fprintf(stderr,
-					"Invalid commandline option \"" FORMAT_UNICODE_STRING "\". "
-					"Prefix it with \"./\", "
-					"if it is intended to be the input path.\n",
-					argument);
-			return 0;
+			if (argc < 1)
+			{
+				return 0;
+			}
+
+			config->snapshot_path = argv[0];
+			argc--;
+			argv++;
 		}
-	}
+		else if (!UNICODE_STRCMP(argument, "--graph-out"))
+		{
+			if (argc < 1 || config->num_outputs == DR2OSM_MAX_OUTPUTS)
+			{
+				return 0;
+			}
 
-	if (argc != 2)
-	{
-		return 0;
-	}
+			Output_Configuration *output = &config->outputs[config->num_outputs++];
+			output->profile = DR2OSM_PROFILE_DEFAULT;
+			output->path = argv[0];
+			output->graph = 1;
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--serve"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-	config->input_path = argv[0];
-	config->output_path = argv[1];
+			config->socket_path = argv[0];
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--trace"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-	return 1;
-}
+			config->trace_path = argv[0];
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--checkpoint"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-/* Opens the sqlite3 database at path and returns the database handle.
- * Returns 0 on error. */
-static sqlite3 *open_database(Unicode_Character *path)
-{
-	sqlite3 *result;
-	int rc;
+			config->checkpoint_path = argv[0];
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--checkpoint-interval"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
 #if defined(_WIN32)
-	rc = sqlite3_open16(path, &result);
+			config->options.checkpoint_interval = _wtoi(argv[0]);
 #else
-	rc = sqlite3_open_v2(path, &result, SQLITE_OPEN_READONLY, 0);
+			config->options.checkpoint_interval = atoi(argv[0]);
 #endif
 
-	if (rc != SQLITE_OK)
-	{
-		fprintf(stderr,
-				"Unable to open \"" FORMAT_UNICODE_STRING "\" for reading: %s\n",
-				path, sqlite3_errmsg(result));
-		return 0;
-	}
-
-	return result;
-}
-
-/* Prepares in the database db the sql statement in the string sql.
- * Returns 0 on error. */
-static sqlite3_stmt *prepare_statement(sqlite3 *db, char *sql)
-{
-	sqlite3_stmt *result = 0;
-
-	int rc = sqlite3_prepare_v2(db, sql, -1, &result, 0);
-
-	if (rc != SQLITE_OK)
-	{
-		fprintf(stderr, "Unable to read data from input: %s\n", sqlite3_errstr(rc));
-		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
-		return 0;
-	}
-
-	return result;
-}
-
-/* Prepares and executes a query counting the number of ways in the Digiroad
- * database opened in the database db, and returns the result.
- * Returns 0 on error. */
-static int get_num_ways(sqlite3 *db)
-{
-	sqlite3_stmt *statement =
-		prepare_statement(db, "SELECT COUNT(*) FROM dr_linkki_k;");
-
-	if (!statement)
-	{
-		return 0;
-	}
-
-	int result = 0;
-	int rc;
-
-	do
-	{
-		rc = sqlite3_step(statement);
-
-		assert(rc != SQLITE_MISUSE);
+			if (config->options.checkpoint_interval < 1)
+			{
+				fprintf(stderr, "The checkpoint interval must be positive.\n");
+				return 0;
+			}
 
-		switch (rc)
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--resume"))
 		{
-		case SQLITE_BUSY:
-			break;
+			config->resume = 1;
+		}
+		else if (!UNICODE_STRCMP(argument, "--node-memory"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-		case SQLITE_ROW:
-			result = sqlite3_column_int(statement, 0);
+#if defined(_WIN32)
+			config->options.node_memory_limit = (int64_t)_wtoi(argv[0]) << 20;
+#else
+			config->options.node_memory_limit = (int64_t)atoi(argv[0]) << 20;
+#endif
 
-			if (!result)
+			if (config->options.node_memory_limit < 1)
 			{
-				fprintf(stderr, "Input does not contain any ways.\n");
+				fprintf(stderr, "The node memory limit must be positive.\n");
+				return 0;
 			}
 
-			break;
-
-		default:
-			fprintf(stderr, "Unable to read data from input: %s\n",
-					sqlite3_errstr(rc));
-			fprintf(stderr, "%s\n", sqlite3_errmsg(db));
-			break;
+			argc--;
+			argv++;
 		}
-	} while (rc == SQLITE_BUSY);
-
-	sqlite3_finalize(statement);
-
-	return result;
-}
-
-/* Return a unique ID number for a node or way.
- * Please don't call this more than INT_MAX times. <3 */
-static int generate_id()
-{
-	int result = ++last_id;
-	assert(result > 0); /* TODO handle this properly. */
-	return result;
-}
-
-/* Buffers into the way buffer the first part of the data for a single way,
- * i.e. the way ID followed by a zero-terminated list of associated node IDs.
- * Returns nonzero on success, 0 on error. */
-static int buffer_ids(const Geopackage_Binary_Header *geom_header,
-					  int geom_size, int reverse_node_order,
-					  Query_Context *context)
-{
-	/* Parse geometry headers and validate the geometry headers.
-	 * This includes the Geopackage binary header
-	 * https://docs.ogc.org/is/12-128r17/12-128r17.html#gpb_format
-	 * and the well known binary header
-	 * https://portal.ogc.org/files/?artifact_id=25355 */
-
-	if ((geom_size -= sizeof(Geopackage_Binary_Header)) < 0)
-	{
-		return 0;
-	}
-
-	int envelope_indicator = (geom_header->flags >> 1) & 7;
-
-	if (envelope_indicator > 4)
-	{
-		return 0;
-	}
-
-	static int envelope_sizes[] = {0, 32, 48, 48, 64};
-
-	int envelope_size = envelope_sizes[envelope_indicator];
-
-	if ((geom_size -= envelope_size + sizeof(Wkb_Line_String_Any)) < 0)
-	{
-		return 0;
-	}
-
-	Wkb_Line_String_Any *line_string =
-		(Wkb_Line_String_Any *)(geom_header->envelope + envelope_size);
-
-	if (line_string->byte_order != 1)
-	{
-		return 0;
-	}
-
-	int point_stride;
-
-	switch (line_string->type)
-	{
-	case 2: /* wkbLineString */
-		point_stride = 2;
-		break;
-
-	case 1002: /* wkbLineStringZ */
-	case 2002: /* wkbLineStringM */
-		point_stride = 3;
-		break;
-
-	case 3002: /* wkbLineStringZM */
-		point_stride = 4;
-		break;
-
-	default:
-		return 0;
-	}
-
-	if ((geom_size -= line_string->num_points * point_stride * sizeof(double)) <
-		0)
-	{
-		return 0;
-	}
-
-	/* Start buffering ways and writing out nodes. If a node with identical
-	 * coordinates has been encountered before, buffer the ID of the
-	 * previously seen node with the way data. Otherwise generate a new node
-	 * ID and write the node to output. */
-
-	int *way_id = way_buffer_push_int(0);
+		else if (!UNICODE_STRCMP(argument, "--snap-iceroads"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-	int prev_x = INT_MIN;
-	int prev_y = INT_MIN;
+#if defined(_WIN32)
+			config->options.snap_iceroads = _wtoi(argv[0]);
+#else
+			config->options.snap_iceroads = atoi(argv[0]);
+#endif
 
-	double *p = line_string->points;
+			if (config->options.snap_iceroads < 1)
+			{
+				fprintf(stderr, "The snapping distance must be positive.\n");
+				return 0;
+			}
 
-	if (reverse_node_order)
-	{
-		p += (line_string->num_points - 1) * point_stride;
-		point_stride = -point_stride;
-	}
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--snap-merged"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-	for (int i = 0; i < line_string->num_points; i++)
-	{
-		int x = (int)(p[0] + 0.5);
-		int y = (int)(p[1] + 0.5);
+#if defined(_WIN32)
+			config->options.snap_merged = _wtoi(argv[0]);
+#else
+			config->options.snap_merged = atoi(argv[0]);
+#endif
 
-		p += point_stride;
+			if (config->options.snap_merged < 1)
+			{
+				fprintf(stderr, "The snapping distance must be positive.\n");
+				return 0;
+			}
 
-		if (x == prev_x && y == prev_y)
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--two-pass"))
 		{
-			continue;
+			config->options.two_pass = 1;
 		}
-
-		prev_x = x;
-		prev_y = y;
-
-		Node *node = node_upsert(x, y);
-
-		if (!node->id)
+		else if (!UNICODE_STRCMP(argument, "--stats"))
 		{
-			node->id = generate_id();
-
-			PJ_COORD fin = proj_coord((double)x, (double)y, 0, 0);
-			PJ_COORD wgs = proj_trans(context->projection, PJ_FWD, fin);
-
-			fprintf(context->output,
-					"<node visible=\"true\" id=\"%d\" lat=\"%.9f\" lon=\"%.9f\"/>\n",
-					node->id, wgs.xy.x, wgs.xy.y);
+			config->options.print_stats = 1;
 		}
+		else if (!UNICODE_STRCMP(argument, "--profile"))
+		{
+			if (argc < 2 || config->num_outputs == DR2OSM_MAX_OUTPUTS)
+			{
+				return 0;
+			}
 
-		way_buffer_push_int(node->id);
-	}
-
-	way_buffer_push_int(0);
-	*way_id = generate_id();
-
-	return 1;
-}
-
-/* Callback function passed to run_query to handle the rows of the Digiroad
- * query.
- * Returns nonzero on valid row, 0 on invalid row. */
-static int digiroad_row(sqlite3_stmt *statement, Query_Context *context)
-{
-	/* The format of a single way in the way buffer:
-	 *
-	 * int way_id
-	 * int... node_ids
-	 * int node_ids_terminator = 0
-	 * int highway
-	 * int route
-	 * int oneway
-	 * int maxspeed
-	 * string name
-	 * int... additional_tags
-	 * int additional_tags_terminator = 0
-	 *
-	 * way_id corresponds to the <way> tag's id attribute. Each element
-	 * of node_ids corresponds to the ref attribute of a distinct <nd> tag
-	 * within the way element. Each of highway, route and oneway is an index
-	 * into the osm_strings array defined at the top of this file, the
-	 * corresponding element of which corresponds to the v attribute of a
-	 * <tag> tag in the way element, with "highway", "route" or "oneway"
-	 * respectively as its k attribute. name corresponds to the v attribute
-	 * of a <tag> tag in the way element, with "name" as its k attribute. */
-
-	assert(!strcmp(sqlite3_column_name(statement, 0), "geom"));
-	assert(!strcmp(sqlite3_column_name(statement, 1), "speed_limit"));
-	assert(!strcmp(sqlite3_column_name(statement, 2), "class"));
-	assert(!strcmp(sqlite3_column_name(statement, 3), "type"));
-	assert(!strcmp(sqlite3_column_name(statement, 4), "direction"));
-	assert(!strcmp(sqlite3_column_name(statement, 5), "name"));
-	assert(!strcmp(sqlite3_column_name(statement, 6), "height_cm"));
-	assert(!strcmp(sqlite3_column_name(statement, 7), "weight_kg"));
-
-	assert(sqlite3_column_type(statement, 0) == SQLITE_BLOB);
-	assert(sqlite3_column_type(statement, 1) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 2) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 3) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 4) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 5) == SQLITE_TEXT);
-	assert(sqlite3_column_type(statement, 6) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 7) == SQLITE_INTEGER);
-
-	const Geopackage_Binary_Header *geom_header =
-		sqlite3_column_blob(statement, 0);
-	int geom_size = sqlite3_column_bytes(statement, 0);
-	int speed_limit = sqlite3_column_int(statement, 1);
-	int class = sqlite3_column_int(statement, 2);
-	int type = sqlite3_column_int(statement, 3);
-	int direction = sqlite3_column_int(statement, 4);
-	const char *name = sqlite3_column_text(statement, 5);
-	int height_cm = sqlite3_column_int(statement, 6);
-	int weight_kg = sqlite3_column_int(statement, 7);
-
-	int reverse_node_order = (direction == 3);
-
-	if (!buffer_ids(geom_header, geom_size, reverse_node_order, context))
-	{
-		return 0;
-	}
+			Output_Configuration *output = &config->outputs[config->num_outputs++];
 
-	int highway = HW_NONE;
+			if (!parse_profile(argv[0], &output->profile))
+			{
+				return 0;
+			}
 
-	if (type == 8 || type == 9 || class == 8)
-	{
-		highway = HW_FOOTWAY;
-	}
-	else if (type != 21)
-	{
-		switch (class)
+			output->path = argv[1];
+			argc -= 2;
+			argv += 2;
+		}
+		else if (!UNICODE_STRCMP(argument, "--format"))
 		{
-		case 1:
-			highway = HW_MOTORWAY;
-			break;
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-		case 2:
-			highway = HW_TRUNK;
-			break;
+			if (!UNICODE_STRCMP(argv[0], "xml"))
+			{
+				config->format = OUTPUT_FORMAT_XML;
+			}
+			else if (!UNICODE_STRCMP(argv[0], "o5m"))
+			{
+				config->format = OUTPUT_FORMAT_O5M;
+			}
+			else
+			{
+				fprintf(stderr, "Unknown format \"" FORMAT_UNICODE_STRING "\".\n",
+						argv[0]);
+				return 0;
+			}
 
-		case 3:
-			highway = HW_PRIMARY;
-			break;
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--threads"))
+		{
+			if (argc < 1)
+			{
+				return 0;
+			}
 
-		case 4:
-			highway = HW_SECONDARY;
-			break;
+#if defined(_WIN32)
+			config->options.num_threads = _wtoi(argv[0]);
+#else
+			config->options.num_threads = atoi(argv[0]);
+#endif
 
-		case 5:
-			highway = HW_TERTIARY;
-			break;
+			if (config->options.num_threads < 1)
+			{
+				fprintf(stderr, "The number of threads must be positive.\n");
+				return 0;
+			}
 
-		default:
-			highway = HW_RESIDENTIAL;
-			break;
+			argc--;
+			argv++;
+		}
+		else if (!UNICODE_STRCMP(argument, "--default-speed-limits"))
+		{
+			config->options.default_speed_limits = 1;
+		}
+		else
+		{
+			fprintf(stderr,
+					"Invalid commandline option \"" FORMAT_UNICODE_STRING "\". "
+					"Prefix it with \"./\", "
+					"if it is intended to be the input path.\n",
+					argument);
+			return 0;
 		}
 	}
 
-	int route = RT_NONE;
-
-	if (type == 21 && class != 8)
-	{
-		route = RT_FERRY;
-	}
-
-	int oneway = OW_NONE;
-
-	switch (direction)
+	if (config->resume && !config->checkpoint_path)
 	{
-	case 2:
-		oneway = OW_NO;
-		break;
-
-	case 3:
-	case 4:
-		oneway = OW_YES;
-		break;
-
-	default:
-		break;
+		fprintf(stderr, "--resume requires --checkpoint.\n");
+		return 0;
 	}
 
-	if (context->default_speed_limits && !speed_limit)
+	/* The server takes no outputs, and otherwise the output path can be
+	 * left out if outputs are given with --profile or --graph-out. */
+	if (config->socket_path)
 	{
-		switch (highway)
+		if (argc != 1 || config->num_outputs)
 		{
-		case HW_MOTORWAY:
-			speed_limit = 80;
-			break;
-
-		case HW_TRUNK:
-			speed_limit = 70;
-			break;
-
-		case HW_PRIMARY:
-			speed_limit = 60;
-			break;
-
-		case HW_SECONDARY:
-			speed_limit = 50;
-			break;
-
-		case HW_TERTIARY:
-			speed_limit = 40;
-			break;
-
-		case HW_UNCLASSIFIED:
-		case HW_RESIDENTIAL:
-			speed_limit = 30;
-			break;
-
-		default:
-			break;
+			return 0;
 		}
 	}
-
-	way_buffer_push_int(highway);
-	way_buffer_push_int(route);
-	way_buffer_push_int(oneway);
-	way_buffer_push_int(speed_limit);
-	way_buffer_push_string(name);
-	way_buffer_push_int(height_cm);
-	way_buffer_push_int(weight_kg);
-	way_buffer_push_int(0); /* No additional tags. */
-
-	return 1;
-}
-
-/* Callback function passed to run_query to handle the rows of the ice road
- * query.
- * Returns nonzero on valid row, 0 on invalid row. */
-static int mml_iceroads_row(sqlite3_stmt *statement, Query_Context *context)
-{
-	assert(!strcmp(sqlite3_column_name(statement, 0), "geom"));
-	assert(!strcmp(sqlite3_column_name(statement, 1), "direction"));
-	assert(!strcmp(sqlite3_column_name(statement, 2), "name"));
-
-	assert(sqlite3_column_type(statement, 0) == SQLITE_BLOB);
-	assert(sqlite3_column_type(statement, 1) == SQLITE_INTEGER);
-	assert(sqlite3_column_type(statement, 2) == SQLITE_TEXT);
-
-	const Geopackage_Binary_Header *geom_header =
-		sqlite3_column_blob(statement, 0);
-	int geom_size = sqlite3_column_bytes(statement, 0);
-	int direction = sqlite3_column_int(statement, 1);
-	const char *name = sqlite3_column_text(statement, 2);
-
-	int reverse_node_order = (direction == 2);
-
-	if (!buffer_ids(geom_header, geom_size, reverse_node_order, context))
+	else if (argc != 2 && (argc != 1 || !config->num_outputs))
 	{
 		return 0;
 	}
 
-	int oneway = OW_NONE;
-
-	switch (direction)
-	{
-	case 0:
-		oneway = OW_NO;
-		break;
-
-	case 1:
-	case 2:
-		oneway = OW_YES;
-		break;
-
-	default:
-		break;
-	}
-
-	way_buffer_push_int(HW_UNCLASSIFIED);
-	way_buffer_push_int(RT_NONE);
-	way_buffer_push_int(oneway);
-	way_buffer_push_int(ICE_ROAD_SPEED_LIMIT);
-	way_buffer_push_string(name);
-	way_buffer_push_int(AT_ICE_ROAD);
-	way_buffer_push_int(0);
-
-	return 1;
-}
-
-/* Steps statement until completion and passes it to callback together with
- * context for each row returned.
- * Returns nonzero on success, 0 on error. */
-static int run_query(sqlite3_stmt *statement, Row_Function *callback,
-					 Query_Context *context)
-{
-	int rc;
+	config->input_path = argv[0];
 
-	do
+	if (argc == 2)
 	{
-		rc = sqlite3_step(statement);
-
-		assert(rc != SQLITE_MISUSE);
-
-		switch (rc)
+		if (config->num_outputs == DR2OSM_MAX_OUTPUTS)
 		{
-		case SQLITE_DONE:
-		case SQLITE_BUSY:
-			break;
-
-		case SQLITE_ROW:
-			if (callback(statement, context))
-			{
-				context->num_valid++;
-			}
-			else
-			{
-				context->num_invalid++;
-			}
-
-			break;
-
-		default:
-			fprintf(stderr, "sqlite3_step: %s\n%s\n%s\n", sqlite3_errstr(rc),
-					sqlite3_sql(statement),
-					sqlite3_errmsg(sqlite3_db_handle(statement)));
 			return 0;
 		}
-	} while (rc != SQLITE_DONE);
+
+		Output_Configuration *output = &config->outputs[config->num_outputs++];
+		output->profile = DR2OSM_PROFILE_DEFAULT;
+		output->path = argv[1];
+	}
 
 	return 1;
 }
@@ -680,195 +415,167 @@ main(int argc, char **argv)
 	{
 		fprintf(stderr,
 				"Usage: " FORMAT_UNICODE_STRING " "
+				"[--input <input-path>]... "
 				"[--mml-iceroads <ice-roads-path>] "
+				"[--snap-iceroads <metres>] "
+				"[--merge <pbf-path>]... "
+				"[--snap-merged <metres>] "
 				"[--default-speed-limits] "
-				" <input-path> <output-path>\n",
-				argv[0]);
+				"[--snapshot <snapshot-path>] "
+				"[--graph-out <graph-path>] "
+				"[--checkpoint <checkpoint-path> [--resume]] "
+				"[--checkpoint-interval <seconds>] "
+				"[--profile <car|bicycle|foot|default> <output-path>]... "
+				"[--threads <count>] "
+				"[--format <xml|o5m>] "
+				"[--node-memory <MiB>] "
+				"[--two-pass] "
+				"[--stats] "
+				"[--trace <trace-path>] "
+				" <input-path> <output-path>\n"
+				"       " FORMAT_UNICODE_STRING " "
+				"--serve <socket-path> [options] <input-path>\n",
+				argv[0], argv[0]);
 		return 1;
 	}
 
-	PJ *projection = proj_create_crs_to_crs(0, "EPSG:3067", "EPSG:4326", 0);
-
-	if (!projection)
+	if (config.trace_path && !dr2osm_trace_start(config.trace_path))
 	{
-		fprintf(stderr, "proj_create_crs_to_crs: %s\n",
-				proj_errno_string(proj_errno(0)));
 		return 1;
 	}
 
-	FILE *output;
+	Dr2osm_Converter *converter = dr2osm_create();
 
-	if (!UNICODE_STRCMP(config.output_path, "-"))
-	{
-		output = stdout;
-	}
-	else
+	if (!converter)
 	{
-		output = UNICODE_FOPEN(config.output_path, "w");
-	}
-
-	if (!output)
-	{
-		fprintf(stderr,
-				"Unable to open \"" FORMAT_UNICODE_STRING "\" for writing: %s\n",
-				config.output_path, strerror(errno));
+		dr2osm_trace_stop();
 		return 1;
 	}
 
-	sqlite3 *db;
-	int rc;
-
-	db = open_database(config.input_path);
-
-	if (!db)
-	{
-		goto cleanup_output;
-	}
-
-	sqlite3_stmt *statement = prepare_statement(db, input_sql_query);
+	dr2osm_set_options(converter, &config.options);
 
-	if (!statement)
+	if (config.snapshot_path
+		&& !dr2osm_set_snapshot_output(converter, config.snapshot_path))
 	{
-		goto cleanup_output;
+		goto cleanup_converter;
 	}
 
-	if (!init_buffer(&way_buffer, (intptr_t)40 * 1024 * 1024 * 1024))
+	if (config.checkpoint_path
+		&& !dr2osm_set_checkpoint(converter, config.checkpoint_path,
+								  config.resume))
 	{
-		goto cleanup;
+		goto cleanup_converter;
 	}
 
-	if (!init_buffer(&node_buffer, sizeof(Node) << 31))
+	if (!dr2osm_open_input(converter, config.input_path))
 	{
-		goto cleanup;
+		goto cleanup_converter;
 	}
 
-	if (setjmp(out_of_memory))
+	for (int i = 0; i < config.num_extra_inputs; i++)
 	{
-		goto cleanup;
+		if (!dr2osm_add_input(converter, config.extra_input_paths[i]))
+		{
+			goto cleanup_converter;
+		}
 	}
 
-	node_tree_root = alloc_node();
-	node_tree_root->x = 1018199;
-	node_tree_root->y = 7248352;
-
-	/* Write OSM header. */
-
-	fprintf(output, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-	fprintf(output, "<osm version=\"0.6\" generator=\"dr2osm\">\n");
-
-	/* Process ways and nodes, and write nodes. */
-
-	int num_ways_processed = 0;
-	int num_invalid_ways = 0;
-	Query_Context context = {0};
-	context.output = output;
-	context.projection = projection;
-	context.default_speed_limits = config.default_speed_limits;
-
-	if (!run_query(statement, digiroad_row, &context))
+	if (config.mml_iceroads_path
+		&& !dr2osm_open_mml_iceroads(converter, config.mml_iceroads_path))
 	{
-		goto cleanup;
+		goto cleanup_converter;
 	}
 
-	num_ways_processed += context.num_valid;
-	num_invalid_ways += context.num_invalid;
-
-	context.num_valid = context.num_invalid = 0;
-
-	if (config.mml_iceroads_path)
+	for (int i = 0; i < config.num_merge_inputs; i++)
 	{
-		sqlite3_finalize(statement);
-		sqlite3_close(db);
-
-		db = open_database(config.mml_iceroads_path);
-
-		if (!db)
+		if (!dr2osm_add_merge_input(converter, config.merge_paths[i]))
 		{
-			goto cleanup_output;
-		}
-
-		statement = prepare_statement(db, mml_iceroads_sql_query);
-
-		if (!statement)
-		{
-			goto cleanup_output;
+			goto cleanup_converter;
 		}
+	}
 
-		if (!run_query(statement, mml_iceroads_row, &context))
+	if (config.socket_path)
+	{
+		if (dr2osm_serve(converter, config.socket_path))
 		{
-			goto cleanup;
+			result = 0;
 		}
 
-		num_ways_processed += context.num_valid;
-		num_invalid_ways += context.num_invalid;
+		goto cleanup_converter;
 	}
 
-	/* Write buffered ways. */
+	Dr2osm_Stream *streams[DR2OSM_MAX_OUTPUTS];
+	Dr2osm_Output outputs[DR2OSM_MAX_OUTPUTS];
+	int num_streams = 0;
 
-	for (int i = 0; i < num_ways_processed; i++)
+	for (; num_streams < config.num_outputs; num_streams++)
 	{
-		int way_id = way_buffer_pop_int();
+		Dr2osm_Stream *stream =
+			dr2osm_stream_open(config.outputs[num_streams].path,
+							   config.options.num_threads);
 
-		fprintf(output, "<way visible=\"true\" id=\"%d\">", way_id);
-
-		for (int node_id; node_id = way_buffer_pop_int();)
+		if (!stream)
 		{
-			fprintf(output, "<nd ref=\"%d\"/>", node_id);
+			goto cleanup_streams;
 		}
 
-		int highway = way_buffer_pop_int();
-		int route = way_buffer_pop_int();
-		int oneway = way_buffer_pop_int();
-		int maxspeed = way_buffer_pop_int();
-		char *name = way_buffer_pop_string();
-
-		fprintf(output, "<tag k=\"highway\" v=\"%s\"/>", osm_strings[highway]);
-		fprintf(output, "<tag k=\"route\" v=\"%s\"/>", osm_strings[route]);
-		fprintf(output, "<tag k=\"oneway\" v=\"%s\"/>", osm_strings[oneway]);
-		fprintf(output, "<tag k=\"maxspeed\" v=\"%d\"/>", maxspeed);
-		fprintf(output, "<tag k=\"name\" v=\"%s\"/>", name);
-
-		int height_cm = way_buffer_pop_int();
-		int weight_kg = way_buffer_pop_int();
+		streams[num_streams] = stream;
+		outputs[num_streams].profile = config.outputs[num_streams].profile;
 
-		if (height_cm > 0)
+		if (config.outputs[num_streams].graph)
 		{
-			fprintf(output, "<tag k=\"maxheight\" v=\"%.1f\"/>", height_cm / 100.0);
+			if (!dr2osm_graph_sink(&outputs[num_streams].sink, stream))
+			{
+				num_streams++;
+				goto cleanup_streams;
+			}
 		}
-
-		if (weight_kg > 0)
+		else if (config.format == OUTPUT_FORMAT_O5M)
 		{
-			fprintf(output, "<tag k=\"maxweight\" v=\"%.0f\"/>", weight_kg / 1000.0);
+			if (!dr2osm_o5m_sink(&outputs[num_streams].sink, stream))
+			{
+				num_streams++;
+				goto cleanup_streams;
+			}
 		}
-
-		for (int additional_tag; additional_tag = way_buffer_pop_int();)
+		else
 		{
-			fprintf(output, "<tag k=\"%s\" v=\"yes\"/>", osm_strings[additional_tag]);
+			dr2osm_xml_sink(&outputs[num_streams].sink, stream);
 		}
-
-		fprintf(output, "</way>\n");
 	}
 
-	if (context.num_invalid > 0)
+	if (dr2osm_run_outputs(converter, outputs, config.num_outputs))
 	{
-		fprintf(stderr,
-				"Input contained %d ways with geometries that"
-				"could not be parsed and were skipped.\n",
-				context.num_invalid);
+		result = 0;
 	}
 
-	fprintf(output, "</osm>\n");
-
-	result = 0;
+	if (config.options.print_stats)
+	{
+		for (int i = 0; i < num_streams; i++)
+		{
+			fprintf(stderr,
+					"Output " FORMAT_UNICODE_STRING ": writer stalled for %.2f s\n",
+					config.outputs[i].path,
+					dr2osm_stream_stall_seconds(streams[i]));
+		}
+	}
 
-cleanup:
-	sqlite3_finalize(statement);
+cleanup_streams:
+	while (num_streams > 0)
+	{
+		if (!dr2osm_stream_close(streams[--num_streams]))
+		{
+			result = 1;
+		}
+	}
 
-cleanup_input:
-	sqlite3_close(db);
+cleanup_converter:
+	dr2osm_destroy(converter);
 
-cleanup_output:
-	fclose(output);
+	if (!dr2osm_trace_stop())
+	{
+		result = 1;
+	}
 
 	return result;
 }
@@ -0,0 +1,340 @@
+/* Public interface of the dr2osm conversion library.
+ *
+ * A converter is created with dr2osm_create, given its inputs with
+ * dr2osm_open_input and optionally dr2osm_add_input, dr2osm_open_mml_iceroads
+ * and dr2osm_add_merge_input, configured with dr2osm_set_options and finally
+ * run with dr2osm_run, which streams all nodes followed by all ways to a
+ * sink. The sink is a set of callbacks, so the converted data can be consumed
+ * directly without going through a file.
+ * dr2osm_xml_sink and dr2osm_o5m_sink provide sinks writing OSM XML and O5M
+ * to an output stream opened with dr2osm_stream_open, which is what the dr2osm
+ * executable uses. dr2osm_graph_sink writes a binary road graph instead.
+ * dr2osm_serve keeps the converted data in memory and serves extracts of it.
+ *
+ * Unless stated otherwise, functions returning int return nonzero on success
+ * and 0 on error, in which case a message has been written to stderr. */
+
+#if !defined(DR2OSM_H)
+#define DR2OSM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(_WIN32)
+#include <wchar.h>
+typedef wchar_t Unicode_Character;
+#else
+typedef char Unicode_Character;
+#endif
+
+typedef struct {
+	/* For ways without a specified speed limit in the source data, enter a
+	 * default speed limit based on the type of way in question. */
+	int default_speed_limits;
+
+	/* Number of worker threads used by the converter, or 0 to use one per
+	 * processor. */
+	int num_threads;
+
+	/* Minimum number of seconds between checkpoints, see
+	 * dr2osm_set_checkpoint. 0 uses a default of 60 seconds. */
+	int checkpoint_interval;
+
+	/* If nonzero, nodes are deduplicated by sorting them on disk, using about
+	 * this many bytes of memory, instead of in an index kept in memory. The
+	 * output is the same either way. Cannot be combined with snapshot input
+	 * or checkpoints. */
+	int64_t node_memory_limit;
+
+	/* If nonzero, the endpoints of ice roads are moved onto the nearest
+	 * node of the Digiroad ways at most this many metres away, so that they
+	 * are connected to the road network. Cannot be combined with
+	 * node_memory_limit. */
+	int snap_iceroads;
+
+	/* If nonzero, the inputs are read twice instead of the ways being kept
+	 * in memory until all nodes have been output: the first pass only
+	 * deduplicates the nodes and the second reads the ways again and streams
+	 * them to the sinks. This uses much less memory at the cost of a second
+	 * query. The output is the same either way. Cannot be combined with
+	 * snapshots, checkpoints or node_memory_limit. */
+	int two_pass;
+
+	/* If nonzero, the endpoints of the ways of merged files, see
+	 * dr2osm_add_merge_input, are moved onto the nearest converted node at
+	 * most this many metres away, so that roads crossing the border connect
+	 * to the converted network. Cannot be combined with node_memory_limit. */
+	int snap_merged;
+
+	/* Print statistics about the conversion to stderr. */
+	int print_stats;
+} Dr2osm_Options;
+
+typedef struct {
+	int id;
+	double lat, lon;
+} Dr2osm_Node;
+
+typedef struct {
+	const char *key;
+	const char *value;
+} Dr2osm_Tag;
+
+/* The arrays pointed to by a way passed to a sink are only valid for the
+ * duration of the callback. */
+typedef struct {
+	int id;
+	int num_node_ids;
+	const int *node_ids;
+	int num_tags;
+	const Dr2osm_Tag *tags;
+} Dr2osm_Way;
+
+/* Receives the output of a conversion. begin is called once before any nodes,
+ * then node is called for every node, then way for every way, and finally end
+ * is called once. Every callback is passed user_data as its first argument and
+ * returns nonzero to continue, 0 to abort the conversion. */
+typedef struct {
+	void *user_data;
+	int (*begin)(void *user_data);
+	int (*node)(void *user_data, const Dr2osm_Node *node);
+	int (*way)(void *user_data, const Dr2osm_Way *way);
+	int (*end)(void *user_data);
+
+	/* Optional, may be 0. If a sink provides all of the following, the ways
+	 * are formatted on several threads directly into the output instead of
+	 * being passed to way.
+	 *
+	 * format_way formats way into buffer, writing at most capacity bytes
+	 * and no terminator, and returns the size of the whole formatted way.
+	 * It is called concurrently from several threads.
+	 *
+	 * can_map_output returns nonzero if the output can be mapped at all, so
+	 * that the ways are not sized for nothing. If it can, map_output
+	 * reserves size bytes at the current end of the output and returns a
+	 * pointer to them, or 0 if mapping fails, in which case the ways are
+	 * passed to way as usual. unmap_output is called once the reserved bytes
+	 * have been filled. */
+	size_t (*format_way)(void *user_data, const Dr2osm_Way *way, char *buffer,
+						 size_t capacity);
+	int (*can_map_output)(void *user_data);
+	char *(*map_output)(void *user_data, int64_t size);
+	int (*unmap_output)(void *user_data);
+} Dr2osm_Sink;
+
+/* Tag mapping rule sets for different OSRM profiles. The default profile
+ * keeps every way. The car profile drops footways, the bicycle profile drops
+ * motorways and tags footways as cycleways, and the foot profile drops
+ * motorways and trunk roads. Nodes only referenced by dropped ways are
+ * dropped as well. */
+typedef enum {
+	DR2OSM_PROFILE_DEFAULT,
+	DR2OSM_PROFILE_CAR,
+	DR2OSM_PROFILE_BICYCLE,
+	DR2OSM_PROFILE_FOOT,
+} Dr2osm_Profile;
+
+typedef struct {
+	Dr2osm_Profile profile;
+	Dr2osm_Sink sink;
+} Dr2osm_Output;
+
+#define DR2OSM_MAX_OUTPUTS 8
+#define DR2OSM_MAX_INPUTS 64
+
+typedef struct Dr2osm_Converter Dr2osm_Converter;
+
+/* Returns 0 on error. */
+Dr2osm_Converter *dr2osm_create(void);
+void dr2osm_destroy(Dr2osm_Converter *converter);
+
+/* Opens the Digiroad K-material geopackage at path. path can also be a
+ * snapshot written by an earlier run, see dr2osm_set_snapshot_output. */
+int dr2osm_open_input(Dr2osm_Converter *converter,
+					  const Unicode_Character *path);
+
+/* Opens another Digiroad K-material geopackage at path, for example a
+ * neighbouring region of the first one, which must not be a snapshot. The
+ * inputs are read concurrently, each on its own thread, and their ways are
+ * output in the order the inputs were opened. Nodes shared by several inputs,
+ * such as those on the borders of regions, are only output once. At most
+ * DR2OSM_MAX_INPUTS inputs can be opened. */
+int dr2osm_add_input(Dr2osm_Converter *converter,
+					 const Unicode_Character *path);
+
+/* Opens the OSM PBF file at path, for example an extract of a neighbouring
+ * country, to be merged into the output. Its nodes are output after the
+ * converted nodes and its ways after the converted ways, with their tags
+ * unchanged and new IDs following those of the converted data. The file must
+ * be sorted by type and ID. Elements in several merged files are only output
+ * once. Node tags and relations are not merged, and the profiles of the
+ * outputs do not apply to merged ways. At most DR2OSM_MAX_INPUTS files can be
+ * merged. */
+int dr2osm_add_merge_input(Dr2osm_Converter *converter,
+						   const Unicode_Character *path);
+
+/* Opens the MML ice road geopackage at path. Its ice roads are included in the
+ * output after the Digiroad ways. */
+int dr2osm_open_mml_iceroads(Dr2osm_Converter *converter,
+							 const Unicode_Character *path);
+
+void dr2osm_set_options(Dr2osm_Converter *converter,
+						const Dr2osm_Options *options);
+
+/* Makes dr2osm_run write a snapshot of the processed input to path before
+ * passing anything to the sink. The snapshot contains the deduplicated nodes
+ * and the ways with their source attributes, so a later run can open it as
+ * its input and only redo the tagging and output, for example with different
+ * options or with ice roads added. Passing 0 disables writing a snapshot. */
+int dr2osm_set_snapshot_output(Dr2osm_Converter *converter,
+							   const Unicode_Character *path);
+
+/* Makes dr2osm_run periodically write a checkpoint of the input processed so
+ * far to path, and a final one once all input has been processed. If resume
+ * is nonzero and path holds a checkpoint, the run continues from it instead of
+ * starting over, so a run that failed, for example because the disk filled up
+ * while writing the output, only repeats the work done after the checkpoint.
+ * The inputs must be the same as in the run that wrote the checkpoint. The
+ * checkpoint is removed once the run succeeds. Passing 0 as path disables
+ * checkpoints. */
+int dr2osm_set_checkpoint(Dr2osm_Converter *converter,
+						  const Unicode_Character *path, int resume);
+
+/* Converts the opened inputs and streams the result to sink. A converter can
+ * only be run once. */
+int dr2osm_run(Dr2osm_Converter *converter, const Dr2osm_Sink *sink);
+
+/* Like dr2osm_run, but streams the result to several outputs, each tagged
+ * according to its own profile. The input is only processed once for all of
+ * them. */
+int dr2osm_run_outputs(Dr2osm_Converter *converter,
+					   const Dr2osm_Output *outputs, int num_outputs);
+
+/* Processes the opened inputs like dr2osm_run, keeps the result in memory and
+ * serves extracts of it over a Unix domain socket created at socket_path
+ * until a client sends "quit". Opening a snapshot as the input makes loading
+ * quick. Each connection sends a single request line and receives the
+ * extract, after which the server closes the connection. A request is one of
+ *
+ *     bbox <min-lon> <min-lat> <max-lon> <max-lat> [<format> [<profile>]]
+ *     municipality <code> [<format> [<profile>]]
+ *
+ * A bbox extract contains the ways with at least one node in the WGS 84 box,
+ * a municipality extract the Digiroad ways of the municipality with the given
+ * Statistics Finland code. Either way, all nodes of the included ways are
+ * output. format is xml, o5m or graph and defaults to xml, profile is one of
+ * default, car, bicycle and foot and defaults to default. An invalid request
+ * is answered with a line starting with "error:". Not available on Windows.
+ * Cannot be combined with node_memory_limit or merged files. */
+int dr2osm_serve(Dr2osm_Converter *converter,
+				 const Unicode_Character *socket_path);
+
+/* Starts writing a trace of the conversions and output streams of the process
+ * to the file at path in the Chrome trace event format, which can be opened
+ * in chrome://tracing or Perfetto to see where the time goes. Only one trace
+ * can be written at a time, and it must not be started or stopped while a
+ * conversion is running. Not available in builds with DR2OSM_NO_TRACE
+ * defined. */
+int dr2osm_trace_start(const Unicode_Character *path);
+
+/* Finishes and closes the trace started with dr2osm_trace_start, if any. */
+int dr2osm_trace_stop(void);
+
+typedef struct Dr2osm_Stream Dr2osm_Stream;
+
+/* Opens an output stream writing to the file at path, or to stdout if path is
+ * "-". If path ends with ".gz" or ".zst", the output is compressed with gzip
+ * or zstd respectively, using num_threads worker threads, or one per
+ * processor if num_threads is 0. The compression and the writing to the file
+ * happen in the background, so writing to the stream rarely waits for them.
+ * Returns 0 on error. */
+Dr2osm_Stream *dr2osm_stream_open(const Unicode_Character *path,
+								  int num_threads);
+
+int dr2osm_stream_write(Dr2osm_Stream *stream, const void *data, size_t size);
+
+/* Returns the number of seconds writing to stream has spent waiting for the
+ * background threads to compress or write earlier output. */
+double dr2osm_stream_stall_seconds(const Dr2osm_Stream *stream);
+
+/* Flushes and closes stream. The stream is freed even on error. */
+int dr2osm_stream_close(Dr2osm_Stream *stream);
+
+/* Fills in sink so that it writes OSM XML to output. */
+void dr2osm_xml_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output);
+
+/* Fills in sink so that it writes O5M to output. The state of the writer is
+ * owned by output and freed when it is closed. */
+int dr2osm_o5m_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output);
+
+/* A road graph file, written by dr2osm_graph_sink, is made for tools that
+ * map it into memory and use it in place. It consists of a Dr2osm_Graph_Header
+ * followed by arrays at the given byte offsets from the start of the file,
+ * each aligned to 8 bytes, in the native byte order of the machine that wrote
+ * it, which byte_order_mark is used to check.
+ *
+ * Nodes are numbered from 0 to num_nodes - 1 in the order of their OSM IDs.
+ * node_ids holds their OSM IDs as int32_t and lats and lons their WGS 84
+ * coordinates as doubles.
+ *
+ * The directed edges are stored in compressed sparse row form: the edges
+ * leaving node i are first_edges[i] to first_edges[i + 1] - 1, as int64_t,
+ * and targets holds the node each edge leads to, as int32_t. A way that is
+ * not oneway gets an edge in both directions between each pair of
+ * consecutive nodes, a oneway way only in the direction it can be travelled.
+ *
+ * The attributes of the edges are stored in separate arrays indexed like
+ * targets: way_ids (int32_t), speed_limits in km/h (uint16_t, 0 if unknown),
+ * highways (uint8_t, see Dr2osm_Graph_Highway), flags (uint8_t, see
+ * DR2OSM_EDGE_), max_heights in cm (uint16_t, 0 if none) and max_weights in
+ * kg (uint32_t, 0 if none). */
+#define DR2OSM_GRAPH_MAGIC "DR2OSMGR"
+#define DR2OSM_GRAPH_VERSION 1
+#define DR2OSM_GRAPH_BYTE_ORDER_MARK 0x01020304
+
+typedef enum {
+	DR2OSM_GRAPH_HIGHWAY_NONE,
+	DR2OSM_GRAPH_HIGHWAY_FOOTWAY,
+	DR2OSM_GRAPH_HIGHWAY_MOTORWAY,
+	DR2OSM_GRAPH_HIGHWAY_TRUNK,
+	DR2OSM_GRAPH_HIGHWAY_PRIMARY,
+	DR2OSM_GRAPH_HIGHWAY_SECONDARY,
+	DR2OSM_GRAPH_HIGHWAY_TERTIARY,
+	DR2OSM_GRAPH_HIGHWAY_RESIDENTIAL,
+	DR2OSM_GRAPH_HIGHWAY_UNCLASSIFIED,
+	DR2OSM_GRAPH_HIGHWAY_CYCLEWAY,
+} Dr2osm_Graph_Highway;
+
+/* The way of the edge is oneway. */
+#define DR2OSM_EDGE_ONEWAY 1
+/* The edge runs against the order of the nodes in its way. */
+#define DR2OSM_EDGE_BACKWARD 2
+#define DR2OSM_EDGE_FERRY 4
+#define DR2OSM_EDGE_ICE_ROAD 8
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order_mark;
+	int64_t num_nodes;
+	int64_t num_edges;
+	int64_t node_ids_offset;
+	int64_t lats_offset;
+	int64_t lons_offset;
+	int64_t first_edges_offset;
+	int64_t targets_offset;
+	int64_t way_ids_offset;
+	int64_t speed_limits_offset;
+	int64_t highways_offset;
+	int64_t flags_offset;
+	int64_t max_heights_offset;
+	int64_t max_weights_offset;
+} Dr2osm_Graph_Header;
+
+/* Fills in sink so that it writes the road graph of the ways passed to it to
+ * output, see Dr2osm_Graph_Header. The graph is collected in memory and
+ * written when the sink is ended. The state of the writer is owned by output
+ * and freed when it is closed. */
+int dr2osm_graph_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output);
+
+#endif
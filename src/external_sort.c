@@ -0,0 +1,346 @@
+/* Sorting of more records than fit in memory, see External_Sorter in
+ * types.h. */
+
+/* Chunks smaller than this are not worth sorting on a separate thread. */
+#define MIN_SORT_CHUNK_RECORDS 65536
+
+/* Initializes sorter to sort records of record_size bytes with compare, using
+ * a buffer of at most memory_limit bytes and num_threads threads.
+ * Returns nonzero on success, 0 on error. */
+static int init_sorter(External_Sorter *sorter, size_t record_size,
+					   Compare_Function *compare, int64_t memory_limit,
+					   int num_threads)
+{
+	memset(sorter, 0, sizeof(External_Sorter));
+	sorter->record_size = record_size;
+	sorter->compare = compare;
+	sorter->num_threads = num_threads;
+	sorter->capacity = memory_limit / record_size;
+
+	if (sorter->capacity < 1024)
+	{
+		sorter->capacity = 1024;
+	}
+
+	sorter->buffer = malloc(sorter->capacity * record_size);
+
+	if (!sorter->buffer)
+	{
+		fprintf(stderr, "Unable to allocate sort buffer: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static void free_sorter(External_Sorter *sorter)
+{
+	if (sorter->file)
+	{
+		fclose(sorter->file);
+	}
+
+	free(sorter->buffer);
+	free(sorter->runs);
+	free(sorter->heap);
+	memset(sorter, 0, sizeof(External_Sorter));
+}
+
+static void sort_chunk(void *argument)
+{
+	Sort_Job *job = argument;
+
+	qsort(job->records, job->num_records, job->record_size, job->compare);
+}
+
+/* Sorts the buffered records in chunks on several threads and adds each chunk
+ * as a run, either in place or, if write is nonzero, appended to the file.
+ * Returns nonzero on success, 0 on error. */
+static int sort_buffer(External_Sorter *sorter, int write)
+{
+	int num_chunks = (int)(sorter->num_buffered / MIN_SORT_CHUNK_RECORDS);
+
+	if (num_chunks > sorter->num_threads)
+	{
+		num_chunks = sorter->num_threads;
+	}
+
+	if (num_chunks < 1)
+	{
+		num_chunks = 1;
+	}
+
+	Sort_Job jobs[64];
+	size_t chunk_size = (sorter->num_buffered + num_chunks - 1) / num_chunks;
+
+	for (int i = 0; i < num_chunks; i++)
+	{
+		size_t first = i * chunk_size;
+		size_t end = first + chunk_size < sorter->num_buffered
+						 ? first + chunk_size
+						 : sorter->num_buffered;
+
+		jobs[i].records = sorter->buffer + first * sorter->record_size;
+		jobs[i].num_records = end - first;
+		jobs[i].record_size = sorter->record_size;
+		jobs[i].compare = sorter->compare;
+	}
+
+	run_jobs(sort_chunk, jobs, num_chunks, sizeof(Sort_Job));
+
+	Sort_Run *runs =
+		realloc(sorter->runs, (sorter->num_runs + num_chunks) * sizeof(Sort_Run));
+
+	if (!runs)
+	{
+		fprintf(stderr, "Unable to allocate sort runs: %s\n", strerror(errno));
+		return 0;
+	}
+
+	sorter->runs = runs;
+
+	if (write && !sorter->file && !(sorter->file = tmpfile()))
+	{
+		fprintf(stderr, "Unable to create temporary file: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	for (int i = 0; i < num_chunks; i++)
+	{
+		Sort_Run *run = &sorter->runs[sorter->num_runs++];
+		memset(run, 0, sizeof(Sort_Run));
+
+		if (!write)
+		{
+			run->records = jobs[i].records;
+			run->num_records = jobs[i].num_records;
+			continue;
+		}
+
+		run->file_offset = sorter->file_size;
+		run->file_records = jobs[i].num_records;
+
+		if (jobs[i].num_records
+			&& fwrite(jobs[i].records, jobs[i].num_records * sorter->record_size,
+					  1, sorter->file) != 1)
+		{
+			fprintf(stderr, "Unable to write temporary file: %s\n",
+					strerror(errno));
+			return 0;
+		}
+
+		sorter->file_size += jobs[i].num_records * sorter->record_size;
+	}
+
+	sorter->num_buffered = 0;
+
+	return 1;
+}
+
+/* Adds a copy of record to the records to be sorted. Errors are recorded in
+ * sorter->failed, after which further records are ignored. */
+static void sorter_push(External_Sorter *sorter, const void *record)
+{
+	if (sorter->failed)
+	{
+		return;
+	}
+
+	if (sorter->num_buffered == sorter->capacity && !sort_buffer(sorter, 1))
+	{
+		sorter->failed = 1;
+		return;
+	}
+
+	memcpy(sorter->buffer + sorter->num_buffered * sorter->record_size, record,
+		   sorter->record_size);
+	sorter->num_buffered++;
+}
+
+/* Reads the next records of run from the file into its buffer.
+ * Returns nonzero on success, 0 on error. */
+static int refill_run(External_Sorter *sorter, Sort_Run *run)
+{
+	size_t count = run->buffer_size / sorter->record_size;
+
+	if ((int64_t)count > run->file_records)
+	{
+		count = (size_t)run->file_records;
+	}
+
+	if (FSEEK64(sorter->file, run->file_offset, SEEK_SET)
+		|| fread(run->records, count * sorter->record_size, 1, sorter->file)
+			   != 1)
+	{
+		fprintf(stderr, "Unable to read temporary file: %s\n",
+				feof(sorter->file) ? "Unexpected end of file" : strerror(errno));
+		return 0;
+	}
+
+	run->num_records = count;
+	run->next_record = 0;
+	run->file_offset += count * sorter->record_size;
+	run->file_records -= count;
+
+	return 1;
+}
+
+/* Returns nonzero if the next record of run a sorts before that of run b. */
+static int run_before(External_Sorter *sorter, int a, int b)
+{
+	Sort_Run *run_a = &sorter->runs[a];
+	Sort_Run *run_b = &sorter->runs[b];
+	int order = sorter->compare(
+		run_a->records + run_a->next_record * sorter->record_size,
+		run_b->records + run_b->next_record * sorter->record_size);
+
+	return order < 0 || (order == 0 && a < b);
+}
+
+/* Moves the run at index down the merge heap to its place. */
+static void sift_down(External_Sorter *sorter, int index)
+{
+	int *heap = sorter->heap;
+
+	while (1)
+	{
+		int smallest = index;
+		int left = 2 * index + 1;
+		int right = left + 1;
+
+		if (left < sorter->heap_size && run_before(sorter, heap[left], heap[smallest]))
+		{
+			smallest = left;
+		}
+
+		if (right < sorter->heap_size
+			&& run_before(sorter, heap[right], heap[smallest]))
+		{
+			smallest = right;
+		}
+
+		if (smallest == index)
+		{
+			return;
+		}
+
+		int swap = heap[index];
+		heap[index] = heap[smallest];
+		heap[smallest] = swap;
+		index = smallest;
+	}
+}
+
+/* Sorts the records that are still buffered and prepares merging all runs.
+ * If every record fit in the buffer, nothing is written to the file and the
+ * runs are merged in memory. Otherwise the buffer is split between the runs
+ * in the file for reading them.
+ * Returns nonzero on success, 0 on error. */
+static int finish_sorter(External_Sorter *sorter)
+{
+	if (sorter->failed || !sort_buffer(sorter, sorter->file != 0))
+	{
+		sorter->failed = 1;
+		return 0;
+	}
+
+	sorter->heap = malloc(sorter->num_runs * sizeof(int));
+
+	if (!sorter->heap)
+	{
+		fprintf(stderr, "Unable to allocate sort runs: %s\n", strerror(errno));
+		sorter->failed = 1;
+		return 0;
+	}
+
+	size_t run_buffer_size =
+		sorter->capacity / sorter->num_runs * sorter->record_size;
+
+	if (sorter->file && !run_buffer_size)
+	{
+		fprintf(stderr, "Too little memory to merge %d sorted runs.\n",
+				sorter->num_runs);
+		sorter->failed = 1;
+		return 0;
+	}
+
+	for (int i = 0; i < sorter->num_runs; i++)
+	{
+		Sort_Run *run = &sorter->runs[i];
+
+		if (sorter->file)
+		{
+			run->records = sorter->buffer + i * run_buffer_size;
+			run->buffer_size = run_buffer_size;
+
+			if (run->file_records && !refill_run(sorter, run))
+			{
+				sorter->failed = 1;
+				return 0;
+			}
+		}
+
+		if (run->num_records)
+		{
+			sorter->heap[sorter->heap_size++] = i;
+		}
+	}
+
+	for (int i = sorter->heap_size / 2 - 1; i >= 0; i--)
+	{
+		sift_down(sorter, i);
+	}
+
+	return 1;
+}
+
+/* Returns the next record in sorted order, which is valid until the next
+ * call, or 0 after the last record and on error, in which case
+ * sorter->failed is set. */
+static const void *sorter_next(External_Sorter *sorter)
+{
+	if (sorter->failed)
+	{
+		return 0;
+	}
+
+	/* The previously returned record is only consumed now, as consuming it
+	 * can overwrite it with the next records of its run. */
+	if (sorter->consume_pending)
+	{
+		Sort_Run *run = &sorter->runs[sorter->heap[0]];
+
+		sorter->consume_pending = 0;
+
+		if (++run->next_record == run->num_records)
+		{
+			if (run->file_records)
+			{
+				if (!refill_run(sorter, run))
+				{
+					sorter->failed = 1;
+					return 0;
+				}
+			}
+			else
+			{
+				sorter->heap[0] = sorter->heap[--sorter->heap_size];
+			}
+		}
+
+		sift_down(sorter, 0);
+	}
+
+	if (!sorter->heap_size)
+	{
+		return 0;
+	}
+
+	Sort_Run *run = &sorter->runs[sorter->heap[0]];
+
+	sorter->consume_pending = 1;
+
+	return run->records + run->next_record * sorter->record_size;
+}
@@ -0,0 +1,132 @@
+/* Uniform grid over the nodes of a node index, for finding the nearest node to
+ * a point. See Node_Grid in types.h. */
+
+/* Returns the grid cell coordinate of the coordinate value. */
+static int get_grid_cell(const Node_Grid *grid, int value)
+{
+	return value >= 0 ? value / grid->cell_size
+					  : -((-value - 1) / grid->cell_size) - 1;
+}
+
+static size_t get_grid_bucket(const Node_Grid *grid, int cell_x, int cell_y)
+{
+	uint64_t hash = (uint64_t)(uint32_t)cell_x * 0x9e3779b97f4a7c15u
+					^ (uint64_t)(uint32_t)cell_y * 0xc2b2ae3d27d4eb4fu;
+
+	return (size_t)(hash >> 32) & (grid->num_buckets - 1);
+}
+
+static void free_node_grid(Node_Grid *grid)
+{
+	free(grid->bucket_starts);
+	free(grid->nodes);
+	memset(grid, 0, sizeof(Node_Grid));
+}
+
+/* Builds grid over the nodes with an ID in index, with cells of cell_size
+ * units. The nodes are bucketed with a counting sort, so each bucket holds its
+ * nodes in the order of their IDs.
+ * Returns nonzero on success, 0 on error. */
+static int build_node_grid(Node_Grid *grid, const Node_Index *index,
+						   int cell_size)
+{
+	size_t num_nodes = (size_t)index->num_nodes;
+
+	memset(grid, 0, sizeof(Node_Grid));
+	grid->cell_size = cell_size > 0 ? cell_size : 1;
+	grid->num_buckets = 1;
+
+	while (grid->num_buckets < num_nodes)
+	{
+		grid->num_buckets *= 2;
+	}
+
+	grid->bucket_starts = calloc(grid->num_buckets + 1, sizeof(size_t));
+	grid->nodes = malloc((num_nodes ? num_nodes : 1) * sizeof(Grid_Node));
+
+	if (!grid->bucket_starts || !grid->nodes)
+	{
+		fprintf(stderr, "Unable to allocate node grid: %s\n", strerror(errno));
+		free_node_grid(grid);
+		return 0;
+	}
+
+	for (int i = 0; i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+		size_t bucket = get_grid_bucket(grid, get_grid_cell(grid, node->x),
+										get_grid_cell(grid, node->y));
+		grid->bucket_starts[bucket + 1]++;
+	}
+
+	for (size_t i = 0; i < grid->num_buckets; i++)
+	{
+		grid->bucket_starts[i + 1] += grid->bucket_starts[i];
+	}
+
+	/* Fill the buckets using their starts as cursors, which shifts each
+	 * start to the next bucket, and shift them back afterwards. */
+	for (int i = 0; i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+		size_t bucket = get_grid_bucket(grid, get_grid_cell(grid, node->x),
+										get_grid_cell(grid, node->y));
+		Grid_Node *grid_node = &grid->nodes[grid->bucket_starts[bucket]++];
+
+		grid_node->x = node->x;
+		grid_node->y = node->y;
+		grid_node->id = node->id;
+	}
+
+	for (size_t i = grid->num_buckets; i > 0; i--)
+	{
+		grid->bucket_starts[i] = grid->bucket_starts[i - 1];
+	}
+
+	grid->bucket_starts[0] = 0;
+
+	return 1;
+}
+
+/* Returns the node in grid nearest to x, y that is at most max_distance units
+ * away, or 0 if there is none. Of equally near nodes the one created first is
+ * returned. max_distance must not exceed the cell size of grid. */
+static const Grid_Node *find_nearest_node(const Node_Grid *grid, int x, int y,
+										  int max_distance)
+{
+	assert(max_distance <= grid->cell_size);
+
+	const Grid_Node *result = 0;
+	int64_t result_distance = (int64_t)max_distance * max_distance;
+	int cell_x = get_grid_cell(grid, x);
+	int cell_y = get_grid_cell(grid, y);
+
+	for (int i = -1; i <= 1; i++)
+	{
+		for (int j = -1; j <= 1; j++)
+		{
+			size_t bucket = get_grid_bucket(grid, cell_x + i, cell_y + j);
+			const Grid_Node *node = grid->nodes + grid->bucket_starts[bucket];
+			const Grid_Node *end = grid->nodes + grid->bucket_starts[bucket + 1];
+
+			/* Buckets are shared by cells with the same hash, so the nodes
+			 * are checked by their distance only. */
+			for (; node < end; node++)
+			{
+				int64_t dx = node->x - x;
+				int64_t dy = node->y - y;
+				int64_t distance = dx * dx + dy * dy;
+
+				if (distance < result_distance
+					|| (distance == result_distance
+						&& (!result || node->id < result->id)))
+				{
+					result = node;
+					result_distance = distance;
+				}
+			}
+		}
+	}
+
+	return result;
+}
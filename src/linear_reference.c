@@ -0,0 +1,254 @@
+/* Digiroad gives the speed limits and the maximum heights and weights of a
+ * link as ranges in metres along the link from its first point, and a link
+ * can have several of each. Every link is read once with all of its ranges
+ * and split into stretches at the ends of the ranges, each of which is output
+ * as a way of its own with the values that apply along it. */
+
+/* Range ends closer than this many metres to each other or to the ends of the
+ * link are taken to be the same point, so that measures rounded in the source
+ * data do not produce slivers. */
+#define LINEAR_REFERENCE_TOLERANCE 1.0
+
+/* Reads the ranges listed in text into ranges, returning their number. The
+ * ranges are separated by commas and each is the value and the start and end
+ * measures separated by spaces, as the Digiroad query lists them. Ranges
+ * without a positive value or length are left out, as are those beyond
+ * MAX_LINK_RANGES. */
+static int parse_attribute_ranges(const unsigned char *text,
+								  Attribute_Range *ranges)
+{
+	const char *p = (const char *)text;
+	int result = 0;
+
+	while (*p && result < MAX_LINK_RANGES)
+	{
+		char *end;
+		double value = strtod(p, &end);
+		double start = strtod(end, &end);
+		double stop = strtod(end, &end);
+
+		if (value >= 1 && value <= INT_MAX && stop > start)
+		{
+			ranges[result].start = start;
+			ranges[result].end = stop;
+			ranges[result].value = (int)value;
+			result++;
+		}
+
+		if (*end != ',')
+		{
+			break;
+		}
+
+		p = end + 1;
+	}
+
+	return result;
+}
+
+/* Returns the length of the line string of num_points points of point_stride
+ * coordinates at points. */
+static double get_line_string_length(const double *points, int num_points,
+									 int point_stride)
+{
+	double result = 0;
+
+	for (int i = 1; i < num_points; i++)
+	{
+		const double *p = points + (i - 1) * point_stride;
+		const double *q = p + point_stride;
+
+		result += sqrt((q[0] - p[0]) * (q[0] - p[0])
+					   + (q[1] - p[1]) * (q[1] - p[1]));
+	}
+
+	return result;
+}
+
+/* Returns measure clamped onto a link of length metres, snapping it to the
+ * ends of the link if it is within the tolerance of them. */
+static double snap_measure(double measure, double length)
+{
+	if (measure < LINEAR_REFERENCE_TOLERANCE)
+	{
+		return 0;
+	}
+
+	if (measure > length - LINEAR_REFERENCE_TOLERANCE)
+	{
+		return length;
+	}
+
+	return measure;
+}
+
+static int compare_measures(const void *a, const void *b)
+{
+	double measure_a = *(const double *)a;
+	double measure_b = *(const double *)b;
+
+	return (measure_a > measure_b) - (measure_a < measure_b);
+}
+
+/* Splits a link of length metres with the attribute ranges ranges into the
+ * stretches along which none of the ranged attributes changes, storing them
+ * in order in stretches, which must have room for MAX_LINK_STRETCHES. The
+ * stretches cover the whole link. Where ranges of an attribute overlap, the
+ * lowest value applies, as they are all upper limits; in Digiroad such
+ * ranges usually give the limits of the two sides of the road.
+ * Returns the number of stretches, which is at least 1. */
+static int split_link(double length, const Link_Ranges *ranges,
+					  Link_Stretch *stretches)
+{
+	double bounds[MAX_LINK_STRETCHES + 1];
+	int num_bounds = 0;
+
+	bounds[num_bounds++] = 0;
+	bounds[num_bounds++] = length;
+
+	for (int i = 0; i < NUM_RANGED_ATTRIBUTES; i++)
+	{
+		for (int j = 0; j < ranges->num_ranges[i]; j++)
+		{
+			const Attribute_Range *range = &ranges->ranges[i][j];
+
+			bounds[num_bounds++] = snap_measure(range->start, length);
+			bounds[num_bounds++] = snap_measure(range->end, length);
+		}
+	}
+
+	qsort(bounds, num_bounds, sizeof(double), compare_measures);
+
+	int num_distinct = 1;
+
+	for (int i = 1; i < num_bounds; i++)
+	{
+		if (bounds[i] - bounds[num_distinct - 1] > LINEAR_REFERENCE_TOLERANCE)
+		{
+			bounds[num_distinct++] = bounds[i];
+		}
+	}
+
+	/* The bounds dropped as duplicates may include the ends of the link, but
+	 * the stretches must reach them so that the end nodes are output. A link
+	 * shorter than the tolerance is a single stretch. */
+	bounds[0] = 0;
+
+	if (num_distinct < 2)
+	{
+		num_distinct++;
+	}
+
+	bounds[num_distinct - 1] = length;
+
+	int result = 0;
+
+	for (int i = 0; i + 1 < num_distinct; i++)
+	{
+		double middle = (bounds[i] + bounds[i + 1]) / 2;
+		Link_Stretch stretch;
+
+		stretch.start = bounds[i];
+		stretch.end = bounds[i + 1];
+
+		for (int j = 0; j < NUM_RANGED_ATTRIBUTES; j++)
+		{
+			stretch.values[j] = 0;
+
+			for (int k = 0; k < ranges->num_ranges[j]; k++)
+			{
+				const Attribute_Range *range = &ranges->ranges[j][k];
+
+				if (snap_measure(range->start, length) <= middle
+					&& snap_measure(range->end, length) >= middle
+					&& (!stretch.values[j] || range->value < stretch.values[j]))
+				{
+					stretch.values[j] = range->value;
+				}
+			}
+		}
+
+		/* Neighbouring stretches with the same values are merged. */
+		if (result && !memcmp(stretches[result - 1].values, stretch.values,
+							  sizeof(stretch.values)))
+		{
+			stretches[result - 1].end = stretch.end;
+		}
+		else
+		{
+			stretches[result++] = stretch;
+		}
+	}
+
+	return result;
+}
+
+/* Stores in output the point at measure metres along the segment from p to q,
+ * which starts at segment_start metres and is segment_length metres long. */
+static void interpolate_measure(const double *p, const double *q,
+								double segment_start, double segment_length,
+								double measure, double *output)
+{
+	double t = segment_length > 0 ? (measure - segment_start) / segment_length
+								  : 0;
+
+	t = t < 0 ? 0 : t > 1 ? 1 : t;
+	output[0] = p[0] + t * (q[0] - p[0]);
+	output[1] = p[1] + t * (q[1] - p[1]);
+}
+
+/* Stores in output the points of the part of the line string of num_points
+ * points of point_stride coordinates at points from start to end metres
+ * along it, as x and y. output must have room for num_points + 2 points.
+ * Returns the number of points stored. */
+static int cut_line_string(const double *points, int num_points,
+						   int point_stride, double start, double end,
+						   double *output)
+{
+	double segment_start = 0;
+	int result = 0;
+
+	for (int i = 1; i < num_points; i++)
+	{
+		const double *p = points + (i - 1) * point_stride;
+		const double *q = p + point_stride;
+		double segment_length = sqrt((q[0] - p[0]) * (q[0] - p[0])
+									 + (q[1] - p[1]) * (q[1] - p[1]));
+		double segment_end = segment_start + segment_length;
+
+		if (!result && start <= segment_end)
+		{
+			interpolate_measure(p, q, segment_start, segment_length, start,
+								output);
+			result++;
+		}
+
+		if (result && end <= segment_end)
+		{
+			interpolate_measure(p, q, segment_start, segment_length, end,
+								output + 2 * result);
+			return result + 1;
+		}
+
+		if (result)
+		{
+			output[2 * result] = q[0];
+			output[2 * result + 1] = q[1];
+			result++;
+		}
+
+		segment_start = segment_end;
+	}
+
+	/* Measures past the end due to rounding end at the last point. */
+	if (!result && num_points)
+	{
+		const double *last = points + (num_points - 1) * point_stride;
+
+		output[0] = last[0];
+		output[1] = last[1];
+		result++;
+	}
+
+	return result;
+}
@@ -0,0 +1,957 @@
+/* Reading of OSM PBF files merged into the output, such as the extracts of
+ * the neighbouring countries. A Pbf_Reader goes through the nodes or the ways
+ * of a file in the order of their IDs, one primitive block at a time, so only
+ * the block being read is kept in memory. The files must be sorted by type
+ * and ID, as extracts from Geofabrik and files written by osmium are. See
+ * https://wiki.openstreetmap.org/wiki/PBF_Format for the format. */
+
+#define PBF_MAX_HEADER_SIZE (64 * 1024)
+#define PBF_MAX_BLOB_SIZE (32 * 1024 * 1024)
+
+/* Grows *array to hold at least count elements of element_size bytes.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_reserve(void **array, size_t *capacity, size_t count,
+					   size_t element_size)
+{
+	if (count <= *capacity)
+	{
+		return 1;
+	}
+
+	size_t new_capacity = *capacity ? *capacity : 1024;
+
+	while (new_capacity < count)
+	{
+		new_capacity *= 2;
+	}
+
+	void *new_array = realloc(*array, new_capacity * element_size);
+
+	if (!new_array)
+	{
+		fprintf(stderr, "Unable to allocate PBF reader: %s\n", strerror(errno));
+		return 0;
+	}
+
+	*array = new_array;
+	*capacity = new_capacity;
+
+	return 1;
+}
+
+/* Protobuf decoding. Reading past the end of a message or a malformed value
+ * sets the failed flag of the message, after which the reads return 0. */
+
+static uint64_t pbf_read_varint(Pbf_Message *message)
+{
+	uint64_t result = 0;
+
+	for (int shift = 0; shift < 64 && message->data < message->end; shift += 7)
+	{
+		uint8_t byte = *message->data++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80))
+		{
+			return result;
+		}
+	}
+
+	message->failed = 1;
+	message->data = message->end;
+
+	return 0;
+}
+
+static int64_t pbf_read_sint(Pbf_Message *message)
+{
+	uint64_t value = pbf_read_varint(message);
+
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Reads a length-delimited value, such as a string, an embedded message or
+ * a packed array, as a message of its own. */
+static Pbf_Message pbf_read_bytes(Pbf_Message *message)
+{
+	Pbf_Message result = {0};
+	uint64_t size = pbf_read_varint(message);
+
+	if (message->failed || size > (uint64_t)(message->end - message->data))
+	{
+		message->failed = 1;
+		message->data = message->end;
+		result.failed = 1;
+		return result;
+	}
+
+	result.data = message->data;
+	result.end = message->data + size;
+	message->data += size;
+
+	return result;
+}
+
+/* Reads the key of the next field of message.
+ * Returns nonzero if there is one, 0 at the end of the message or on error. */
+static int pbf_next_field(Pbf_Message *message, int *field, int *wire_type)
+{
+	if (message->failed || message->data >= message->end)
+	{
+		return 0;
+	}
+
+	uint64_t key = pbf_read_varint(message);
+
+	*field = (int)(key >> 3);
+	*wire_type = (int)(key & 7);
+
+	return !message->failed;
+}
+
+static void pbf_skip_field(Pbf_Message *message, int wire_type)
+{
+	size_t size = 0;
+
+	switch (wire_type)
+	{
+	case 0:
+		pbf_read_varint(message);
+		return;
+
+	case 1:
+		size = 8;
+		break;
+
+	case 2:
+		pbf_read_bytes(message);
+		return;
+
+	case 5:
+		size = 4;
+		break;
+
+	default:
+		message->failed = 1;
+		return;
+	}
+
+	if (size > (size_t)(message->end - message->data))
+	{
+		message->failed = 1;
+		message->data = message->end;
+		return;
+	}
+
+	message->data += size;
+}
+
+/* Returns nonzero if message is the string string. */
+static int pbf_string_equals(const Pbf_Message *message, const char *string)
+{
+	size_t size = strlen(string);
+
+	return (size_t)(message->end - message->data) == size
+		   && !memcmp(message->data, string, size);
+}
+
+static int pbf_error(Pbf_Reader *reader, const char *message)
+{
+	fprintf(stderr, "Unable to read \"" FORMAT_UNICODE_STRING "\": %s\n",
+			reader->path, message);
+
+	return -1;
+}
+
+/* Reads size bytes from the file of reader into data.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_file(Pbf_Reader *reader, void *data, size_t size)
+{
+	if (size && fread(data, size, 1, reader->file) != 1)
+	{
+		pbf_error(reader, ferror(reader->file) ? strerror(errno)
+											   : "Unexpected end of file");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Reads the next blob of the file of reader and decompresses it into the
+ * block buffer of reader. *is_data and *is_header are set to whether it is
+ * an OSMData or an OSMHeader blob, other types can be skipped.
+ * Returns 1 on success, 0 at the end of the file and -1 on error. */
+static int pbf_read_blob(Pbf_Reader *reader, int *is_data, int *is_header)
+{
+	uint8_t size_bytes[4];
+	size_t num_read = fread(size_bytes, 1, sizeof(size_bytes), reader->file);
+
+	if (num_read == 0 && feof(reader->file))
+	{
+		return 0;
+	}
+
+	if (num_read != sizeof(size_bytes))
+	{
+		return pbf_error(reader, ferror(reader->file) ? strerror(errno)
+													  : "Truncated blob");
+	}
+
+	uint32_t header_size = (uint32_t)size_bytes[0] << 24
+						   | (uint32_t)size_bytes[1] << 16
+						   | (uint32_t)size_bytes[2] << 8 | size_bytes[3];
+
+	if (header_size > PBF_MAX_HEADER_SIZE)
+	{
+		return pbf_error(reader, "Blob header is too large");
+	}
+
+	if (!pbf_reserve((void **)&reader->blob, &reader->blob_capacity,
+					 header_size, 1)
+		|| !pbf_read_file(reader, reader->blob, header_size))
+	{
+		return -1;
+	}
+
+	/* BlobHeader: type (1) and datasize (3). */
+	Pbf_Message header = {reader->blob, reader->blob + header_size, 0};
+	uint64_t data_size = 0;
+	int field, wire_type;
+
+	*is_data = 0;
+	*is_header = 0;
+
+	while (pbf_next_field(&header, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 2)
+		{
+			Pbf_Message type = pbf_read_bytes(&header);
+
+			*is_data = pbf_string_equals(&type, "OSMData");
+			*is_header = pbf_string_equals(&type, "OSMHeader");
+		}
+		else if (field == 3 && wire_type == 0)
+		{
+			data_size = pbf_read_varint(&header);
+		}
+		else
+		{
+			pbf_skip_field(&header, wire_type);
+		}
+	}
+
+	if (header.failed)
+	{
+		return pbf_error(reader, "Invalid blob header");
+	}
+
+	if (data_size > PBF_MAX_BLOB_SIZE)
+	{
+		return pbf_error(reader, "Blob is too large");
+	}
+
+	if (!pbf_reserve((void **)&reader->blob, &reader->blob_capacity,
+					 (size_t)data_size, 1)
+		|| !pbf_read_file(reader, reader->blob, (size_t)data_size))
+	{
+		return -1;
+	}
+
+	/* Blob: raw (1), raw_size (2), zlib_data (3) and zstd_data (7). */
+	Pbf_Message blob = {reader->blob, reader->blob + data_size, 0};
+	Pbf_Message data = {0};
+	int compression = -1;
+	uint64_t raw_size = 0;
+
+	while (pbf_next_field(&blob, &field, &wire_type))
+	{
+		if (field == 2 && wire_type == 0)
+		{
+			raw_size = pbf_read_varint(&blob);
+		}
+		else if ((field == 1 || field == 3 || field == 7) && wire_type == 2)
+		{
+			data = pbf_read_bytes(&blob);
+			compression = field == 1   ? COMPRESSION_NONE
+						  : field == 3 ? COMPRESSION_GZIP
+									   : COMPRESSION_ZSTD;
+		}
+		else if (wire_type == 2 && field >= 4 && field <= 6)
+		{
+			return pbf_error(reader, "Unsupported blob compression");
+		}
+		else
+		{
+			pbf_skip_field(&blob, wire_type);
+		}
+	}
+
+	if (blob.failed || compression < 0)
+	{
+		return pbf_error(reader, "Invalid blob");
+	}
+
+	if (compression == COMPRESSION_NONE)
+	{
+		raw_size = (uint64_t)(data.end - data.data);
+	}
+
+	if (raw_size > PBF_MAX_BLOB_SIZE)
+	{
+		return pbf_error(reader, "Blob is too large");
+	}
+
+	if (!pbf_reserve((void **)&reader->block, &reader->block_capacity,
+					 (size_t)raw_size, 1))
+	{
+		return -1;
+	}
+
+	reader->block_size = (size_t)raw_size;
+
+	if (compression == COMPRESSION_NONE)
+	{
+		memcpy(reader->block, data.data, reader->block_size);
+	}
+	else if (compression == COMPRESSION_GZIP)
+	{
+		uLongf size = (uLongf)raw_size;
+
+		if (uncompress(reader->block, &size, data.data,
+					   (uLong)(data.end - data.data))
+				!= Z_OK
+			|| size != raw_size)
+		{
+			return pbf_error(reader, "Invalid zlib data");
+		}
+	}
+	else
+	{
+#if defined(HAVE_ZSTD)
+		size_t size = ZSTD_decompress(reader->block, (size_t)raw_size,
+									  data.data, data.end - data.data);
+
+		if (ZSTD_isError(size) || size != raw_size)
+		{
+			return pbf_error(reader, "Invalid zstd data");
+		}
+#else
+		return pbf_error(reader, "zstd support is not compiled in");
+#endif
+	}
+
+	return 1;
+}
+
+/* Copies the string table of the block being decoded into the string buffer
+ * of reader, so that its strings can be used with terminators.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_string_table(Pbf_Reader *reader, Pbf_Message table)
+{
+	Pbf_Message counting = table;
+	size_t num_strings = 0;
+	size_t total_size = 0;
+	int field, wire_type;
+
+	while (pbf_next_field(&counting, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 2)
+		{
+			Pbf_Message string = pbf_read_bytes(&counting);
+
+			num_strings++;
+			total_size += (size_t)(string.end - string.data) + 1;
+		}
+		else
+		{
+			pbf_skip_field(&counting, wire_type);
+		}
+	}
+
+	if (counting.failed)
+	{
+		pbf_error(reader, "Invalid string table");
+		return 0;
+	}
+
+	if (!pbf_reserve((void **)&reader->strings, &reader->strings_capacity,
+					 total_size, 1)
+		|| !pbf_reserve((void **)&reader->string_table,
+						&reader->string_table_capacity, num_strings,
+						sizeof(const char *)))
+	{
+		return 0;
+	}
+
+	char *next = reader->strings;
+	reader->num_strings = 0;
+
+	while (pbf_next_field(&table, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 2)
+		{
+			Pbf_Message string = pbf_read_bytes(&table);
+			size_t size = (size_t)(string.end - string.data);
+
+			memcpy(next, string.data, size);
+			next[size] = 0;
+			reader->string_table[reader->num_strings++] = next;
+			next += size + 1;
+		}
+		else
+		{
+			pbf_skip_field(&table, wire_type);
+		}
+	}
+
+	return 1;
+}
+
+/* Appends a node to the elements of reader.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_push_node(Pbf_Reader *reader, const Pbf_Block_Scale *scale,
+						 int64_t id, int64_t lat, int64_t lon)
+{
+	if (!pbf_reserve((void **)&reader->nodes, &reader->node_capacity,
+					 reader->num_elements + 1, sizeof(Pbf_Node)))
+	{
+		return 0;
+	}
+
+	Pbf_Node *node = &reader->nodes[reader->num_elements++];
+	node->id = id;
+	node->lat = 1e-9 * (scale->lat_offset + scale->granularity * lat);
+	node->lon = 1e-9 * (scale->lon_offset + scale->granularity * lon);
+
+	return 1;
+}
+
+/* Decodes the delta coded nodes of a DenseNodes message. Their tags are not
+ * needed and skipped.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_dense_nodes(Pbf_Reader *reader,
+								const Pbf_Block_Scale *scale,
+								Pbf_Message dense)
+{
+	Pbf_Message ids = {0}, lats = {0}, lons = {0};
+	int field, wire_type;
+
+	while (pbf_next_field(&dense, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 2)
+		{
+			ids = pbf_read_bytes(&dense);
+		}
+		else if (field == 8 && wire_type == 2)
+		{
+			lats = pbf_read_bytes(&dense);
+		}
+		else if (field == 9 && wire_type == 2)
+		{
+			lons = pbf_read_bytes(&dense);
+		}
+		else
+		{
+			pbf_skip_field(&dense, wire_type);
+		}
+	}
+
+	int64_t id = 0, lat = 0, lon = 0;
+
+	while (!dense.failed && ids.data < ids.end)
+	{
+		id += pbf_read_sint(&ids);
+		lat += pbf_read_sint(&lats);
+		lon += pbf_read_sint(&lons);
+
+		if (ids.failed || lats.failed || lons.failed)
+		{
+			break;
+		}
+
+		if (!pbf_push_node(reader, scale, id, lat, lon))
+		{
+			return 0;
+		}
+	}
+
+	if (dense.failed || ids.failed || lats.failed || lons.failed
+		|| lats.data != lats.end || lons.data != lons.end)
+	{
+		pbf_error(reader, "Invalid dense nodes");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Decodes a Node message, ignoring its tags.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_node(Pbf_Reader *reader, const Pbf_Block_Scale *scale,
+						 Pbf_Message node)
+{
+	int64_t id = 0, lat = 0, lon = 0;
+	int field, wire_type;
+
+	while (pbf_next_field(&node, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 0)
+		{
+			id = pbf_read_sint(&node);
+		}
+		else if (field == 8 && wire_type == 0)
+		{
+			lat = pbf_read_sint(&node);
+		}
+		else if (field == 9 && wire_type == 0)
+		{
+			lon = pbf_read_sint(&node);
+		}
+		else
+		{
+			pbf_skip_field(&node, wire_type);
+		}
+	}
+
+	if (node.failed)
+	{
+		pbf_error(reader, "Invalid node");
+		return 0;
+	}
+
+	return pbf_push_node(reader, scale, id, lat, lon);
+}
+
+/* Decodes a Way message with its node references and tags.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_way(Pbf_Reader *reader, Pbf_Message message)
+{
+	Pbf_Message keys = {0}, values = {0}, refs = {0};
+	int64_t id = 0;
+	int field, wire_type;
+
+	while (pbf_next_field(&message, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 0)
+		{
+			id = (int64_t)pbf_read_varint(&message);
+		}
+		else if (field == 2 && wire_type == 2)
+		{
+			keys = pbf_read_bytes(&message);
+		}
+		else if (field == 3 && wire_type == 2)
+		{
+			values = pbf_read_bytes(&message);
+		}
+		else if (field == 8 && wire_type == 2)
+		{
+			refs = pbf_read_bytes(&message);
+		}
+		else
+		{
+			pbf_skip_field(&message, wire_type);
+		}
+	}
+
+	if (!pbf_reserve((void **)&reader->ways, &reader->way_capacity,
+					 reader->num_elements + 1, sizeof(Pbf_Way)))
+	{
+		return 0;
+	}
+
+	Pbf_Way *way = &reader->ways[reader->num_elements];
+	way->id = id;
+	way->first_ref = reader->num_refs;
+	way->first_tag = reader->num_tags;
+
+	for (int64_t ref = 0; !message.failed && refs.data < refs.end;)
+	{
+		ref += pbf_read_sint(&refs);
+
+		if (!pbf_reserve((void **)&reader->refs, &reader->ref_capacity,
+						 reader->num_refs + 1, sizeof(int64_t)))
+		{
+			return 0;
+		}
+
+		reader->refs[reader->num_refs++] = ref;
+	}
+
+	while (!message.failed && keys.data < keys.end)
+	{
+		uint64_t key = pbf_read_varint(&keys);
+		uint64_t value = pbf_read_varint(&values);
+
+		if (keys.failed || values.failed || key >= reader->num_strings
+			|| value >= reader->num_strings)
+		{
+			message.failed = 1;
+			break;
+		}
+
+		if (!pbf_reserve((void **)&reader->tags, &reader->tag_capacity,
+						 reader->num_tags + 1, sizeof(Dr2osm_Tag)))
+		{
+			return 0;
+		}
+
+		Dr2osm_Tag *tag = &reader->tags[reader->num_tags++];
+		tag->key = reader->string_table[key];
+		tag->value = reader->string_table[value];
+	}
+
+	if (message.failed || refs.failed || values.data != values.end)
+	{
+		pbf_error(reader, "Invalid way");
+		return 0;
+	}
+
+	way->num_refs = reader->num_refs - way->first_ref;
+	way->num_tags = reader->num_tags - way->first_tag;
+	reader->num_elements++;
+
+	return 1;
+}
+
+/* Decodes the nodes or the ways of the primitive block in the block buffer of
+ * reader, depending on which it is reading. The types of the groups in the
+ * block are returned in *has_nodes, *has_ways and *has_relations.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_read_block(Pbf_Reader *reader, int *has_nodes, int *has_ways,
+						  int *has_relations)
+{
+	Pbf_Message block = {reader->block, reader->block + reader->block_size, 0};
+	Pbf_Block_Scale scale = {100, 0, 0};
+	Pbf_Message string_table = {0};
+	int field, wire_type;
+
+	/* The scale follows the groups in the block, so it is read first. */
+	while (pbf_next_field(&block, &field, &wire_type))
+	{
+		if (field == 1 && wire_type == 2)
+		{
+			string_table = pbf_read_bytes(&block);
+		}
+		else if (field == 17 && wire_type == 0)
+		{
+			scale.granularity = (int64_t)pbf_read_varint(&block);
+		}
+		else if (field == 19 && wire_type == 0)
+		{
+			scale.lat_offset = (int64_t)pbf_read_varint(&block);
+		}
+		else if (field == 20 && wire_type == 0)
+		{
+			scale.lon_offset = (int64_t)pbf_read_varint(&block);
+		}
+		else
+		{
+			pbf_skip_field(&block, wire_type);
+		}
+	}
+
+	if (block.failed)
+	{
+		pbf_error(reader, "Invalid primitive block");
+		return 0;
+	}
+
+	reader->num_elements = 0;
+	reader->num_refs = 0;
+	reader->num_tags = 0;
+	reader->num_strings = 0;
+	*has_nodes = 0;
+	*has_ways = 0;
+	*has_relations = 0;
+
+	if (reader->reading_ways && !pbf_read_string_table(reader, string_table))
+	{
+		return 0;
+	}
+
+	block.data = reader->block;
+
+	while (pbf_next_field(&block, &field, &wire_type))
+	{
+		if (field != 2 || wire_type != 2)
+		{
+			pbf_skip_field(&block, wire_type);
+			continue;
+		}
+
+		Pbf_Message group = pbf_read_bytes(&block);
+
+		/* PrimitiveGroup: nodes (1), dense (2), ways (3) and relations
+		 * (4). */
+		while (pbf_next_field(&group, &field, &wire_type))
+		{
+			if (wire_type != 2)
+			{
+				pbf_skip_field(&group, wire_type);
+				continue;
+			}
+
+			Pbf_Message element = pbf_read_bytes(&group);
+
+			if (field == 1 || field == 2)
+			{
+				*has_nodes = 1;
+
+				if (!reader->reading_ways
+					&& !(field == 1
+							 ? pbf_read_node(reader, &scale, element)
+							 : pbf_read_dense_nodes(reader, &scale, element)))
+				{
+					return 0;
+				}
+			}
+			else if (field == 3)
+			{
+				*has_ways = 1;
+
+				if (reader->reading_ways && !pbf_read_way(reader, element))
+				{
+					return 0;
+				}
+			}
+			else if (field == 4)
+			{
+				*has_relations = 1;
+			}
+		}
+
+		if (group.failed)
+		{
+			block.failed = 1;
+		}
+	}
+
+	if (block.failed)
+	{
+		pbf_error(reader, "Invalid primitive group");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Reads the next data block of reader and decodes its nodes or ways. The node
+ * pass ends with the first block containing other elements, whose position
+ * is remembered for the way pass, which ends with the first block containing
+ * relations.
+ * Returns 1 on success, 0 at the end of the nodes or ways and -1 on error. */
+static int pbf_next_block(Pbf_Reader *reader)
+{
+	while (!reader->last_block)
+	{
+		int64_t offset = FTELL64(reader->file);
+		int is_data, is_header;
+		int result = pbf_read_blob(reader, &is_data, &is_header);
+
+		if (result <= 0)
+		{
+			return result;
+		}
+
+		if (!is_data)
+		{
+			continue;
+		}
+
+		int has_nodes, has_ways, has_relations;
+
+		if (!pbf_read_block(reader, &has_nodes, &has_ways, &has_relations))
+		{
+			return -1;
+		}
+
+		if (!reader->reading_ways && (has_ways || has_relations))
+		{
+			reader->ways_offset = offset;
+			reader->last_block = 1;
+		}
+		else if (reader->reading_ways && has_nodes)
+		{
+			return pbf_error(reader, "Nodes follow ways, the file is not "
+									 "sorted by type");
+		}
+		else if (reader->reading_ways && has_relations)
+		{
+			reader->last_block = 1;
+		}
+
+		reader->current = 0;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Moves reader to its next node or way, depending on which it is reading.
+ * Sets at_end once there are none left.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_advance(Pbf_Reader *reader)
+{
+	reader->current++;
+
+	while (reader->current >= reader->num_elements)
+	{
+		int result = pbf_next_block(reader);
+
+		if (result < 0)
+		{
+			return 0;
+		}
+
+		if (!result)
+		{
+			reader->at_end = 1;
+			return 1;
+		}
+	}
+
+	int64_t id = reader->reading_ways ? reader->ways[reader->current].id
+									  : reader->nodes[reader->current].id;
+
+	if (id <= reader->previous_id)
+	{
+		pbf_error(reader, "The file is not sorted by ID");
+		return 0;
+	}
+
+	reader->previous_id = id;
+
+	return 1;
+}
+
+/* Positions reader at its first node, or at its first way if ways is
+ * nonzero, which must be done after reading the nodes.
+ * Returns nonzero on success, 0 on error. */
+static int pbf_start(Pbf_Reader *reader, int ways)
+{
+	reader->reading_ways = ways;
+	reader->at_end = 0;
+	reader->last_block = 0;
+	reader->previous_id = INT64_MIN;
+	reader->num_elements = 0;
+	reader->current = 0;
+
+	int64_t offset = ways ? reader->ways_offset : reader->data_offset;
+
+	if (offset < 0)
+	{
+		reader->at_end = 1;
+		return 1;
+	}
+
+	if (FSEEK64(reader->file, offset, SEEK_SET))
+	{
+		pbf_error(reader, strerror(errno));
+		return 0;
+	}
+
+	return pbf_advance(reader);
+}
+
+static void free_pbf_reader(Pbf_Reader *reader)
+{
+	if (reader->file)
+	{
+		fclose(reader->file);
+	}
+
+	free(reader->path);
+	free(reader->blob);
+	free(reader->block);
+	free(reader->strings);
+	free(reader->string_table);
+	free(reader->nodes);
+	free(reader->ways);
+	free(reader->refs);
+	free(reader->tags);
+	memset(reader, 0, sizeof(Pbf_Reader));
+}
+
+/* Opens the PBF file at path in reader and checks its header, which must not
+ * require features other than the OSM schema and dense nodes.
+ * Returns nonzero on success, 0 on error. */
+static int open_pbf_reader(Pbf_Reader *reader, const Unicode_Character *path)
+{
+	size_t length = 0;
+
+	while (path[length])
+	{
+		length++;
+	}
+
+	memset(reader, 0, sizeof(Pbf_Reader));
+	reader->ways_offset = -1;
+	reader->path = malloc((length + 1) * sizeof(Unicode_Character));
+
+	if (!reader->path)
+	{
+		fprintf(stderr, "Unable to allocate PBF reader: %s\n", strerror(errno));
+		return 0;
+	}
+
+	memcpy(reader->path, path, (length + 1) * sizeof(Unicode_Character));
+	reader->file = UNICODE_FOPEN(path, "rb");
+
+	if (!reader->file)
+	{
+		pbf_error(reader, strerror(errno));
+		free_pbf_reader(reader);
+		return 0;
+	}
+
+	int is_data = 0, is_header = 0;
+	int result = pbf_read_blob(reader, &is_data, &is_header);
+
+	if (result >= 0 && !is_header)
+	{
+		result = pbf_error(reader, "Not an OSM PBF file");
+	}
+
+	/* HeaderBlock: required_features (4). */
+	Pbf_Message header = {reader->block, reader->block + reader->block_size, 0};
+	int field, wire_type;
+
+	while (result > 0 && pbf_next_field(&header, &field, &wire_type))
+	{
+		if (field != 4 || wire_type != 2)
+		{
+			pbf_skip_field(&header, wire_type);
+			continue;
+		}
+
+		Pbf_Message feature = pbf_read_bytes(&header);
+
+		if (!pbf_string_equals(&feature, "OsmSchema-V0.6")
+			&& !pbf_string_equals(&feature, "DenseNodes"))
+		{
+			fprintf(stderr,
+					"Unable to read \"" FORMAT_UNICODE_STRING
+					"\": Unsupported required feature \"%.*s\"\n",
+					path, (int)(feature.end - feature.data),
+					(const char *)feature.data);
+			result = -1;
+		}
+	}
+
+	if (result > 0 && header.failed)
+	{
+		result = pbf_error(reader, "Invalid header block");
+	}
+
+	if (result <= 0)
+	{
+		free_pbf_reader(reader);
+		return 0;
+	}
+
+	reader->data_offset = FTELL64(reader->file);
+
+	return 1;
+}
@@ -0,0 +1,250 @@
+/* The node index deduplicates nodes by their coordinates. It is split into
+ * shards by a hash of the square kilometre the coordinates fall in, each a
+ * quad tree of its own, so that threads inserting nodes concurrently mostly
+ * lock different shards while consecutive nodes of a way mostly stay in the
+ * same tree. Node IDs are not assigned here but by whoever processes the ways
+ * in order, so they do not depend on the timing of the threads. */
+
+/* Every shard starts with a root node at these coordinates, which only gets
+ * an ID if a way references them. */
+#define NODE_ROOT_X 1018199
+#define NODE_ROOT_Y 7248352
+
+static int
+get_node_shard(int x, int y)
+{
+	uint64_t hash = (uint64_t)(uint32_t)(x >> 10) * 0x9e3779b97f4a7c15u
+			^ (uint64_t)(uint32_t)(y >> 10) * 0xc2b2ae3d27d4eb4fu;
+
+	return (int)(hash >> (64 - NODE_SHARD_BITS));
+}
+
+static Node *
+get_node(const Node_Index *index, uint32_t ref)
+{
+	const Node_Shard *shard = &index->shards[ref & (NUM_NODE_SHARDS - 1)];
+
+	return (Node *)shard->buffer.start + (ref >> NODE_SHARD_BITS);
+}
+
+/* Returns the ith node of index in the order of their IDs. */
+static Node *
+get_ordered_node(const Node_Index *index, int i)
+{
+	return get_node(index, ((const uint32_t *)index->ordered_refs.start)[i]);
+}
+
+static int
+init_node_index(Node_Index *index, jmp_buf *out_of_memory)
+{
+	for (int i = 0; i < NUM_NODE_SHARDS; i++) {
+		Node_Shard *shard = &index->shards[i];
+
+		if (!init_buffer(&shard->buffer,
+				sizeof(Node) << (32 - NODE_SHARD_BITS), out_of_memory)) {
+			return 0;
+		}
+
+		init_mutex(&shard->mutex);
+
+		Node *root = buffer_push(&shard->buffer, sizeof(Node));
+		memset(root, 0, sizeof(Node));
+		root->x = NODE_ROOT_X;
+		root->y = NODE_ROOT_Y;
+	}
+
+	return init_buffer(&index->ordered_refs, sizeof(uint32_t) << 31,
+			out_of_memory);
+}
+
+static void
+free_node_index(Node_Index *index)
+{
+	for (int i = 0; i < NUM_NODE_SHARDS; i++) {
+		Node_Shard *shard = &index->shards[i];
+
+		if (shard->buffer.start) {
+			free_buffer(&shard->buffer);
+			destroy_mutex(&shard->mutex);
+		}
+	}
+
+	free_buffer(&index->ordered_refs);
+}
+
+/* Returns the memory committed to index and the number of commits in
+ * num_commits. */
+static intptr_t
+get_node_index_committed(const Node_Index *index, int *num_commits)
+{
+	intptr_t result = index->ordered_refs.commit_threshold_offset;
+	*num_commits = index->ordered_refs.num_commits;
+
+	for (int i = 0; i < NUM_NODE_SHARDS; i++) {
+		result += index->shards[i].buffer.commit_threshold_offset;
+		*num_commits += index->shards[i].buffer.num_commits;
+	}
+
+	return result;
+}
+
+/* Looks up the node at x, y in the quad tree of shard number shard_number
+ * of index, allocating a new node with its id field set to 0 if there is
+ * none. The shard must have room for a new node.
+ * Returns the reference of the node. */
+static uint32_t
+shard_upsert(Node_Index *index, int shard_number, int x, int y)
+{
+	Node_Shard *shard = &index->shards[shard_number];
+	Node *root = (Node *)shard->buffer.start;
+	Node *current = root;
+
+	while (1) {
+		if (x == current->x && y == current->y) {
+			break;
+		}
+
+		int east = (x > current->x);
+		int north = (y > current->y);
+		int child_index = east | (north << 1);
+
+		if (current->child_node_offsets[child_index] == 0) {
+			Node *new = buffer_push(&shard->buffer, sizeof(Node));
+			intptr_t offset = new - current;
+
+			assert(offset > 0 && offset < INT_MAX);
+
+			current->child_node_offsets[child_index] = (int)offset;
+			memset(new, 0, sizeof(Node));
+			new->x = x;
+			new->y = y;
+			current = new;
+			break;
+		}
+
+		current += current->child_node_offsets[child_index];
+	}
+
+	return (uint32_t)(current - root) << NODE_SHARD_BITS | shard_number;
+}
+
+/* Empties cache by pointing all of its entries to the root node, which is
+ * found at its coordinates in the first place of its shard. */
+static void
+init_node_cache(Node_Cache *cache)
+{
+	uint32_t root_ref = get_node_shard(NODE_ROOT_X, NODE_ROOT_Y);
+
+	for (int i = 0; i < NODE_CACHE_SIZE; i++) {
+		cache->entries[i].x = NODE_ROOT_X;
+		cache->entries[i].y = NODE_ROOT_Y;
+		cache->entries[i].ref = root_ref;
+	}
+
+	cache->num_lookups = 0;
+	cache->num_hits = 0;
+}
+
+/* Returns the entry of cache that x, y map to. */
+static Node_Cache_Entry *
+get_node_cache_entry(Node_Cache *cache, int x, int y)
+{
+	uint32_t hash = (uint32_t)x * 0x9e3779b1u ^ (uint32_t)y * 0x85ebca77u;
+
+	return &cache->entries[hash >> (32 - NODE_CACHE_BITS)];
+}
+
+/* Buffers nodes (as coordinate pairs) into the node index. If a node with
+ * identical coordinates has already been buffered, returns a reference to the
+ * previously seen node. Otherwise allocates a new node with its id field
+ * initialized to 0 and returns a reference to it. The node is first looked up
+ * in cache, unless it is 0. Only one thread may call this at a time, and not
+ * while others call node_upsert_shared. */
+static uint32_t
+node_upsert(Node_Index *index, Node_Cache *cache, int x, int y)
+{
+	if (!cache) {
+		return shard_upsert(index, get_node_shard(x, y), x, y);
+	}
+
+	Node_Cache_Entry *entry = get_node_cache_entry(cache, x, y);
+
+	cache->num_lookups++;
+
+	if (entry->x == x && entry->y == y) {
+		cache->num_hits++;
+		return entry->ref;
+	}
+
+	uint32_t ref = shard_upsert(index, get_node_shard(x, y), x, y);
+
+	entry->x = x;
+	entry->y = y;
+	entry->ref = ref;
+
+	return ref;
+}
+
+/* Like node_upsert, but may be called from several threads at once, each with
+ * a cache of its own. Nodes never move, so hits in the cache need no lock. On
+ * error longjmps to out_of_memory, which belongs to the calling thread. */
+static uint32_t
+node_upsert_shared(Node_Index *index, Node_Cache *cache, int x, int y,
+		jmp_buf *out_of_memory)
+{
+	Node_Cache_Entry *entry = get_node_cache_entry(cache, x, y);
+
+	cache->num_lookups++;
+
+	if (entry->x == x && entry->y == y) {
+		cache->num_hits++;
+		return entry->ref;
+	}
+
+	int shard_number = get_node_shard(x, y);
+	Node_Shard *shard = &index->shards[shard_number];
+	Growable_Buffer *buffer = &shard->buffer;
+
+	lock_mutex(&shard->mutex);
+
+	/* Make room for a new node up front, so that the buffer never jumps to
+	 * the out of memory handler of another thread while the lock is
+	 * held. */
+	const char *error = 0;
+
+	if (buffer->size - buffer->next_in_offset < (intptr_t)sizeof(Node)) {
+		error = "Ran out of buffer space";
+	}
+
+	while (!error && buffer->next_in_offset + (intptr_t)sizeof(Node)
+			> buffer->commit_threshold_offset) {
+		if (!commit_memory(buffer)) {
+			error = get_memory_error_message();
+		}
+	}
+
+	if (error) {
+		unlock_mutex(&shard->mutex);
+		fprintf(stderr, "Unable to insert into the node index: %s\n", error);
+		longjmp(*out_of_memory, 1);
+	}
+
+	uint32_t ref = shard_upsert(index, shard_number, x, y);
+
+	unlock_mutex(&shard->mutex);
+
+	entry->x = x;
+	entry->y = y;
+	entry->ref = ref;
+
+	return ref;
+}
+
+/* Appends the node ref, which has just been given the next ID, to the nodes
+ * of index in the order of their IDs. */
+static void
+order_node(Node_Index *index, uint32_t ref)
+{
+	*(uint32_t *)buffer_push(&index->ordered_refs, sizeof(uint32_t)) = ref;
+	index->num_nodes++;
+}
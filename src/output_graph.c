@@ -0,0 +1,412 @@
+/* Sink writing a road graph in compressed sparse row form to an output
+ * stream. The nodes and edges are collected as they are passed to the sink,
+ * and the edges are grouped by their source node and written column by
+ * column when the sink is ended. The file format is described next to
+ * Dr2osm_Graph_Header in dr2osm.h. */
+
+#define GRAPH_CHUNK_SIZE 65536
+
+static const char *graph_highways[] = {
+	"", "footway", "motorway", "trunk", "primary", "secondary", "tertiary",
+	"residential", "unclassified", "cycleway",
+};
+
+/* Reallocates the array at *array to hold capacity elements of
+ * element_size bytes.
+ * Returns nonzero on success, 0 on error. */
+static int graph_realloc(void **array, int64_t capacity, size_t element_size)
+{
+	void *new_array = realloc(*array, capacity * element_size);
+
+	if (!new_array)
+	{
+		fprintf(stderr, "Unable to allocate road graph: %s\n", strerror(errno));
+		return 0;
+	}
+
+	*array = new_array;
+
+	return 1;
+}
+
+/* Returns the capacity to grow an array of capacity elements to, so that it
+ * holds at least count elements. */
+static int64_t graph_grow(int64_t capacity, int64_t count)
+{
+	capacity = capacity ? capacity : 4096;
+
+	while (capacity < count)
+	{
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+static int graph_node(void *user_data, const Dr2osm_Node *node)
+{
+	Graph_Writer *writer = user_data;
+
+	if (writer->num_nodes == writer->node_capacity)
+	{
+		int64_t capacity = graph_grow(writer->node_capacity,
+									  writer->num_nodes + 1);
+
+		if (!graph_realloc((void **)&writer->node_ids, capacity,
+						   sizeof(int32_t))
+			|| !graph_realloc((void **)&writer->lats, capacity,
+							  sizeof(double))
+			|| !graph_realloc((void **)&writer->lons, capacity,
+							  sizeof(double)))
+		{
+			return 0;
+		}
+
+		writer->node_capacity = capacity;
+	}
+
+	if (node->id >= writer->node_index_capacity)
+	{
+		int64_t capacity = graph_grow(writer->node_index_capacity,
+									  (int64_t)node->id + 1);
+
+		if (!graph_realloc((void **)&writer->node_indices, capacity,
+						   sizeof(int32_t)))
+		{
+			return 0;
+		}
+
+		memset(writer->node_indices + writer->node_index_capacity, 0xff,
+			   (capacity - writer->node_index_capacity) * sizeof(int32_t));
+		writer->node_index_capacity = capacity;
+	}
+
+	writer->node_indices[node->id] = (int32_t)writer->num_nodes;
+	writer->node_ids[writer->num_nodes] = node->id;
+	writer->lats[writer->num_nodes] = node->lat;
+	writer->lons[writer->num_nodes] = node->lon;
+	writer->num_nodes++;
+
+	return 1;
+}
+
+/* Returns the index of the node with the OSM ID id, or -1 if the node has not
+ * been passed to the sink. */
+static int32_t graph_node_index(const Graph_Writer *writer, int id)
+{
+	return id >= 0 && id < writer->node_index_capacity
+			   ? writer->node_indices[id]
+			   : -1;
+}
+
+static int graph_way(void *user_data, const Dr2osm_Way *way)
+{
+	Graph_Writer *writer = user_data;
+	Graph_Edge edge = {0};
+	int oneway = 0;
+
+	edge.way_id = way->id;
+
+	for (int i = 0; i < way->num_tags; i++)
+	{
+		const char *key = way->tags[i].key;
+		const char *value = way->tags[i].value;
+
+		if (!strcmp(key, "highway"))
+		{
+			for (int j = 0;
+				 j < (int)(sizeof(graph_highways) / sizeof(graph_highways[0]));
+				 j++)
+			{
+				if (!strcmp(value, graph_highways[j]))
+				{
+					edge.highway = (uint8_t)j;
+				}
+			}
+		}
+		else if (!strcmp(key, "route") && !strcmp(value, "ferry"))
+		{
+			edge.flags |= DR2OSM_EDGE_FERRY;
+		}
+		else if (!strcmp(key, "oneway") && !strcmp(value, "yes"))
+		{
+			oneway = 1;
+			edge.flags |= DR2OSM_EDGE_ONEWAY;
+		}
+		else if (!strcmp(key, "maxspeed"))
+		{
+			edge.speed_limit = (uint16_t)atoi(value);
+		}
+		else if (!strcmp(key, "maxheight"))
+		{
+			edge.max_height = (uint16_t)(strtod(value, 0) * 100 + 0.5);
+		}
+		else if (!strcmp(key, "maxweight"))
+		{
+			edge.max_weight = (uint32_t)(strtod(value, 0) * 1000 + 0.5);
+		}
+		else if (!strcmp(key, osm_strings[AT_ICE_ROAD]))
+		{
+			edge.flags |= DR2OSM_EDGE_ICE_ROAD;
+		}
+	}
+
+	int64_t max_edges = writer->num_edges + 2 * (int64_t)way->num_node_ids;
+
+	if (max_edges > writer->edge_capacity)
+	{
+		int64_t capacity = graph_grow(writer->edge_capacity, max_edges);
+
+		if (!graph_realloc((void **)&writer->edges, capacity,
+						   sizeof(Graph_Edge)))
+		{
+			return 0;
+		}
+
+		writer->edge_capacity = capacity;
+	}
+
+	/* The nodes of the way are already in the direction of travel of oneway
+	 * ways. */
+	for (int i = 0; i + 1 < way->num_node_ids; i++)
+	{
+		int32_t source = graph_node_index(writer, way->node_ids[i]);
+		int32_t target = graph_node_index(writer, way->node_ids[i + 1]);
+
+		if (source < 0 || target < 0)
+		{
+			fprintf(stderr, "Way %d references a node missing from the graph.\n",
+					way->id);
+			return 0;
+		}
+
+		if (source == target)
+		{
+			continue;
+		}
+
+		Graph_Edge *forward = &writer->edges[writer->num_edges++];
+		*forward = edge;
+		forward->source = source;
+		forward->target = target;
+
+		if (!oneway)
+		{
+			Graph_Edge *backward = &writer->edges[writer->num_edges++];
+			*backward = edge;
+			backward->source = target;
+			backward->target = source;
+			backward->flags |= DR2OSM_EDGE_BACKWARD;
+		}
+	}
+
+	return 1;
+}
+
+/* Returns the offset of an array of size bytes placed at *offset, aligned to
+ * 8 bytes, and advances *offset past it. */
+static int64_t graph_place(int64_t *offset, int64_t size)
+{
+	int64_t result = (*offset + 7) & ~(int64_t)7;
+
+	*offset = result + size;
+
+	return result;
+}
+
+/* Writes zeros up to offset, and then size bytes from data.
+ * Returns nonzero on success, 0 on error. */
+static int graph_write(Graph_Writer *writer, int64_t *written, int64_t offset,
+					   const void *data, int64_t size)
+{
+	static const char zeros[8];
+
+	assert(offset >= *written && offset - *written <= 8);
+
+	if (!dr2osm_stream_write(writer->output, zeros, offset - *written)
+		|| !dr2osm_stream_write(writer->output, data, size))
+	{
+		return 0;
+	}
+
+	*written = offset + size;
+
+	return 1;
+}
+
+/* Writes the field of field_size bytes at field_offset of the edges in the
+ * order of order as an array at offset.
+ * Returns nonzero on success, 0 on error. */
+static int graph_write_column(Graph_Writer *writer, int64_t *written,
+							  int64_t offset, const int64_t *order,
+							  size_t field_offset, size_t field_size)
+{
+	char chunk[GRAPH_CHUNK_SIZE];
+	int64_t per_chunk = GRAPH_CHUNK_SIZE / field_size;
+
+	for (int64_t i = 0; i < writer->num_edges; i += per_chunk)
+	{
+		int64_t count = writer->num_edges - i < per_chunk
+							? writer->num_edges - i
+							: per_chunk;
+
+		for (int64_t j = 0; j < count; j++)
+		{
+			memcpy(chunk + j * field_size,
+				   (char *)&writer->edges[order[i + j]] + field_offset,
+				   field_size);
+		}
+
+		if (!graph_write(writer, written, offset + i * field_size, chunk,
+						 count * field_size))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int graph_end(void *user_data)
+{
+	Graph_Writer *writer = user_data;
+	int64_t num_nodes = writer->num_nodes;
+	int64_t num_edges = writer->num_edges;
+
+	/* Group the edges by their source node with a counting sort, which
+	 * keeps the edges of each node in the order they were passed. */
+	int64_t *first_edges = calloc(num_nodes + 1, sizeof(int64_t));
+	int64_t *next_edges = malloc((num_nodes + 1) * sizeof(int64_t));
+	int64_t *order = malloc((num_edges ? num_edges : 1) * sizeof(int64_t));
+
+	int result = 0;
+
+	if (!first_edges || !next_edges || !order)
+	{
+		fprintf(stderr, "Unable to allocate road graph: %s\n", strerror(errno));
+		goto cleanup;
+	}
+
+	for (int64_t i = 0; i < num_edges; i++)
+	{
+		first_edges[writer->edges[i].source + 1]++;
+	}
+
+	for (int64_t i = 0; i < num_nodes; i++)
+	{
+		first_edges[i + 1] += first_edges[i];
+	}
+
+	memcpy(next_edges, first_edges, (num_nodes + 1) * sizeof(int64_t));
+
+	for (int64_t i = 0; i < num_edges; i++)
+	{
+		order[next_edges[writer->edges[i].source]++] = i;
+	}
+
+	Dr2osm_Graph_Header header = {0};
+	int64_t offset = sizeof(header);
+
+	memcpy(header.magic, DR2OSM_GRAPH_MAGIC, sizeof(header.magic));
+	header.version = DR2OSM_GRAPH_VERSION;
+	header.byte_order_mark = DR2OSM_GRAPH_BYTE_ORDER_MARK;
+	header.num_nodes = num_nodes;
+	header.num_edges = num_edges;
+	header.node_ids_offset = graph_place(&offset, num_nodes * sizeof(int32_t));
+	header.lats_offset = graph_place(&offset, num_nodes * sizeof(double));
+	header.lons_offset = graph_place(&offset, num_nodes * sizeof(double));
+	header.first_edges_offset =
+		graph_place(&offset, (num_nodes + 1) * sizeof(int64_t));
+	header.targets_offset = graph_place(&offset, num_edges * sizeof(int32_t));
+	header.way_ids_offset = graph_place(&offset, num_edges * sizeof(int32_t));
+	header.speed_limits_offset =
+		graph_place(&offset, num_edges * sizeof(uint16_t));
+	header.highways_offset = graph_place(&offset, num_edges * sizeof(uint8_t));
+	header.flags_offset = graph_place(&offset, num_edges * sizeof(uint8_t));
+	header.max_heights_offset =
+		graph_place(&offset, num_edges * sizeof(uint16_t));
+	header.max_weights_offset =
+		graph_place(&offset, num_edges * sizeof(uint32_t));
+
+	int64_t written = 0;
+
+#define EDGE_COLUMN(OFFSET, FIELD)                                         \
+	graph_write_column(writer, &written, header.OFFSET, order,             \
+					   offsetof(Graph_Edge, FIELD),                        \
+					   sizeof(((Graph_Edge *)0)->FIELD))
+
+	result =
+		graph_write(writer, &written, 0, &header, sizeof(header))
+		&& graph_write(writer, &written, header.node_ids_offset,
+					   writer->node_ids, num_nodes * sizeof(int32_t))
+		&& graph_write(writer, &written, header.lats_offset, writer->lats,
+					   num_nodes * sizeof(double))
+		&& graph_write(writer, &written, header.lons_offset, writer->lons,
+					   num_nodes * sizeof(double))
+		&& graph_write(writer, &written, header.first_edges_offset,
+					   first_edges, (num_nodes + 1) * sizeof(int64_t))
+		&& EDGE_COLUMN(targets_offset, target)
+		&& EDGE_COLUMN(way_ids_offset, way_id)
+		&& EDGE_COLUMN(speed_limits_offset, speed_limit)
+		&& EDGE_COLUMN(highways_offset, highway)
+		&& EDGE_COLUMN(flags_offset, flags)
+		&& EDGE_COLUMN(max_heights_offset, max_height)
+		&& EDGE_COLUMN(max_weights_offset, max_weight);
+
+#undef EDGE_COLUMN
+
+cleanup:
+	free(first_edges);
+	free(next_edges);
+	free(order);
+
+	return result;
+}
+
+static int graph_begin(void *user_data)
+{
+	return 1;
+}
+
+static void free_graph_writer(void *sink_state)
+{
+	Graph_Writer *writer = sink_state;
+
+	free(writer->node_ids);
+	free(writer->lats);
+	free(writer->lons);
+	free(writer->node_indices);
+	free(writer->edges);
+	free(writer);
+}
+
+int dr2osm_graph_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output)
+{
+	Graph_Writer *writer = calloc(1, sizeof(Graph_Writer));
+
+	if (!writer)
+	{
+		fprintf(stderr, "Unable to allocate graph writer: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	writer->output = output;
+
+	if (output->free_sink_state)
+	{
+		output->free_sink_state(output->sink_state);
+	}
+
+	output->sink_state = writer;
+	output->free_sink_state = free_graph_writer;
+
+	memset(sink, 0, sizeof(Dr2osm_Sink));
+	sink->user_data = writer;
+	sink->begin = graph_begin;
+	sink->node = graph_node;
+	sink->way = graph_way;
+	sink->end = graph_end;
+
+	return 1;
+}
@@ -0,0 +1,279 @@
+/* Sink writing O5M to an output stream. O5M is a streamable binary OSM format
+ * that stores ids, coordinates and node references as differences to the
+ * previous value and replaces repeated tags with references to a table of
+ * recently seen string pairs. It needs no buffering beyond a single object.
+ * https://wiki.openstreetmap.org/wiki/O5m */
+
+#define O5M_NODE 0x10
+#define O5M_WAY 0x11
+#define O5M_HEADER 0xe0
+#define O5M_END 0xfe
+#define O5M_RESET 0xff
+
+static void o5m_put_bytes(O5m_Writer *writer, O5m_Buffer *buffer,
+						  const void *data, size_t size)
+{
+	if (buffer->capacity - buffer->size < size)
+	{
+		size_t capacity = buffer->capacity ? 2 * buffer->capacity : 4096;
+
+		while (capacity - buffer->size < size)
+		{
+			capacity *= 2;
+		}
+
+		char *new_data = realloc(buffer->data, capacity);
+
+		if (!new_data)
+		{
+			writer->failed = 1;
+			return;
+		}
+
+		buffer->data = new_data;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void o5m_put_unsigned(O5m_Writer *writer, O5m_Buffer *buffer,
+							 uint64_t value)
+{
+	uint8_t bytes[10];
+	int size = 0;
+
+	while (value >= 0x80)
+	{
+		bytes[size++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+
+	bytes[size++] = (uint8_t)value;
+
+	o5m_put_bytes(writer, buffer, bytes, size);
+}
+
+/* Signed numbers store the sign in the lowest bit. */
+static void o5m_put_signed(O5m_Writer *writer, O5m_Buffer *buffer,
+						   int64_t value)
+{
+	o5m_put_unsigned(writer, buffer,
+					 value < 0 ? ((uint64_t)(-(value + 1)) << 1) | 1
+							   : (uint64_t)value << 1);
+}
+
+/* Writes a key and a value either as a reference to an earlier occurrence in
+ * the string table or inline, in which case short pairs are added to the
+ * table. */
+static void o5m_put_string_pair(O5m_Writer *writer, O5m_Buffer *buffer,
+								const char *key, const char *value)
+{
+	size_t key_size = strlen(key);
+	size_t value_size = strlen(value);
+
+	if (key_size + value_size > O5M_MAX_TABLE_PAIR_SIZE)
+	{
+		o5m_put_bytes(writer, buffer, "", 1);
+		o5m_put_bytes(writer, buffer, key, key_size + 1);
+		o5m_put_bytes(writer, buffer, value, value_size + 1);
+		return;
+	}
+
+	char pair[O5M_MAX_TABLE_PAIR_SIZE + 2];
+	size_t pair_size = key_size + value_size + 2;
+
+	memcpy(pair, key, key_size + 1);
+	memcpy(pair + key_size + 1, value, value_size + 1);
+
+	/* FNV-1a. */
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < pair_size; i++)
+	{
+		hash = (hash ^ (uint8_t)pair[i]) * 16777619u;
+	}
+
+	int64_t *entry = &writer->string_hashes[hash % O5M_HASH_TABLE_SIZE];
+	int64_t index = *entry - 1;
+
+	if (index >= 0 && writer->num_strings - index <= O5M_STRING_TABLE_SIZE
+		&& !memcmp(writer->strings[index % O5M_STRING_TABLE_SIZE], pair,
+				   pair_size))
+	{
+		o5m_put_unsigned(writer, buffer, writer->num_strings - index);
+		return;
+	}
+
+	o5m_put_bytes(writer, buffer, "", 1);
+	o5m_put_bytes(writer, buffer, pair, pair_size);
+
+	memcpy(writer->strings[writer->num_strings % O5M_STRING_TABLE_SIZE], pair,
+		   pair_size);
+	*entry = ++writer->num_strings;
+}
+
+/* Writes the dataset built in the dataset buffer to the output, prefixed
+ * with its type and size.
+ * Returns nonzero on success, 0 on error. */
+static int o5m_write_dataset(O5m_Writer *writer, uint8_t type)
+{
+	O5m_Buffer header = {0};
+	uint8_t header_data[11];
+
+	header.data = (char *)header_data;
+	header.capacity = sizeof(header_data);
+
+	o5m_put_bytes(writer, &header, &type, 1);
+	o5m_put_unsigned(writer, &header, writer->dataset.size);
+
+	int result = !writer->failed
+				 && dr2osm_stream_write(writer->output, header.data, header.size)
+				 && dr2osm_stream_write(writer->output, writer->dataset.data,
+										writer->dataset.size);
+
+	writer->dataset.size = 0;
+
+	return result;
+}
+
+static int o5m_begin(void *user_data)
+{
+	O5m_Writer *writer = user_data;
+
+	static const uint8_t header[] = {O5M_RESET, O5M_HEADER, 4, 'o', '5', 'm', '2'};
+
+	return dr2osm_stream_write(writer->output, header, sizeof(header));
+}
+
+static int o5m_node(void *user_data, const Dr2osm_Node *node)
+{
+	O5m_Writer *writer = user_data;
+	O5m_Buffer *dataset = &writer->dataset;
+
+	/* Coordinates are stored in units of 100 nanodegrees. */
+	int64_t lon = (int64_t)(node->lon * 1e7 + (node->lon < 0 ? -0.5 : 0.5));
+	int64_t lat = (int64_t)(node->lat * 1e7 + (node->lat < 0 ? -0.5 : 0.5));
+
+	o5m_put_signed(writer, dataset, node->id - writer->id);
+	o5m_put_bytes(writer, dataset, "", 1); /* No version information. */
+	o5m_put_signed(writer, dataset, lon - writer->lon);
+	o5m_put_signed(writer, dataset, lat - writer->lat);
+
+	writer->id = node->id;
+	writer->lon = lon;
+	writer->lat = lat;
+
+	return o5m_write_dataset(writer, O5M_NODE);
+}
+
+/* Writes a reset, after which readers start the delta coded fields from 0
+ * and empty their string tables, and does the same to writer.
+ * Returns nonzero on success, 0 on error. */
+static int o5m_reset(O5m_Writer *writer)
+{
+	static const uint8_t reset[] = {O5M_RESET};
+
+	writer->id = 0;
+	writer->node_ref = 0;
+	writer->lat = 0;
+	writer->lon = 0;
+	writer->num_strings = 0;
+	memset(writer->string_hashes, 0, sizeof(writer->string_hashes));
+
+	return dr2osm_stream_write(writer->output, reset, sizeof(reset));
+}
+
+static int o5m_way(void *user_data, const Dr2osm_Way *way)
+{
+	O5m_Writer *writer = user_data;
+	O5m_Buffer *dataset = &writer->dataset;
+	O5m_Buffer *refs = &writer->refs;
+
+	if (!writer->writing_ways)
+	{
+		writer->writing_ways = 1;
+
+		if (!o5m_reset(writer))
+		{
+			return 0;
+		}
+	}
+
+	o5m_put_signed(writer, dataset, way->id - writer->id);
+	o5m_put_bytes(writer, dataset, "", 1); /* No version information. */
+
+	writer->id = way->id;
+
+	refs->size = 0;
+
+	for (int i = 0; i < way->num_node_ids; i++)
+	{
+		o5m_put_signed(writer, refs, way->node_ids[i] - writer->node_ref);
+		writer->node_ref = way->node_ids[i];
+	}
+
+	o5m_put_unsigned(writer, dataset, refs->size);
+	o5m_put_bytes(writer, dataset, refs->data, refs->size);
+
+	for (int i = 0; i < way->num_tags; i++)
+	{
+		o5m_put_string_pair(writer, dataset, way->tags[i].key,
+							way->tags[i].value);
+	}
+
+	return o5m_write_dataset(writer, O5M_WAY);
+}
+
+static int o5m_end(void *user_data)
+{
+	O5m_Writer *writer = user_data;
+
+	static const uint8_t end[] = {O5M_END};
+
+	return dr2osm_stream_write(writer->output, end, sizeof(end));
+}
+
+static void free_o5m_writer(void *sink_state)
+{
+	O5m_Writer *writer = sink_state;
+
+	free(writer->strings);
+	free(writer->dataset.data);
+	free(writer->refs.data);
+	free(writer);
+}
+
+int dr2osm_o5m_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output)
+{
+	O5m_Writer *writer = calloc(1, sizeof(O5m_Writer));
+
+	if (!writer
+		|| !(writer->strings = malloc(O5M_STRING_TABLE_SIZE
+									  * sizeof(writer->strings[0]))))
+	{
+		fprintf(stderr, "Unable to allocate O5M writer: %s\n", strerror(errno));
+		free(writer);
+		return 0;
+	}
+
+	writer->output = output;
+
+	if (output->free_sink_state)
+	{
+		output->free_sink_state(output->sink_state);
+	}
+
+	output->sink_state = writer;
+	output->free_sink_state = free_o5m_writer;
+
+	memset(sink, 0, sizeof(Dr2osm_Sink));
+	sink->user_data = writer;
+	sink->begin = o5m_begin;
+	sink->node = o5m_node;
+	sink->way = o5m_way;
+	sink->end = o5m_end;
+
+	return 1;
+}
@@ -0,0 +1,272 @@
+/* Sink writing OSM XML to an output stream. */
+
+static int xml_begin(void *user_data)
+{
+	Dr2osm_Stream *output = user_data;
+
+	return stream_printf(output,
+						 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+						 "<osm version=\"0.6\" generator=\"dr2osm\">\n");
+}
+
+static int xml_node(void *user_data, const Dr2osm_Node *node)
+{
+	Dr2osm_Stream *output = user_data;
+
+	return stream_printf(output,
+						 "<node visible=\"true\" id=\"%d\" lat=\"%.9f\" lon=\"%.9f\"/>\n",
+						 node->id, node->lat, node->lon);
+}
+
+static void format_bytes(Format_Buffer *output, const char *data, size_t size)
+{
+	if (output->size < output->capacity)
+	{
+		size_t available = output->capacity - output->size;
+
+		memcpy(output->buffer + output->size, data,
+			   size < available ? size : available);
+	}
+
+	output->size += size;
+}
+
+static void format_string(Format_Buffer *output, const char *string)
+{
+	format_bytes(output, string, strlen(string));
+}
+
+/* Returns the entity escaping character in an attribute value, or 0 if it
+ * can be written as is. */
+static const char *get_escape(char character)
+{
+	switch (character)
+	{
+	case '&':
+		return "&amp;";
+
+	case '<':
+		return "&lt;";
+
+	case '>':
+		return "&gt;";
+
+	case '"':
+		return "&quot;";
+
+	default:
+		return 0;
+	}
+}
+
+/* Returns the index of the first character in the size bytes of string that
+ * needs escaping, or size if there is none. Most names need no escaping, so
+ * 16 bytes are checked at a time where possible. */
+static size_t find_escape(const char *string, size_t size)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+	const __m128i ampersand = _mm_set1_epi8('&');
+	const __m128i less = _mm_set1_epi8('<');
+	const __m128i greater = _mm_set1_epi8('>');
+	const __m128i quote = _mm_set1_epi8('"');
+
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+		__m128i matches =
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, ampersand),
+									  _mm_cmpeq_epi8(block, less)),
+						 _mm_or_si128(_mm_cmpeq_epi8(block, greater),
+									  _mm_cmpeq_epi8(block, quote)));
+		int mask = _mm_movemask_epi8(matches);
+
+		if (mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return i + index;
+#else
+			return i + __builtin_ctz(mask);
+#endif
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t ampersand = vdupq_n_u8('&');
+	const uint8x16_t less = vdupq_n_u8('<');
+	const uint8x16_t greater = vdupq_n_u8('>');
+	const uint8x16_t quote = vdupq_n_u8('"');
+
+	for (; i + 16 <= size; i += 16)
+	{
+		uint8x16_t block = vld1q_u8((const uint8_t *)(string + i));
+		uint8x16_t matches = vorrq_u8(
+			vorrq_u8(vceqq_u8(block, ampersand), vceqq_u8(block, less)),
+			vorrq_u8(vceqq_u8(block, greater), vceqq_u8(block, quote)));
+
+		uint8x8_t halves = vorr_u8(vget_low_u8(matches), vget_high_u8(matches));
+
+		/* The block has a match, which the loop below finds. The halves are
+		 * combined without vmaxvq_u8, which only AArch64 has. */
+		if (vget_lane_u64(vreinterpret_u64_u8(halves), 0))
+		{
+			break;
+		}
+	}
+#endif
+
+	for (; i < size; i++)
+	{
+		if (get_escape(string[i]))
+		{
+			return i;
+		}
+	}
+
+	return size;
+}
+
+/* Formats string as an attribute value, escaping the characters that would
+ * end or break it. Runs of characters needing no escaping are copied as is. */
+static void format_escaped(Format_Buffer *output, const char *string)
+{
+	size_t size = strlen(string);
+
+	while (1)
+	{
+		size_t clean_size = find_escape(string, size);
+
+		format_bytes(output, string, clean_size);
+
+		if (clean_size == size)
+		{
+			return;
+		}
+
+		format_string(output, get_escape(string[clean_size]));
+		string += clean_size + 1;
+		size -= clean_size + 1;
+	}
+}
+
+static void format_int(Format_Buffer *output, int value)
+{
+	char digits[16];
+	char *start = digits + sizeof(digits);
+	unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : value;
+
+	do
+	{
+		*--start = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+
+	if (value < 0)
+	{
+		*--start = '-';
+	}
+
+	format_bytes(output, start, digits + sizeof(digits) - start);
+}
+
+/* Formats a way element without going through stdio, so that the same code
+ * can size ways and fill them in mapped output. */
+static size_t xml_format_way(void *user_data, const Dr2osm_Way *way,
+							 char *buffer, size_t capacity)
+{
+	Format_Buffer output = {buffer, capacity, 0};
+
+	format_string(&output, "<way visible=\"true\" id=\"");
+	format_int(&output, way->id);
+	format_string(&output, "\">");
+
+	for (int i = 0; i < way->num_node_ids; i++)
+	{
+		format_string(&output, "<nd ref=\"");
+		format_int(&output, way->node_ids[i]);
+		format_string(&output, "\"/>");
+	}
+
+	for (int i = 0; i < way->num_tags; i++)
+	{
+		format_string(&output, "<tag k=\"");
+		format_escaped(&output, way->tags[i].key);
+		format_string(&output, "\" v=\"");
+		format_escaped(&output, way->tags[i].value);
+		format_string(&output, "\"/>");
+	}
+
+	format_string(&output, "</way>\n");
+
+	return output.size;
+}
+
+static int xml_way(void *user_data, const Dr2osm_Way *way)
+{
+	Dr2osm_Stream *output = user_data;
+
+	size_t available = STREAM_BLOCK_SIZE - output->used;
+	size_t size = xml_format_way(user_data, way, output->buffer + output->used,
+								 available);
+
+	if (size <= available)
+	{
+		output->used += size;
+		return 1;
+	}
+
+	/* The way did not fit in the current block, so format it again in a
+	 * temporary buffer and write it from there. */
+	char *temporary = malloc(size);
+
+	if (!temporary)
+	{
+		output->failed = 1;
+		return 0;
+	}
+
+	xml_format_way(user_data, way, temporary, size);
+
+	int result = dr2osm_stream_write(output, temporary, size);
+
+	free(temporary);
+
+	return result;
+}
+
+static int xml_can_map_output(void *user_data)
+{
+	return stream_can_map(user_data);
+}
+
+static char *xml_map_output(void *user_data, int64_t size)
+{
+	return stream_map(user_data, size);
+}
+
+static int xml_unmap_output(void *user_data)
+{
+	return stream_unmap(user_data);
+}
+
+static int xml_end(void *user_data)
+{
+	Dr2osm_Stream *output = user_data;
+
+	return stream_printf(output, "</osm>\n");
+}
+
+void dr2osm_xml_sink(Dr2osm_Sink *sink, Dr2osm_Stream *output)
+{
+	sink->user_data = output;
+	sink->begin = xml_begin;
+	sink->node = xml_node;
+	sink->way = xml_way;
+	sink->end = xml_end;
+	sink->format_way = xml_format_way;
+	sink->can_map_output = xml_can_map_output;
+	sink->map_output = xml_map_output;
+	sink->unmap_output = xml_unmap_output;
+}
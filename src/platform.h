@@ -0,0 +1,32 @@
+#if defined(RELEASE_BUILD)
+#define assert(P) 0
+#elif defined(_WIN32)
+#define assert(P)         \
+	do                    \
+	{                     \
+		if (!(P))         \
+			DebugBreak(); \
+	} while (0)
+#else
+#define assert(P)             \
+	do                        \
+	{                         \
+		if (!(P))             \
+			__builtin_trap(); \
+	} while (0)
+#endif
+
+#if defined(_WIN32)
+#define FORMAT_UNICODE_STRING "%ls"
+#define UNICODE_STRCMP(A, B) wcscmp(A, L##B)
+#define UNICODE_FOPEN(FILENAME, MODE) _wfopen(FILENAME, L##MODE)
+#define UNICODE_RENAME(FROM, TO) \
+	(MoveFileExW(FROM, TO, MOVEFILE_REPLACE_EXISTING) ? 0 : -1)
+#define UNICODE_REMOVE(FILENAME) _wremove(FILENAME)
+#else
+#define FORMAT_UNICODE_STRING "%s"
+#define UNICODE_STRCMP(A, B) strcmp(A, B)
+#define UNICODE_FOPEN(FILENAME, MODE) fopen(FILENAME, MODE)
+#define UNICODE_RENAME(FROM, TO) rename(FROM, TO)
+#define UNICODE_REMOVE(FILENAME) remove(FILENAME)
+#endif
@@ -0,0 +1,637 @@
+/* Resident extract server. dr2osm_serve processes the inputs once, indexes the
+ * result in memory and then answers extract requests over a Unix domain
+ * socket, so that repeated extracts skip the sqlite query, node deduplication
+ * and PROJ setup. The request protocol is described next to dr2osm_serve in
+ * dr2osm.h. Requests are served one at a time on the calling thread. */
+
+#define EXTRACT_GRID_CELL_SIZE 1000
+#define MAX_REQUEST_SIZE 1024
+
+/* The box is projected by sampling this many segments of each of its edges,
+ * which are curved in the projected coordinates. */
+#define BBOX_EDGE_SEGMENTS 16
+
+static void free_extract_server(Extract_Server *server)
+{
+	free(server->way_offsets);
+	free(server->way_municipalities);
+	free(server->node_coordinates);
+	free(server->node_way_starts);
+	free(server->node_ways);
+	free(server->selected_ways);
+	free(server->selected_nodes);
+	free_node_grid(&server->grid);
+}
+
+/* Builds the indices of server over the processed input of its converter.
+ * Returns nonzero on success, 0 on error. */
+static int build_extract_server(Extract_Server *server)
+{
+	Dr2osm_Converter *converter = server->converter;
+	size_t num_ids = (size_t)converter->last_id + 1;
+	size_t num_ways = converter->num_ways > 0 ? converter->num_ways : 1;
+
+	server->way_offsets = index_ways(converter);
+
+	if (!server->way_offsets)
+	{
+		return 0;
+	}
+
+	server->way_municipalities = malloc(num_ways * sizeof(int));
+	server->node_coordinates = malloc(2 * num_ids * sizeof(double));
+	server->node_way_starts = calloc(num_ids + 1, sizeof(int));
+	server->selected_ways = malloc(num_ways);
+	server->selected_nodes = malloc(num_ids);
+
+	if (!server->way_municipalities || !server->node_coordinates
+		|| !server->node_way_starts || !server->selected_ways
+		|| !server->selected_nodes)
+	{
+		fprintf(stderr, "Unable to allocate extract server: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	if (!build_node_grid(&server->grid, &converter->node_index,
+						 EXTRACT_GRID_CELL_SIZE))
+	{
+		return 0;
+	}
+
+	/* Project every node once up front. */
+	Node_Index *index = &converter->node_index;
+
+	for (int i = 0; i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+		PJ_COORD fin = proj_coord((double)node->x, (double)node->y, 0, 0);
+		PJ_COORD wgs = proj_trans(converter->projection, PJ_FWD, fin);
+
+		server->node_coordinates[2 * node->id] = wgs.xy.x;
+		server->node_coordinates[2 * node->id + 1] = wgs.xy.y;
+	}
+
+	/* Count the references to each node, turn the counts into starts and
+	 * fill in the ways using the starts as cursors, which shifts each start
+	 * to the next node, and shift them back afterwards. */
+	Growable_Buffer way_buffer = converter->way_buffer;
+	Way_Attributes attributes;
+	Dr2osm_Way way;
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		way_buffer.first_in_offset = server->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		server->way_municipalities[i] = attributes.municipality;
+
+		for (int j = 0; j < way.num_node_ids; j++)
+		{
+			server->node_way_starts[way.node_ids[j] + 1]++;
+		}
+	}
+
+	for (size_t i = 0; i < num_ids; i++)
+	{
+		server->node_way_starts[i + 1] += server->node_way_starts[i];
+	}
+
+	server->node_ways = malloc(((size_t)server->node_way_starts[num_ids] + 1)
+							   * sizeof(int));
+
+	if (!server->node_ways)
+	{
+		fprintf(stderr, "Unable to allocate extract server: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		way_buffer.first_in_offset = server->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		for (int j = 0; j < way.num_node_ids; j++)
+		{
+			server->node_ways[server->node_way_starts[way.node_ids[j]]++] = i;
+		}
+	}
+
+	for (size_t i = num_ids; i > 0; i--)
+	{
+		server->node_way_starts[i] = server->node_way_starts[i - 1];
+	}
+
+	server->node_way_starts[0] = 0;
+
+	return 1;
+}
+
+/* Selects the ways referencing the nodes from node to end that lie in the
+ * WGS 84 box bbox, given as minimum longitude, minimum latitude, maximum
+ * longitude and maximum latitude. */
+static void select_grid_nodes(Extract_Server *server, const Grid_Node *node,
+							  const Grid_Node *end, const double *bbox)
+{
+	for (; node < end; node++)
+	{
+		double lat = server->node_coordinates[2 * node->id];
+		double lon = server->node_coordinates[2 * node->id + 1];
+
+		if (lon < bbox[0] || lat < bbox[1] || lon > bbox[2] || lat > bbox[3])
+		{
+			continue;
+		}
+
+		for (int i = server->node_way_starts[node->id];
+			 i < server->node_way_starts[node->id + 1]; i++)
+		{
+			server->selected_ways[server->node_ways[i]] = 1;
+		}
+	}
+}
+
+/* Selects the ways with at least one node in the WGS 84 box bbox, see
+ * select_grid_nodes. Only the grid cells overlapping the box are searched,
+ * unless there are more of them than there are buckets in the grid. */
+static void select_bbox(Extract_Server *server, const double *bbox)
+{
+	Dr2osm_Converter *converter = server->converter;
+	const Node_Grid *grid = &server->grid;
+	double min_x = HUGE_VAL, min_y = HUGE_VAL;
+	double max_x = -HUGE_VAL, max_y = -HUGE_VAL;
+
+	memset(server->selected_ways, 0, converter->num_ways);
+
+	for (int i = 0; i <= BBOX_EDGE_SEGMENTS; i++)
+	{
+		double t = (double)i / BBOX_EDGE_SEGMENTS;
+		double lon = bbox[0] + t * (bbox[2] - bbox[0]);
+		double lat = bbox[1] + t * (bbox[3] - bbox[1]);
+		double lats[4] = {bbox[1], bbox[3], lat, lat};
+		double lons[4] = {lon, lon, bbox[0], bbox[2]};
+
+		for (int j = 0; j < 4; j++)
+		{
+			PJ_COORD wgs = proj_coord(lats[j], lons[j], 0, 0);
+			PJ_COORD fin = proj_trans(converter->projection, PJ_INV, wgs);
+
+			min_x = fin.xy.x < min_x ? fin.xy.x : min_x;
+			min_y = fin.xy.y < min_y ? fin.xy.y : min_y;
+			max_x = fin.xy.x > max_x ? fin.xy.x : max_x;
+			max_y = fin.xy.y > max_y ? fin.xy.y : max_y;
+		}
+	}
+
+	/* A cell of margin covers the bulge of the edges between the samples. */
+	min_x -= grid->cell_size;
+	min_y -= grid->cell_size;
+	max_x += grid->cell_size;
+	max_y += grid->cell_size;
+
+	double num_cells = (max_x - min_x) / grid->cell_size
+					   * ((max_y - min_y) / grid->cell_size);
+
+	if (!(num_cells <= (double)grid->num_buckets) || min_x < INT_MIN
+		|| min_y < INT_MIN || max_x > INT_MAX || max_y > INT_MAX)
+	{
+		select_grid_nodes(server, grid->nodes,
+						  grid->nodes + grid->bucket_starts[grid->num_buckets],
+						  bbox);
+		return;
+	}
+
+	int min_cell_x = get_grid_cell(grid, (int)min_x);
+	int min_cell_y = get_grid_cell(grid, (int)min_y);
+	int max_cell_x = get_grid_cell(grid, (int)max_x);
+	int max_cell_y = get_grid_cell(grid, (int)max_y);
+
+	/* Buckets are shared by cells with the same hash, so a bucket can be
+	 * searched more than once, which selects the same ways again. */
+	for (int cell_x = min_cell_x; cell_x <= max_cell_x; cell_x++)
+	{
+		for (int cell_y = min_cell_y; cell_y <= max_cell_y; cell_y++)
+		{
+			size_t bucket = get_grid_bucket(grid, cell_x, cell_y);
+
+			select_grid_nodes(server,
+							  grid->nodes + grid->bucket_starts[bucket],
+							  grid->nodes + grid->bucket_starts[bucket + 1],
+							  bbox);
+		}
+	}
+}
+
+/* Selects the ways in the municipality with the Statistics Finland code
+ * municipality. */
+static void select_municipality(Extract_Server *server, int municipality)
+{
+	for (int i = 0; i < server->converter->num_ways; i++)
+	{
+		server->selected_ways[i] =
+			server->way_municipalities[i] == municipality;
+	}
+}
+
+/* Passes the selected ways that profile keeps, and the nodes they reference,
+ * to sink in the same order as a full conversion would.
+ * Returns the number of ways passed to sink, or -1 on error. */
+static int write_extract(Extract_Server *server, const Dr2osm_Sink *sink,
+						 Dr2osm_Profile profile)
+{
+	Dr2osm_Converter *converter = server->converter;
+	Growable_Buffer way_buffer = converter->way_buffer;
+	Way_Attributes attributes;
+	Way_Tag_Storage storage;
+	Dr2osm_Way way;
+	int highway, route, oneway;
+	int num_ways = 0;
+
+	memset(server->selected_nodes, 0, (size_t)converter->last_id + 1);
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		if (!server->selected_ways[i])
+		{
+			continue;
+		}
+
+		way_buffer.first_in_offset = server->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		if (!classify_way(&attributes, profile, &highway, &route, &oneway))
+		{
+			server->selected_ways[i] = 0;
+			continue;
+		}
+
+		for (int j = 0; j < way.num_node_ids; j++)
+		{
+			server->selected_nodes[way.node_ids[j]] = 1;
+		}
+	}
+
+	if (!sink->begin(sink->user_data))
+	{
+		return -1;
+	}
+
+	for (int id = 1; id <= converter->last_id; id++)
+	{
+		if (server->selected_nodes[id])
+		{
+			Dr2osm_Node node;
+			node.id = id;
+			node.lat = server->node_coordinates[2 * id];
+			node.lon = server->node_coordinates[2 * id + 1];
+
+			if (!sink->node(sink->user_data, &node))
+			{
+				return -1;
+			}
+		}
+	}
+
+	for (int i = 0; i < converter->num_ways; i++)
+	{
+		if (!server->selected_ways[i])
+		{
+			continue;
+		}
+
+		way_buffer.first_in_offset = server->way_offsets[i];
+		pop_way(&way_buffer, &way, &attributes);
+
+		if (tag_way(&attributes, &converter->options, profile, &way, &storage))
+		{
+			if (!sink->way(sink->user_data, &way))
+			{
+				return -1;
+			}
+
+			num_ways++;
+		}
+	}
+
+	return sink->end(sink->user_data) ? num_ways : -1;
+}
+
+#if !defined(_WIN32)
+
+/* Reads a request line of at most MAX_REQUEST_SIZE - 1 bytes from client into
+ * request, without the line break.
+ * Returns nonzero on success, 0 on error. */
+static int read_request(int client, char *request)
+{
+	size_t size = 0;
+
+	while (size < MAX_REQUEST_SIZE - 1)
+	{
+		ssize_t received = read(client, request + size,
+								MAX_REQUEST_SIZE - 1 - size);
+
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (received <= 0)
+		{
+			break;
+		}
+
+		char *line_end = memchr(request + size, '\n', received);
+
+		if (line_end)
+		{
+			size = line_end - request;
+			break;
+		}
+
+		size += received;
+	}
+
+	request[size] = 0;
+
+	if (size && request[size - 1] == '\r')
+	{
+		request[size - 1] = 0;
+	}
+
+	return size > 0;
+}
+
+/* Answers the request of client with an error message. */
+static void reject_request(int client, const char *message)
+{
+	char reply[256];
+	int size = snprintf(reply, sizeof(reply), "error: %s\n", message);
+
+	if (write(client, reply, size) != size)
+	{
+		fprintf(stderr, "Unable to answer extract request: %s\n",
+				strerror(errno));
+	}
+}
+
+/* Reads the request of client, streams the extract to it and closes the
+ * connection.
+ * Returns 0 if the request asked the server to stop, nonzero otherwise. */
+static int serve_client(Extract_Server *server, int client)
+{
+	Dr2osm_Converter *converter = server->converter;
+	double start_time = get_time();
+	char request[MAX_REQUEST_SIZE];
+	char format[16] = "xml";
+	char profile_name[16] = "default";
+	double bbox[4];
+	int municipality;
+
+	if (!read_request(client, request))
+	{
+		close(client);
+		return 1;
+	}
+
+	if (!strcmp(request, "quit"))
+	{
+		close(client);
+		return 0;
+	}
+
+	if (sscanf(request, "bbox %lf %lf %lf %lf %15s %15s", &bbox[0], &bbox[1],
+			   &bbox[2], &bbox[3], format, profile_name) >= 4)
+	{
+		if (!isfinite(bbox[0]) || !isfinite(bbox[1]) || !isfinite(bbox[2])
+			|| !isfinite(bbox[3]))
+		{
+			reject_request(client, "invalid bounding box");
+			close(client);
+			return 1;
+		}
+
+		if (!(bbox[0] <= bbox[2] && bbox[1] <= bbox[3]))
+		{
+			reject_request(client, "empty bounding box");
+			close(client);
+			return 1;
+		}
+
+		select_bbox(server, bbox);
+	}
+	else if (sscanf(request, "municipality %d %15s %15s", &municipality,
+					format, profile_name) >= 1)
+	{
+		select_municipality(server, municipality);
+	}
+	else
+	{
+		reject_request(client, "invalid request");
+		close(client);
+		return 1;
+	}
+
+	Dr2osm_Profile profile;
+
+	if (!strcmp(profile_name, "default"))
+	{
+		profile = DR2OSM_PROFILE_DEFAULT;
+	}
+	else if (!strcmp(profile_name, "car"))
+	{
+		profile = DR2OSM_PROFILE_CAR;
+	}
+	else if (!strcmp(profile_name, "bicycle"))
+	{
+		profile = DR2OSM_PROFILE_BICYCLE;
+	}
+	else if (!strcmp(profile_name, "foot"))
+	{
+		profile = DR2OSM_PROFILE_FOOT;
+	}
+	else
+	{
+		reject_request(client, "unknown profile");
+		close(client);
+		return 1;
+	}
+
+	if (strcmp(format, "xml") && strcmp(format, "o5m")
+		&& strcmp(format, "graph"))
+	{
+		reject_request(client, "unknown format");
+		close(client);
+		return 1;
+	}
+
+	FILE *file = fdopen(client, "wb");
+	Dr2osm_Stream *stream =
+		file ? open_file_stream(file, 1, COMPRESSION_NONE, 1) : 0;
+
+	if (!stream)
+	{
+		if (file)
+		{
+			fclose(file);
+		}
+		else
+		{
+			close(client);
+		}
+
+		return 1;
+	}
+
+	Dr2osm_Sink sink;
+	int sink_created = 1;
+
+	if (!strcmp(format, "o5m"))
+	{
+		sink_created = dr2osm_o5m_sink(&sink, stream);
+	}
+	else if (!strcmp(format, "graph"))
+	{
+		sink_created = dr2osm_graph_sink(&sink, stream);
+	}
+	else
+	{
+		dr2osm_xml_sink(&sink, stream);
+	}
+
+	int num_ways = sink_created ? write_extract(server, &sink, profile) : -1;
+
+	if (!dr2osm_stream_close(stream))
+	{
+		num_ways = -1;
+	}
+
+	if (num_ways < 0)
+	{
+		fprintf(stderr, "Unable to serve extract \"%s\".\n", request);
+	}
+	else if (converter->options.print_stats)
+	{
+		fprintf(stderr, "Served extract \"%s\" with %d ways in %.3f s.\n",
+				request, num_ways, get_time() - start_time);
+	}
+
+	return 1;
+}
+
+/* Creates a Unix domain socket listening at path, replacing any file there.
+ * Returns the socket, or -1 on error. */
+static int open_listener(const char *path)
+{
+	struct sockaddr_un address;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "The socket path \"%s\" is too long.\n", path);
+		return -1;
+	}
+
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listener < 0)
+	{
+		fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address))
+		|| listen(listener, 16))
+	{
+		fprintf(stderr, "Unable to listen on \"%s\": %s\n", path,
+				strerror(errno));
+		close(listener);
+		return -1;
+	}
+
+	return listener;
+}
+
+#endif
+
+int dr2osm_serve(Dr2osm_Converter *converter,
+				 const Unicode_Character *socket_path)
+{
+#if defined(_WIN32)
+	fprintf(stderr, "The extract server is not available on Windows.\n");
+	return 0;
+#else
+	if (converter->options.node_memory_limit || converter->num_merge_inputs)
+	{
+		fprintf(stderr,
+				"The extract server cannot be combined with external node "
+				"deduplication or merged files.\n");
+		return 0;
+	}
+
+	if (setjmp(converter->out_of_memory))
+	{
+		return 0;
+	}
+
+	double start_time = get_time();
+
+	if (!process_input(converter))
+	{
+		return 0;
+	}
+
+	Extract_Server server = {0};
+	server.converter = converter;
+
+	int result = build_extract_server(&server);
+	int listener = result ? open_listener(socket_path) : -1;
+
+	if (listener < 0)
+	{
+		free_extract_server(&server);
+		return 0;
+	}
+
+	fprintf(stderr, "Serving %d ways on \"%s\", loaded in %.2f s.\n",
+			converter->num_ways, socket_path, get_time() - start_time);
+
+	/* A client disconnecting early must only fail its own request. */
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1)
+	{
+		int client = accept(listener, 0, 0);
+
+		if (client < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			fprintf(stderr, "Unable to accept connection: %s\n",
+					strerror(errno));
+			result = 0;
+			break;
+		}
+
+		if (!serve_client(&server, client))
+		{
+			break;
+		}
+	}
+
+	close(listener);
+	unlink(socket_path);
+	free_extract_server(&server);
+
+	return result;
+#endif
+}
@@ -0,0 +1,241 @@
+/* Snapshots store the deduplicated nodes and the buffered ways of a converter
+ * after the input has been processed, so that a later run can skip the sqlite
+ * query, geometry parsing and node deduplication. The file format is
+ * described next to Snapshot_Header in types.h. */
+
+/* Returns nonzero if the file at path starts with a snapshot header. On
+ * success the file is left open in *file, positioned after the header, which
+ * is read into header. */
+static int open_snapshot(const Unicode_Character *path, FILE **file,
+						 Snapshot_Header *header)
+{
+	FILE *input = UNICODE_FOPEN(path, "rb");
+
+	if (!input)
+	{
+		return 0;
+	}
+
+	if (fread(header, sizeof(Snapshot_Header), 1, input) != 1
+		|| memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)))
+	{
+		fclose(input);
+		return 0;
+	}
+
+	*file = input;
+
+	return 1;
+}
+
+/* Reads size bytes from input into data.
+ * Returns nonzero on success, 0 on error. */
+static int read_snapshot_data(FILE *input, void *data, size_t size)
+{
+	if (size && fread(data, size, 1, input) != 1)
+	{
+		fprintf(stderr, "Unable to read snapshot: %s\n",
+				feof(input) ? "Unexpected end of file" : strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Writes size bytes from data to output, reporting errors with path.
+ * Returns nonzero on success, 0 on error. */
+static int write_snapshot_data(FILE *output, const void *data, size_t size,
+							   const Unicode_Character *path)
+{
+	if (size && fwrite(data, size, 1, output) != 1)
+	{
+		fprintf(stderr,
+				"Unable to write snapshot \"" FORMAT_UNICODE_STRING "\": %s\n",
+				path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Writes the node index and the unpopped part of the way buffer of converter
+ * to a snapshot at path. If progress is not 0, the input is still being
+ * processed by the query of progress and the snapshot is written as a
+ * checkpoint of it.
+ * Returns nonzero on success, 0 on error. */
+static int write_snapshot(Dr2osm_Converter *converter,
+						  const Unicode_Character *path,
+						  const Query_Context *progress)
+{
+	FILE *output = UNICODE_FOPEN(path, "wb");
+
+	if (!output)
+	{
+		fprintf(stderr,
+				"Unable to open \"" FORMAT_UNICODE_STRING "\" for writing: %s\n",
+				path, strerror(errno));
+		return 0;
+	}
+
+	Node_Index *index = &converter->node_index;
+	Growable_Buffer *way_buffer = &converter->way_buffer;
+
+	Snapshot_Header header = {0};
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order_mark = SNAPSHOT_BYTE_ORDER_MARK;
+	header.last_id = converter->last_id;
+	header.num_nodes = converter->node_file ? converter->num_file_nodes
+											: index->num_nodes;
+	header.num_ways = converter->num_ways;
+
+	if (progress)
+	{
+		header.num_ways += progress->num_valid;
+		header.stage = progress->stage;
+		header.input = progress->input;
+		header.last_rowid = progress->rowid;
+		header.num_invalid = progress->num_invalid;
+	}
+
+	header.nodes_offset = sizeof(Snapshot_Header);
+	header.ways_offset = (header.nodes_offset
+						  + header.num_nodes * sizeof(Snapshot_Node) + 7)
+						 & ~(int64_t)7;
+	header.ways_size = way_buffer->next_in_offset - way_buffer->first_in_offset;
+
+	int result = write_snapshot_data(output, &header, sizeof(header), path);
+
+	/* Nodes are converted in chunks to keep the number of writes down.
+	 * Externally deduplicated nodes are already in the snapshot format, and
+	 * the node index is empty then. */
+	Snapshot_Node chunk[4096];
+	int chunk_size = 0;
+
+	if (converter->node_file)
+	{
+		rewind(converter->node_file);
+
+		for (int32_t i = 0; result && i < header.num_nodes; i += chunk_size)
+		{
+			chunk_size = header.num_nodes - i < 4096 ? header.num_nodes - i
+													 : 4096;
+			result = read_snapshot_data(converter->node_file, chunk,
+										chunk_size * sizeof(Snapshot_Node))
+					 && write_snapshot_data(output, chunk,
+											chunk_size * sizeof(Snapshot_Node),
+											path);
+		}
+
+		chunk_size = 0;
+	}
+
+	for (int i = 0; result && i < index->num_nodes; i++)
+	{
+		Node *node = get_ordered_node(index, i);
+
+		chunk[chunk_size].x = node->x;
+		chunk[chunk_size].y = node->y;
+		chunk[chunk_size].id = node->id;
+
+		if (++chunk_size == 4096 || i + 1 == index->num_nodes)
+		{
+			result = write_snapshot_data(
+				output, chunk, chunk_size * sizeof(Snapshot_Node), path);
+			chunk_size = 0;
+		}
+	}
+
+	static const char padding[8];
+	int64_t padding_size = header.ways_offset - header.nodes_offset
+						   - header.num_nodes * sizeof(Snapshot_Node);
+
+	result = result
+			 && write_snapshot_data(output, padding, padding_size, path)
+			 && write_snapshot_data(output,
+									way_buffer->start + way_buffer->first_in_offset,
+									header.ways_size, path);
+
+	if (fclose(output) && result)
+	{
+		fprintf(stderr,
+				"Unable to write snapshot \"" FORMAT_UNICODE_STRING "\": %s\n",
+				path, strerror(errno));
+		result = 0;
+	}
+
+	return result;
+}
+
+/* Loads the snapshot in input, whose header has already been read into
+ * header, into the node index and way buffer of converter. The node index is
+ * rebuilt by inserting the nodes in their original order, so that nodes of
+ * further inputs are deduplicated against them.
+ * Returns nonzero on success, 0 on error. */
+static int load_snapshot(Dr2osm_Converter *converter, FILE *input,
+						 const Snapshot_Header *header)
+{
+	if (header->version != SNAPSHOT_VERSION
+		|| header->byte_order_mark != SNAPSHOT_BYTE_ORDER_MARK)
+	{
+		fprintf(stderr,
+				"Snapshot was written by an incompatible version of dr2osm "
+				"or on a machine with a different byte order.\n");
+		return 0;
+	}
+
+	/* The nodes follow the header, which has already been read. */
+	if (header->nodes_offset != sizeof(Snapshot_Header))
+	{
+		fprintf(stderr, "Unable to read snapshot: Invalid header\n");
+		return 0;
+	}
+
+	Snapshot_Node chunk[4096];
+
+	for (int32_t i = 0; i < header->num_nodes;)
+	{
+		int chunk_size = header->num_nodes - i < 4096
+							 ? header->num_nodes - i
+							 : 4096;
+
+		if (!read_snapshot_data(input, chunk, chunk_size * sizeof(Snapshot_Node)))
+		{
+			return 0;
+		}
+
+		for (int j = 0; j < chunk_size; j++)
+		{
+			uint32_t ref = node_upsert(&converter->node_index, 0, chunk[j].x,
+									   chunk[j].y);
+
+			get_node(&converter->node_index, ref)->id = chunk[j].id;
+			order_node(&converter->node_index, ref);
+		}
+
+		i += chunk_size;
+	}
+
+	/* The padding before the ways is at most 7 bytes. */
+	char padding[8];
+	int64_t padding_size = header->ways_offset - header->nodes_offset
+						   - header->num_nodes * sizeof(Snapshot_Node);
+
+	if (padding_size < 0 || padding_size > 7
+		|| !read_snapshot_data(input, padding, padding_size))
+	{
+		return 0;
+	}
+
+	void *ways = buffer_push(&converter->way_buffer, header->ways_size);
+
+	if (!read_snapshot_data(input, ways, header->ways_size))
+	{
+		return 0;
+	}
+
+	converter->last_id = header->last_id;
+	converter->num_ways += header->num_ways;
+
+	return 1;
+}
@@ -0,0 +1,1107 @@
+/* Output streams. Every stream hands its filled blocks to a writer thread,
+ * so the conversion goes on while the output is written. Compressed streams
+ * first compress each block independently on a pool of worker threads, in
+ * the style of pigz, and the writer thread concatenates the compressed blocks
+ * in order. A concatenation of gzip members is a valid gzip file and a
+ * concatenation of zstd frames is a valid zstd file, so the result can be
+ * read with the usual tools. */
+
+/* Returns nonzero if path ends with extension, which must be ASCII. */
+static int has_extension(const Unicode_Character *path,
+						 const char *extension)
+{
+	size_t path_length = 0;
+	size_t extension_length = strlen(extension);
+
+	while (path[path_length])
+	{
+		path_length++;
+	}
+
+	if (path_length < extension_length)
+	{
+		return 0;
+	}
+
+	path += path_length - extension_length;
+
+	for (size_t i = 0; i < extension_length; i++)
+	{
+		if (path[i] != (Unicode_Character)extension[i])
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Compresses the input of block into its output.
+ * Returns nonzero on success, 0 on error. */
+static int compress_block(int compression, Compression_Block *block)
+{
+	switch (compression)
+	{
+	case COMPRESSION_GZIP:
+	{
+		z_stream z = {0};
+
+		/* Adding 16 to the window bits selects the gzip format. */
+		if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+						 Z_DEFAULT_STRATEGY)
+			!= Z_OK)
+		{
+			return 0;
+		}
+
+		z.next_in = (Bytef *)block->input;
+		z.avail_in = (uInt)block->input_size;
+		z.next_out = (Bytef *)block->output;
+		z.avail_out = (uInt)block->output_capacity;
+
+		int rc = deflate(&z, Z_FINISH);
+
+		block->output_size = z.total_out;
+		deflateEnd(&z);
+
+		return rc == Z_STREAM_END;
+	}
+
+#if defined(HAVE_ZSTD)
+	case COMPRESSION_ZSTD:
+	{
+		size_t size = ZSTD_compress(block->output, block->output_capacity,
+									block->input, block->input_size, 3);
+
+		block->output_size = size;
+
+		return !ZSTD_isError(size);
+	}
+#endif
+
+	default:
+		return 0;
+	}
+}
+
+/* Worker thread of a compressed stream. Compresses filled blocks until the
+ * stream is closed. */
+static void compression_worker(void *argument)
+{
+	Dr2osm_Stream *stream = argument;
+
+	lock_mutex(&stream->mutex);
+
+	while (1)
+	{
+		Compression_Block *block = 0;
+
+		for (int64_t i = stream->next_write_sequence;
+			 i < stream->next_fill_sequence; i++)
+		{
+			Compression_Block *candidate = &stream->blocks[i % stream->num_blocks];
+
+			if (candidate->state == BLOCK_FILLED)
+			{
+				block = candidate;
+				break;
+			}
+		}
+
+		if (block)
+		{
+			block->state = BLOCK_COMPRESSING;
+			unlock_mutex(&stream->mutex);
+
+			TRACE_BEGIN(compress_output);
+
+			int success = compress_block(stream->compression, block);
+
+			TRACE_END(compress_output);
+
+			lock_mutex(&stream->mutex);
+
+			if (!success)
+			{
+				fprintf(stderr, "Unable to compress output.\n");
+				stream->failed = 1;
+				block->output_size = 0;
+			}
+
+			block->state = BLOCK_COMPRESSED;
+			broadcast_condition(&stream->block_compressed);
+		}
+		else if (stream->closing)
+		{
+			break;
+		}
+		else
+		{
+			wait_condition(&stream->block_filled, &stream->mutex);
+		}
+	}
+
+	unlock_mutex(&stream->mutex);
+}
+
+/* Marks block as written and frees the blocks written so far in order, so
+ * that the thread filling them can reuse them. The stream must be locked. */
+static void free_written_blocks(Dr2osm_Stream *stream, Compression_Block *block)
+{
+	block->state = BLOCK_WRITTEN;
+
+	while (1)
+	{
+		Compression_Block *next =
+			&stream->blocks[stream->next_write_sequence % stream->num_blocks];
+
+		if (stream->next_write_sequence == stream->next_fill_sequence
+			|| next->state != BLOCK_WRITTEN)
+		{
+			break;
+		}
+
+		next->state = BLOCK_FREE;
+		stream->next_write_sequence++;
+	}
+
+	broadcast_condition(&stream->block_freed);
+}
+
+/* Writer thread of a stream. Writes the output of blocks to the file in the
+ * order they were filled until the stream is closed and every block has been
+ * written. */
+static void stream_writer(void *argument)
+{
+	Dr2osm_Stream *stream = argument;
+
+	lock_mutex(&stream->mutex);
+
+	while (1)
+	{
+		Compression_Block *block =
+			&stream->blocks[stream->next_write_sequence % stream->num_blocks];
+
+		if (stream->next_write_sequence < stream->next_fill_sequence
+			&& block->state == BLOCK_COMPRESSED)
+		{
+			int failed = stream->failed;
+
+			unlock_mutex(&stream->mutex);
+
+			TRACE_BEGIN(write_output);
+
+			/* After an error the blocks are only recycled, so that the
+			 * thread filling them does not wait forever. */
+			if (!failed && block->output_size
+				&& fwrite(block->output, block->output_size, 1, stream->file) != 1)
+			{
+				fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+				failed = 1;
+			}
+
+			TRACE_END(write_output);
+
+			lock_mutex(&stream->mutex);
+
+			stream->failed |= failed;
+			free_written_blocks(stream, block);
+		}
+		else if (stream->closing
+				 && stream->next_write_sequence == stream->next_fill_sequence)
+		{
+			break;
+		}
+		else
+		{
+			wait_condition(&stream->block_compressed, &stream->mutex);
+		}
+	}
+
+	unlock_mutex(&stream->mutex);
+}
+
+#if defined(USE_IO_URING)
+
+/* On Linux, plain files are written with io_uring, which lets several blocks
+ * be in flight at once. The queues are set up with the raw system calls, so
+ * no library is needed, and streams fall back to stream_writer if the kernel
+ * does not support io_uring or its write operation. */
+
+static int setup_io_ring(Io_Ring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(Io_Ring));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring->fd < 0)
+	{
+		return 0;
+	}
+
+	/* IORING_OP_WRITE came with the same kernel version as this feature. The
+	 * ring is closed by free_io_ring, which the caller calls on failure. */
+	if (!(params.features & IORING_FEAT_RW_CUR_POS))
+	{
+		return 0;
+	}
+
+	ring->sq_ring_size = params.sq_off.array
+						 + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes
+						 + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	char *sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_SQ_RING);
+	char *cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_CQ_RING);
+	void *sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	ring->sq_ring = sq_ring == MAP_FAILED ? 0 : sq_ring;
+	ring->cq_ring = cq_ring == MAP_FAILED ? 0 : cq_ring;
+	ring->sqes = sqes == MAP_FAILED ? 0 : sqes;
+
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes)
+	{
+		return 0;
+	}
+
+	ring->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+	return 1;
+}
+
+static void free_io_ring(Io_Ring *ring)
+{
+	if (ring->sq_ring)
+	{
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+
+	if (ring->cq_ring)
+	{
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (ring->sqes)
+	{
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->fd >= 0)
+	{
+		close(ring->fd);
+	}
+}
+
+/* Submits a write of the unwritten part of the output of block to fd.
+ * Returns nonzero on success, 0 on error. */
+static int submit_block_write(Io_Ring *ring, int fd, Compression_Block *block)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)(block->output + block->written);
+	sqe->len = (unsigned)(block->output_size - block->written);
+	sqe->off = block->file_offset + block->written;
+	sqe->user_data = (uintptr_t)block;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, 0, 0) == 1;
+}
+
+/* Waits for a write to complete and stores the number of bytes written, or
+ * a negative error number, in result.
+ * Returns the block of the write, or 0 on error. */
+static Compression_Block *wait_block_write(Io_Ring *ring, int *result)
+{
+	while (1)
+	{
+		unsigned head = *ring->cq_head;
+
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			Compression_Block *block =
+				(Compression_Block *)(uintptr_t)cqe->user_data;
+
+			*result = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+			return block;
+		}
+
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+					0, 0) < 0
+			&& errno != EINTR)
+		{
+			return 0;
+		}
+	}
+}
+
+/* Writer thread of a plain stream writing with io_uring. Submits every block
+ * as soon as it is filled and frees the blocks as their writes complete. */
+static void io_ring_writer(void *argument)
+{
+	Dr2osm_Stream *stream = argument;
+	int fd = fileno(stream->file);
+	int in_flight = 0;
+
+	lock_mutex(&stream->mutex);
+
+	while (1)
+	{
+		Compression_Block *block =
+			&stream->blocks[stream->next_submit_sequence % stream->num_blocks];
+
+		if (stream->next_submit_sequence < stream->next_fill_sequence
+			&& block->state == BLOCK_COMPRESSED)
+		{
+			int failed = stream->failed;
+
+			block->state = BLOCK_WRITING;
+			block->file_offset = stream->file_offset;
+			block->written = 0;
+			stream->file_offset += block->output_size;
+			stream->next_submit_sequence++;
+
+			unlock_mutex(&stream->mutex);
+
+			int submitted = !failed && block->output_size
+							&& submit_block_write(&stream->io_ring, fd, block);
+
+			if (!failed && block->output_size && !submitted)
+			{
+				fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+				failed = 1;
+			}
+
+			lock_mutex(&stream->mutex);
+
+			stream->failed |= failed;
+
+			if (submitted)
+			{
+				in_flight++;
+			}
+			else
+			{
+				free_written_blocks(stream, block);
+			}
+		}
+		else if (in_flight)
+		{
+			unlock_mutex(&stream->mutex);
+
+			int result;
+			int failed = 0;
+			int done = 1;
+
+			TRACE_BEGIN(write_output);
+
+			block = wait_block_write(&stream->io_ring, &result);
+
+			TRACE_END(write_output);
+
+			if (!block)
+			{
+				/* Without a completion the writes in flight cannot be
+				 * accounted for, so stop waiting for them. */
+				fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+				lock_mutex(&stream->mutex);
+				stream->failed = 1;
+				break;
+			}
+
+			if (result <= 0)
+			{
+				fprintf(stderr, "Unable to write output: %s\n",
+						strerror(result ? -result : EIO));
+				failed = 1;
+			}
+			else if ((block->written += result) < block->output_size)
+			{
+				/* Continue a short write. */
+				done = 0;
+
+				if (!submit_block_write(&stream->io_ring, fd, block))
+				{
+					fprintf(stderr, "Unable to write output: %s\n",
+							strerror(errno));
+					failed = done = 1;
+				}
+			}
+
+			lock_mutex(&stream->mutex);
+
+			stream->failed |= failed;
+
+			if (done)
+			{
+				in_flight--;
+				free_written_blocks(stream, block);
+			}
+		}
+		else if (stream->closing
+				 && stream->next_write_sequence == stream->next_fill_sequence)
+		{
+			break;
+		}
+		else
+		{
+			wait_condition(&stream->block_compressed, &stream->mutex);
+		}
+	}
+
+	unlock_mutex(&stream->mutex);
+}
+
+#endif
+
+/* Passes the block currently being filled on to be compressed or written
+ * and waits for a free block to fill next. The time spent waiting is added to
+ * the stall time of the stream.
+ * Returns nonzero on success, 0 on error. */
+static int flush_stream_block(Dr2osm_Stream *stream)
+{
+	if (!stream->used || stream->failed)
+	{
+		stream->used = 0;
+		return !stream->failed;
+	}
+
+	TRACE_BEGIN(flush_output);
+
+	lock_mutex(&stream->mutex);
+
+	Compression_Block *block =
+		&stream->blocks[stream->next_fill_sequence % stream->num_blocks];
+
+	block->input_size = stream->used;
+	stream->next_fill_sequence++;
+
+	if (stream->compression == COMPRESSION_NONE)
+	{
+		block->output_size = stream->used;
+		block->state = BLOCK_COMPRESSED;
+		signal_condition(&stream->block_compressed);
+	}
+	else
+	{
+		block->state = BLOCK_FILLED;
+		signal_condition(&stream->block_filled);
+	}
+
+	block = &stream->blocks[stream->next_fill_sequence % stream->num_blocks];
+
+	if (block->state != BLOCK_FREE)
+	{
+		double start_time = get_time();
+
+		while (block->state != BLOCK_FREE)
+		{
+			wait_condition(&stream->block_freed, &stream->mutex);
+		}
+
+		stream->stall_seconds += get_time() - start_time;
+	}
+
+	int failed = stream->failed;
+
+	unlock_mutex(&stream->mutex);
+
+	stream->buffer = block->input;
+	stream->used = 0;
+
+	TRACE_END(flush_output);
+
+	return !failed;
+}
+
+/* Waits until every filled block of stream has been written.
+ * Returns nonzero on success, 0 on error. */
+static int drain_stream(Dr2osm_Stream *stream)
+{
+	if (!flush_stream_block(stream))
+	{
+		return 0;
+	}
+
+	lock_mutex(&stream->mutex);
+
+	double start_time = get_time();
+
+	while (stream->next_write_sequence < stream->next_fill_sequence)
+	{
+		wait_condition(&stream->block_freed, &stream->mutex);
+	}
+
+	stream->stall_seconds += get_time() - start_time;
+
+	int failed = stream->failed;
+
+	unlock_mutex(&stream->mutex);
+
+#if defined(USE_IO_URING)
+	/* Writes with io_uring do not move the file position. */
+	if (!failed && stream->use_io_ring
+		&& fseeko(stream->file, stream->file_offset, SEEK_SET))
+	{
+		fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+		stream->failed = failed = 1;
+	}
+#endif
+
+	return !failed;
+}
+
+/* Frees the resources of stream without flushing it. The threads of the
+ * stream must have been stopped. */
+static void free_stream(Dr2osm_Stream *stream)
+{
+	if (stream->free_sink_state)
+	{
+		stream->free_sink_state(stream->sink_state);
+	}
+
+	for (int i = 0; stream->blocks && i < stream->num_blocks; i++)
+	{
+		/* The blocks of plain streams are their own output. */
+		if (stream->blocks[i].output != stream->blocks[i].input)
+		{
+			free(stream->blocks[i].output);
+		}
+
+		free(stream->blocks[i].input);
+	}
+
+	free(stream->blocks);
+	free(stream->workers);
+	destroy_mutex(&stream->mutex);
+	destroy_condition(&stream->block_filled);
+	destroy_condition(&stream->block_compressed);
+	destroy_condition(&stream->block_freed);
+
+#if defined(USE_IO_URING)
+	if (stream->use_io_ring)
+	{
+		free_io_ring(&stream->io_ring);
+	}
+#endif
+
+	if (stream->close_file)
+	{
+		fclose(stream->file);
+	}
+
+	free(stream);
+}
+
+/* Stops the threads of a stream after the blocks filled so far have been
+ * written. */
+static void stop_stream_threads(Dr2osm_Stream *stream)
+{
+	lock_mutex(&stream->mutex);
+	stream->closing = 1;
+	broadcast_condition(&stream->block_filled);
+	broadcast_condition(&stream->block_compressed);
+	unlock_mutex(&stream->mutex);
+
+	for (int i = 0; i < stream->num_workers; i++)
+	{
+		join_thread(&stream->workers[i]);
+	}
+
+	join_thread(&stream->writer);
+}
+
+/* Sets up the block ring and starts the threads of a stream.
+ * Returns nonzero on success, 0 on error. */
+static int start_stream_threads(Dr2osm_Stream *stream, int num_threads)
+{
+	init_mutex(&stream->mutex);
+	init_condition(&stream->block_filled);
+	init_condition(&stream->block_compressed);
+	init_condition(&stream->block_freed);
+
+	int num_workers = 0;
+
+	if (stream->compression == COMPRESSION_NONE)
+	{
+		stream->num_blocks = PLAIN_STREAM_BLOCKS;
+	}
+	else
+	{
+		num_workers = num_threads > 0 ? num_threads : get_processor_count();
+
+		/* Enough blocks for every worker to have one in progress and one
+		 * waiting, so that the thread filling them rarely has to wait. */
+		stream->num_blocks = 2 * num_workers + 2;
+	}
+
+	stream->blocks = calloc(stream->num_blocks, sizeof(Compression_Block));
+	stream->workers = calloc(num_workers ? num_workers : 1, sizeof(Thread));
+
+	if (!stream->blocks || !stream->workers)
+	{
+		return 0;
+	}
+
+	size_t output_capacity = compressBound(STREAM_BLOCK_SIZE) + 32;
+
+#if defined(HAVE_ZSTD)
+	if (stream->compression == COMPRESSION_ZSTD)
+	{
+		output_capacity = ZSTD_compressBound(STREAM_BLOCK_SIZE);
+	}
+#endif
+
+	for (int i = 0; i < stream->num_blocks; i++)
+	{
+		Compression_Block *block = &stream->blocks[i];
+
+		block->input = malloc(STREAM_BLOCK_SIZE);
+
+		if (!block->input)
+		{
+			return 0;
+		}
+
+		if (stream->compression == COMPRESSION_NONE)
+		{
+			block->output = block->input;
+			block->output_capacity = STREAM_BLOCK_SIZE;
+		}
+		else
+		{
+			block->output = malloc(output_capacity);
+			block->output_capacity = output_capacity;
+
+			if (!block->output)
+			{
+				return 0;
+			}
+		}
+	}
+
+	stream->buffer = stream->blocks[0].input;
+
+	Thread_Function *writer = stream_writer;
+
+#if defined(USE_IO_URING)
+	/* Only seekable files can be written at explicit offsets. */
+	if (stream->compression == COMPRESSION_NONE
+		&& (stream->file_offset = ftello(stream->file)) >= 0)
+	{
+		stream->use_io_ring = setup_io_ring(&stream->io_ring,
+											PLAIN_STREAM_BLOCKS);
+
+		if (stream->use_io_ring)
+		{
+			writer = io_ring_writer;
+		}
+		else
+		{
+			free_io_ring(&stream->io_ring);
+		}
+	}
+#endif
+
+	if (!start_thread(&stream->writer, writer, stream))
+	{
+		return 0;
+	}
+
+	for (; stream->num_workers < num_workers; stream->num_workers++)
+	{
+		if (!start_thread(&stream->workers[stream->num_workers],
+						  compression_worker, stream))
+		{
+			stop_stream_threads(stream);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Opens an output stream writing to file, which is closed with the stream if
+ * close_file is nonzero. On error file is left open.
+ * Returns 0 on error. */
+static Dr2osm_Stream *open_file_stream(FILE *file, int close_file,
+									   int compression, int num_threads)
+{
+	Dr2osm_Stream *result = calloc(1, sizeof(Dr2osm_Stream));
+
+	if (!result)
+	{
+		fprintf(stderr, "Unable to allocate output stream: %s\n",
+				strerror(errno));
+		return 0;
+	}
+
+	result->file = file;
+	result->compression = compression;
+
+	if (!start_stream_threads(result, num_threads))
+	{
+		fprintf(stderr, "Unable to start output stream threads.\n");
+		free_stream(result);
+		return 0;
+	}
+
+	result->close_file = close_file;
+
+	return result;
+}
+
+Dr2osm_Stream *dr2osm_stream_open(const Unicode_Character *path,
+								  int num_threads)
+{
+	int compression = COMPRESSION_NONE;
+
+	if (has_extension(path, ".gz"))
+	{
+		compression = COMPRESSION_GZIP;
+	}
+	else if (has_extension(path, ".zst"))
+	{
+#if defined(HAVE_ZSTD)
+		compression = COMPRESSION_ZSTD;
+#else
+		fprintf(stderr, "This build of dr2osm does not support zstd output.\n");
+		return 0;
+#endif
+	}
+
+	if (!UNICODE_STRCMP(path, "-"))
+	{
+		return open_file_stream(stdout, 0, compression, num_threads);
+	}
+
+	/* Opened for reading too, since mapping the file for writing requires
+	 * it. */
+	FILE *file = UNICODE_FOPEN(path, "w+b");
+
+	if (!file)
+	{
+		fprintf(stderr,
+				"Unable to open \"" FORMAT_UNICODE_STRING "\" for writing: %s\n",
+				path, strerror(errno));
+		return 0;
+	}
+
+	Dr2osm_Stream *result = open_file_stream(file, 1, compression, num_threads);
+
+	if (!result)
+	{
+		fclose(file);
+	}
+
+	return result;
+}
+
+int dr2osm_stream_write(Dr2osm_Stream *stream, const void *data, size_t size)
+{
+	const char *bytes = data;
+
+	while (size > 0)
+	{
+		size_t chunk_size = STREAM_BLOCK_SIZE - stream->used;
+
+		if (chunk_size > size)
+		{
+			chunk_size = size;
+		}
+
+		memcpy(stream->buffer + stream->used, bytes, chunk_size);
+		stream->used += chunk_size;
+		bytes += chunk_size;
+		size -= chunk_size;
+
+		if (stream->used == STREAM_BLOCK_SIZE && !flush_stream_block(stream))
+		{
+			return 0;
+		}
+	}
+
+	return !stream->failed;
+}
+
+/* Writes formatted output to stream like fprintf.
+ * Returns nonzero on success, 0 on error. */
+static int stream_printf(Dr2osm_Stream *stream, const char *format, ...)
+{
+	va_list arguments;
+
+	va_start(arguments, format);
+
+	size_t available = STREAM_BLOCK_SIZE - stream->used;
+	int size = vsnprintf(stream->buffer + stream->used, available, format,
+						 arguments);
+
+	va_end(arguments);
+
+	if (size < 0)
+	{
+		stream->failed = 1;
+		return 0;
+	}
+
+	if ((size_t)size < available)
+	{
+		stream->used += size;
+		return 1;
+	}
+
+	/* The output did not fit in the current block. Format it again in a
+	 * temporary buffer and write it from there. */
+	char *temporary = malloc((size_t)size + 1);
+
+	if (!temporary)
+	{
+		stream->failed = 1;
+		return 0;
+	}
+
+	va_start(arguments, format);
+	vsnprintf(temporary, (size_t)size + 1, format, arguments);
+	va_end(arguments);
+
+	int result = dr2osm_stream_write(stream, temporary, size);
+
+	free(temporary);
+
+	return result;
+}
+
+#if defined(_WIN32)
+
+static int64_t map_file_region(Dr2osm_Stream *stream, int64_t offset,
+							   int64_t size)
+{
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno(stream->file));
+	LARGE_INTEGER end;
+	SYSTEM_INFO info;
+
+	/* Creating a mapping larger than the file extends the file. */
+	end.QuadPart = offset + size;
+	stream->mapping_handle = CreateFileMappingW(file, 0, PAGE_READWRITE,
+												end.HighPart, end.LowPart, 0);
+
+	if (!stream->mapping_handle)
+	{
+		return -1;
+	}
+
+	GetSystemInfo(&info);
+
+	int64_t aligned_offset = offset - offset % info.dwAllocationGranularity;
+
+	stream->mapping = MapViewOfFile(stream->mapping_handle, FILE_MAP_WRITE,
+									(DWORD)(aligned_offset >> 32),
+									(DWORD)aligned_offset,
+									(SIZE_T)(size + offset - aligned_offset));
+
+	if (!stream->mapping)
+	{
+		CloseHandle(stream->mapping_handle);
+		return -1;
+	}
+
+	return aligned_offset;
+}
+
+static void unmap_file_region(Dr2osm_Stream *stream)
+{
+	UnmapViewOfFile(stream->mapping);
+	CloseHandle(stream->mapping_handle);
+}
+
+static char *get_file_error_message()
+{
+	return get_memory_error_message();
+}
+
+static int is_regular_file(FILE *file)
+{
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+
+	return GetFileType(handle) == FILE_TYPE_DISK;
+}
+
+#define FTELL64 _ftelli64
+#define FSEEK64 _fseeki64
+
+#else
+
+static int64_t map_file_region(Dr2osm_Stream *stream, int64_t offset,
+							   int64_t size)
+{
+	int fd = fileno(stream->file);
+
+	/* Allocate the disk space up front, so that running out of it is
+	 * reported here instead of as a signal while writing to the mapping. */
+#if defined(__linux__)
+	int rc = posix_fallocate(fd, offset, size);
+
+	if (rc)
+	{
+		errno = rc;
+		return -1;
+	}
+#else
+	if (ftruncate(fd, offset + size))
+	{
+		return -1;
+	}
+#endif
+
+	int64_t aligned_offset = offset & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);
+	void *mapping = mmap(0, size + offset - aligned_offset,
+						 PROT_READ | PROT_WRITE, MAP_SHARED, fd, aligned_offset);
+
+	if (mapping == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	stream->mapping = mapping;
+
+	return aligned_offset;
+}
+
+static void unmap_file_region(Dr2osm_Stream *stream)
+{
+	munmap(stream->mapping, stream->mapping_size);
+}
+
+static char *get_file_error_message()
+{
+	return strerror(errno);
+}
+
+static int is_regular_file(FILE *file)
+{
+	struct stat info;
+
+	return !fstat(fileno(file), &info) && S_ISREG(info.st_mode);
+}
+
+#define FTELL64 ftello
+#define FSEEK64 fseeko
+
+#endif
+
+/* Returns nonzero if stream is a plain stream to a regular file, which
+ * stream_map can map. Devices such as /dev/null are written normally. */
+static int stream_can_map(const Dr2osm_Stream *stream)
+{
+	return stream->compression == COMPRESSION_NONE && stream->close_file
+		   && is_regular_file(stream->file);
+}
+
+/* Reserves size bytes at the current end of a plain file stream and maps
+ * them into memory, so that they can be filled directly, possibly from
+ * several threads. stream_unmap must be called before writing to the stream
+ * again.
+ * Returns a pointer to the reserved bytes, or 0 if the stream cannot be
+ * mapped, in which case it can still be written to normally. */
+static char *stream_map(Dr2osm_Stream *stream, int64_t size)
+{
+	if (!stream_can_map(stream) || size <= 0 || !drain_stream(stream)
+		|| fflush(stream->file))
+	{
+		return 0;
+	}
+
+	int64_t offset = FTELL64(stream->file);
+
+	if (offset < 0)
+	{
+		return 0;
+	}
+
+	int64_t aligned_offset = map_file_region(stream, offset, size);
+
+	if (aligned_offset < 0)
+	{
+		fprintf(stderr, "Unable to map output: %s\n", get_file_error_message());
+		return 0;
+	}
+
+	stream->mapping_size = size + offset - aligned_offset;
+	stream->mapped_end_offset = offset + size;
+
+	return stream->mapping + (offset - aligned_offset);
+}
+
+/* Unmaps the region mapped by stream_map and continues the stream after it.
+ * Returns nonzero on success, 0 on error. */
+static int stream_unmap(Dr2osm_Stream *stream)
+{
+	unmap_file_region(stream);
+	stream->mapping = 0;
+
+	if (FSEEK64(stream->file, stream->mapped_end_offset, SEEK_SET))
+	{
+		fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+		stream->failed = 1;
+	}
+
+#if defined(USE_IO_URING)
+	stream->file_offset = stream->mapped_end_offset;
+#endif
+
+	return !stream->failed;
+}
+
+int dr2osm_stream_close(Dr2osm_Stream *stream)
+{
+	drain_stream(stream);
+	stop_stream_threads(stream);
+
+	if (fflush(stream->file))
+	{
+		fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+		stream->failed = 1;
+	}
+
+	int result = !stream->failed;
+
+	if (stream->close_file && fclose(stream->file) && result)
+	{
+		fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+		result = 0;
+	}
+
+	stream->close_file = 0;
+	free_stream(stream);
+
+	return result;
+}
+
+double dr2osm_stream_stall_seconds(const Dr2osm_Stream *stream)
+{
+	return stream->stall_seconds;
+}
@@ -0,0 +1,272 @@
+#if defined(_WIN32)
+
+/* On Windows use native threads, slim reader/writer locks and condition
+ * variables. */
+
+typedef struct {
+	Thread_Function *function;
+	void *argument;
+} Thread_Start;
+
+static DWORD WINAPI
+thread_start(void *parameter)
+{
+	Thread_Start start = *(Thread_Start *)parameter;
+
+	free(parameter);
+	start.function(start.argument);
+
+	return 0;
+}
+
+static int
+start_thread(Thread *thread, Thread_Function *function, void *argument)
+{
+	Thread_Start *start = malloc(sizeof(Thread_Start));
+
+	if (!start) {
+		return 0;
+	}
+
+	start->function = function;
+	start->argument = argument;
+
+	thread->handle = CreateThread(0, 0, thread_start, start, 0, 0);
+
+	if (!thread->handle) {
+		free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+join_thread(Thread *thread)
+{
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+}
+
+static void
+init_mutex(Mutex *mutex)
+{
+	InitializeSRWLock(&mutex->lock);
+}
+
+static void
+destroy_mutex(Mutex *mutex)
+{
+}
+
+static void
+lock_mutex(Mutex *mutex)
+{
+	AcquireSRWLockExclusive(&mutex->lock);
+}
+
+static void
+unlock_mutex(Mutex *mutex)
+{
+	ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+static void
+init_condition(Condition *condition)
+{
+	InitializeConditionVariable(&condition->variable);
+}
+
+static void
+destroy_condition(Condition *condition)
+{
+}
+
+static void
+wait_condition(Condition *condition, Mutex *mutex)
+{
+	SleepConditionVariableSRW(&condition->variable, &mutex->lock, INFINITE, 0);
+}
+
+static void
+signal_condition(Condition *condition)
+{
+	WakeConditionVariable(&condition->variable);
+}
+
+static void
+broadcast_condition(Condition *condition)
+{
+	WakeAllConditionVariable(&condition->variable);
+}
+
+#if !defined(DR2OSM_NO_TRACE)
+
+/* Returns an identifier of the calling thread, which is unique among the
+ * running threads. Only traces need it. */
+static uintptr_t
+get_current_thread_id()
+{
+	return (uintptr_t)GetCurrentThreadId();
+}
+
+#endif
+
+static int
+get_processor_count()
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	return (int)info.dwNumberOfProcessors;
+}
+
+#else
+
+/* On POSIX use pthreads. */
+
+typedef struct {
+	Thread_Function *function;
+	void *argument;
+} Thread_Start;
+
+static void *
+thread_start(void *parameter)
+{
+	Thread_Start start = *(Thread_Start *)parameter;
+
+	free(parameter);
+	start.function(start.argument);
+
+	return 0;
+}
+
+static int
+start_thread(Thread *thread, Thread_Function *function, void *argument)
+{
+	Thread_Start *start = malloc(sizeof(Thread_Start));
+
+	if (!start) {
+		return 0;
+	}
+
+	start->function = function;
+	start->argument = argument;
+
+	if (pthread_create(&thread->handle, 0, thread_start, start)) {
+		free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+join_thread(Thread *thread)
+{
+	pthread_join(thread->handle, 0);
+}
+
+static void
+init_mutex(Mutex *mutex)
+{
+	pthread_mutex_init(&mutex->lock, 0);
+}
+
+static void
+destroy_mutex(Mutex *mutex)
+{
+	pthread_mutex_destroy(&mutex->lock);
+}
+
+static void
+lock_mutex(Mutex *mutex)
+{
+	pthread_mutex_lock(&mutex->lock);
+}
+
+static void
+unlock_mutex(Mutex *mutex)
+{
+	pthread_mutex_unlock(&mutex->lock);
+}
+
+static void
+init_condition(Condition *condition)
+{
+	pthread_cond_init(&condition->variable, 0);
+}
+
+static void
+destroy_condition(Condition *condition)
+{
+	pthread_cond_destroy(&condition->variable);
+}
+
+static void
+wait_condition(Condition *condition, Mutex *mutex)
+{
+	pthread_cond_wait(&condition->variable, &mutex->lock);
+}
+
+static void
+signal_condition(Condition *condition)
+{
+	pthread_cond_signal(&condition->variable);
+}
+
+static void
+broadcast_condition(Condition *condition)
+{
+	pthread_cond_broadcast(&condition->variable);
+}
+
+#if !defined(DR2OSM_NO_TRACE)
+
+/* Returns an identifier of the calling thread, which is unique among the
+ * running threads. Only traces need it. */
+static uintptr_t
+get_current_thread_id()
+{
+	return (uintptr_t)pthread_self();
+}
+
+#endif
+
+static int
+get_processor_count()
+{
+	long result = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return result > 0 ? (int)result : 1;
+}
+
+#endif
+
+/* Runs function on each of the num_jobs jobs in jobs, which are job_size
+ * bytes each, on separate threads, and waits for them to finish. Jobs whose
+ * thread cannot be started are run on the calling thread. */
+static void
+run_jobs(Thread_Function *function, void *jobs, int num_jobs, size_t job_size)
+{
+	Thread threads[64];
+	int started[64] = {0};
+
+	assert(num_jobs <= 64);
+
+	for (int i = 1; i < num_jobs; i++) {
+		started[i] = start_thread(&threads[i], function,
+				(char *)jobs + i * job_size);
+	}
+
+	function(jobs);
+
+	for (int i = 1; i < num_jobs; i++) {
+		if (started[i]) {
+			join_thread(&threads[i]);
+		} else {
+			function((char *)jobs + i * job_size);
+		}
+	}
+}
@@ -0,0 +1,159 @@
+/* Tracing of the hot paths of a conversion in the Chrome trace event format,
+ * which chrome://tracing and Perfetto can open. A trace point is a pair of
+ * TRACE_BEGIN(name) and TRACE_END(name) in the same block, which records the
+ * time spent between them as a complete event called name on the calling
+ * thread. Events shorter than TRACE_MIN_SECONDS are left out, so that a trace
+ * of a whole country stays small enough to open and mostly shows the phases,
+ * slow rows and stalls. Trace points cost a single branch when no trace is
+ * being written, and none at all when compiled with DR2OSM_NO_TRACE. */
+
+#if defined(DR2OSM_NO_TRACE)
+
+#define TRACE_BEGIN(NAME)
+#define TRACE_END(NAME)
+
+int
+dr2osm_trace_start(const Unicode_Character *path)
+{
+	fprintf(stderr, "Tracing was left out of this build.\n");
+	return 0;
+}
+
+int
+dr2osm_trace_stop(void)
+{
+	return 1;
+}
+
+#else
+
+#define TRACE_MIN_SECONDS 10e-6
+#define TRACE_MAX_THREADS 256
+
+#define TRACE_BEGIN(NAME) double trace_start_##NAME = trace_begin()
+#define TRACE_END(NAME) trace_end(#NAME, trace_start_##NAME)
+
+/* The trace is shared by the whole process, as the output streams trace their
+ * flushes without knowing about the converter. file is only set or cleared
+ * while no trace points are running. */
+static struct {
+	FILE *file;
+	Mutex mutex;
+	double start_time;
+	int num_events;
+	int failed;
+	uintptr_t threads[TRACE_MAX_THREADS];
+	int num_threads;
+} tracer;
+
+/* Returns the start time of an event, or 0 if no trace is being written. */
+static double
+trace_begin()
+{
+	return tracer.file ? get_time() : 0;
+}
+
+/* Returns the number of the calling thread in the trace, numbering threads in
+ * the order of their first events. The trace must be locked. */
+static int
+get_trace_thread()
+{
+	uintptr_t id = get_current_thread_id();
+
+	for (int i = 0; i < tracer.num_threads; i++) {
+		if (tracer.threads[i] == id) {
+			return i + 1;
+		}
+	}
+
+	if (tracer.num_threads == TRACE_MAX_THREADS) {
+		return 0;
+	}
+
+	tracer.threads[tracer.num_threads++] = id;
+
+	return tracer.num_threads;
+}
+
+/* Records the event called name that started at start_time, as returned by
+ * trace_begin, and ends now. */
+static void
+trace_end(const char *name, double start_time)
+{
+	if (!start_time) {
+		return;
+	}
+
+	double end_time = get_time();
+
+	if (end_time - start_time < TRACE_MIN_SECONDS) {
+		return;
+	}
+
+	lock_mutex(&tracer.mutex);
+
+	int result = fprintf(tracer.file,
+			"%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"pid\":1,\"tid\":%d}",
+			tracer.num_events ? ",\n" : "", name,
+			(start_time - tracer.start_time) * 1e6,
+			(end_time - start_time) * 1e6, get_trace_thread());
+
+	tracer.failed |= (result < 0);
+	tracer.num_events++;
+
+	unlock_mutex(&tracer.mutex);
+}
+
+int
+dr2osm_trace_start(const Unicode_Character *path)
+{
+	if (tracer.file) {
+		fprintf(stderr, "A trace is already being written.\n");
+		return 0;
+	}
+
+	FILE *file = UNICODE_FOPEN(path, "wb");
+
+	if (!file) {
+		fprintf(stderr, "Unable to open trace file " FORMAT_UNICODE_STRING
+				": %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	init_mutex(&tracer.mutex);
+	tracer.start_time = get_time();
+	tracer.num_events = 0;
+	tracer.failed = fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n",
+			file) < 0;
+	tracer.num_threads = 0;
+	tracer.file = file;
+
+	return 1;
+}
+
+int
+dr2osm_trace_stop(void)
+{
+	FILE *file = tracer.file;
+
+	if (!file) {
+		return 1;
+	}
+
+	tracer.file = 0;
+	destroy_mutex(&tracer.mutex);
+
+	int failed = tracer.failed;
+
+	failed |= fputs("\n]}\n", file) < 0;
+	failed |= fclose(file) != 0;
+
+	if (failed) {
+		fprintf(stderr, "Unable to write trace: %s\n", strerror(errno));
+	}
+
+	return !failed;
+}
+
+#endif
@@ -7,17 +7,32 @@
 #endif
 
 #if defined(_WIN32)
-typedef wchar_t Unicode_Character;
+typedef struct {
+	HANDLE handle;
+} Thread;
+
+typedef struct {
+	SRWLOCK lock;
+} Mutex;
+
+typedef struct {
+	CONDITION_VARIABLE variable;
+} Condition;
 #else
-typedef char Unicode_Character;
-#endif
+typedef struct {
+	pthread_t handle;
+} Thread;
 
 typedef struct {
-	Unicode_Character *input_path;
-	Unicode_Character *output_path;
-	Unicode_Character *mml_iceroads_path;
-	int default_speed_limits;
-} Program_Configuration;
+	pthread_mutex_t lock;
+} Mutex;
+
+typedef struct {
+	pthread_cond_t variable;
+} Condition;
+#endif
+
+typedef void Thread_Function(void *);
 
 typedef struct {
 	char *start;
@@ -25,6 +40,8 @@ typedef struct {
 	intptr_t first_in_offset;
 	intptr_t next_in_offset;
 	intptr_t commit_threshold_offset;
+	int num_commits;
+	jmp_buf *out_of_memory;
 } Growable_Buffer;
 
 typedef struct {
@@ -33,13 +50,674 @@ typedef struct {
 	int child_node_offsets[4];
 } Node;
 
+/* The node index is split into NUM_NODE_SHARDS shards, see node_index.c. A
+ * node is referred to by its index in its shard, shifted left by
+ * NODE_SHARD_BITS, or'ed with the number of the shard. */
+#define NODE_SHARD_BITS 6
+#define NUM_NODE_SHARDS (1 << NODE_SHARD_BITS)
+
+typedef struct {
+	Growable_Buffer buffer;
+	Mutex mutex;
+} Node_Shard;
+
+typedef struct {
+	Node_Shard shards[NUM_NODE_SHARDS];
+
+	/* The references of the nodes with an ID in the order of their IDs. */
+	Growable_Buffer ordered_refs;
+	int num_nodes;
+} Node_Index;
+
+/* A direct-mapped cache of recently upserted nodes in front of the node index,
+ * which mostly catches the endpoints consecutive ways share. Each thread
+ * inserting nodes has one of its own, so hits take no locks. 4096 entries
+ * catch nine tenths of the repeated lookups of nearby links while staying in
+ * the L2 cache. */
+#define NODE_CACHE_BITS 12
+#define NODE_CACHE_SIZE (1 << NODE_CACHE_BITS)
+
+typedef struct {
+	int x;
+	int y;
+	uint32_t ref;
+} Node_Cache_Entry;
+
+typedef struct {
+	Node_Cache_Entry entries[NODE_CACHE_SIZE];
+	int64_t num_lookups;
+	int64_t num_hits;
+} Node_Cache;
+
+/* A snapshot file consists of a header followed by an array of num_nodes
+ * Snapshot_Node records at nodes_offset and a copy of the way buffer of
+ * ways_size bytes at ways_offset. Both arrays are aligned to 8 bytes, so a
+ * mapped snapshot can be used in place. Snapshots are written in native byte
+ * order, which byte_order_mark is used to check.
+ *
+ * Checkpoints use the same format. stage tells which input was being
+ * processed when the checkpoint was written, input which of several Digiroad
+ * inputs it was, last_rowid is the rowid of the last row of that input whose
+ * way has been buffered and num_invalid the number of rows skipped so far.
+ * Snapshots have the stage SNAPSHOT_STAGE_COMPLETE. */
+#define SNAPSHOT_MAGIC "DR2OSMSS"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BYTE_ORDER_MARK 0x01020304
+
+enum
+{
+	SNAPSHOT_STAGE_COMPLETE,
+	SNAPSHOT_STAGE_DIGIROAD,
+	SNAPSHOT_STAGE_MML_ICEROADS,
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order_mark;
+	int32_t last_id;
+	int32_t num_nodes;
+	int32_t num_ways;
+	int32_t stage;
+	int64_t nodes_offset;
+	int64_t ways_offset;
+	int64_t ways_size;
+	int64_t last_rowid;
+	int32_t num_invalid;
+	int32_t input;
+} Snapshot_Header;
+
+typedef struct {
+	int32_t x, y;
+	int32_t id;
+} Snapshot_Node;
+
+/* A uniform grid of square cells over nodes. The cells are hashed into
+ * num_buckets buckets, a power of two, and the nodes of bucket i are
+ * nodes[bucket_starts[i]] to nodes[bucket_starts[i + 1] - 1]. */
+typedef struct {
+	int x, y;
+	int id;
+} Grid_Node;
+
+typedef struct {
+	int cell_size;
+	size_t num_buckets;
+	size_t *bucket_starts;
+	Grid_Node *nodes;
+} Node_Grid;
+
+/* An external sorter collects fixed size records into a buffer. Whenever the
+ * buffer fills up, it is sorted in chunks on several threads and the chunks
+ * are appended to a temporary file as sorted runs. Once all records have been
+ * pushed, the runs are merged, or the chunks in the buffer if nothing was
+ * written to the file. */
+typedef int Compare_Function(const void *a, const void *b);
+
+typedef struct {
+	/* Buffered records of the run. Runs in the file are read into their
+	 * part of the sorter buffer as they are merged. */
+	char *records;
+	size_t num_records;
+	size_t next_record;
+	size_t buffer_size;
+
+	/* The remaining records in the file. */
+	int64_t file_offset;
+	int64_t file_records;
+} Sort_Run;
+
+typedef struct {
+	size_t record_size;
+	Compare_Function *compare;
+	int num_threads;
+
+	char *buffer;
+	size_t capacity;
+	size_t num_buffered;
+
+	FILE *file;
+	int64_t file_size;
+
+	Sort_Run *runs;
+	int num_runs;
+
+	/* Runs with records left during the merge, as a binary heap ordered by
+	 * their next record. */
+	int *heap;
+	int heap_size;
+	int consume_pending;
+
+	int failed;
+} External_Sorter;
+
+/* A chunk of the sorter buffer sorted by a worker thread. */
+typedef struct {
+	char *records;
+	size_t num_records;
+	size_t record_size;
+	Compare_Function *compare;
+} Sort_Job;
+
+/* The position of a node in the way buffer, as a byte offset from its start,
+ * which is sorted by coordinates to deduplicate nodes externally. */
 typedef struct {
-	FILE *output;
+	int32_t x, y;
+	int64_t offset;
+} Node_Occurrence;
+
+/* A protobuf message being decoded, see merge_pbf.c. */
+typedef struct {
+	const uint8_t *data, *end;
+	int failed;
+} Pbf_Message;
+
+/* Coordinates in a primitive block are in units of granularity nanodegrees
+ * from the offsets. */
+typedef struct {
+	int64_t granularity;
+	int64_t lat_offset, lon_offset;
+} Pbf_Block_Scale;
+
+typedef struct {
+	int64_t id;
+	double lat, lon;
+} Pbf_Node;
+
+/* The references and tags of a way are in the refs and tags arrays of the
+ * reader. */
+typedef struct {
+	int64_t id;
+	size_t first_ref, num_refs;
+	size_t first_tag, num_tags;
+} Pbf_Way;
+
+/* Reader of an OSM PBF file merged into the output. The nodes or the ways of
+ * the current primitive block are decoded into nodes or ways and the reader
+ * is at element current of them. */
+typedef struct {
+	FILE *file;
+	Unicode_Character *path;
+
+	/* The offsets of the first data block and of the first block after the
+	 * nodes, or -1 if the nodes have not been read or run to the end of the
+	 * file. */
+	int64_t data_offset;
+	int64_t ways_offset;
+
+	int reading_ways;
+	int last_block;
+	int at_end;
+	int64_t previous_id;
+
+	/* The blob as read from the file and the block decompressed from it. */
+	uint8_t *blob;
+	size_t blob_capacity;
+	uint8_t *block;
+	size_t block_capacity;
+	size_t block_size;
+
+	/* The string table of the block, with terminators. */
+	char *strings;
+	size_t strings_capacity;
+	const char **string_table;
+	size_t string_table_capacity;
+	size_t num_strings;
+
+	Pbf_Node *nodes;
+	size_t node_capacity;
+	Pbf_Way *ways;
+	size_t way_capacity;
+	int64_t *refs;
+	size_t ref_capacity;
+	size_t num_refs;
+	Dr2osm_Tag *tags;
+	size_t tag_capacity;
+	size_t num_tags;
+	size_t num_elements;
+	size_t current;
+} Pbf_Reader;
+
+/* A node of a merged file with the converted node that way endpoints at it
+ * are snapped to. */
+typedef struct {
+	int64_t id;
+	int node_id;
+} Merge_Snap;
+
+typedef struct Input_Reader Input_Reader;
+
+struct Dr2osm_Converter {
+	Dr2osm_Options options;
+	sqlite3 *digiroad_dbs[DR2OSM_MAX_INPUTS];
+	int num_inputs;
+	sqlite3 *mml_iceroads_db;
+	FILE *snapshot_input;
+	Snapshot_Header snapshot_header;
+	Unicode_Character *snapshot_output_path;
+	Unicode_Character *checkpoint_path;
+	Unicode_Character *checkpoint_temporary_path;
+	int resume;
+	int num_checkpoints;
+	double checkpoint_seconds;
 	PJ *projection;
+	Growable_Buffer way_buffer;
+	Node_Index node_index;
+	Node_Cache node_cache;
+
+	/* The rounded points of the way being buffered. */
+	Growable_Buffer point_buffer;
+
+	/* The points of the stretch of a link being buffered, see
+	 * linear_reference.c. */
+	Growable_Buffer stretch_points;
+
+	/* With several Digiroad inputs, the readers parsing them concurrently. */
+	Input_Reader *readers;
+	int num_readers;
+
+	/* If the nodes are deduplicated externally, the occurrences of nodes in
+	 * the ways while processing the input, and afterwards the nodes as
+	 * Snapshot_Nodes in ID order. */
+	External_Sorter node_occurrences;
+	FILE *node_file;
+	int num_file_nodes;
+
+	/* The nodes that ice road endpoints are snapped to. */
+	Node_Grid snap_grid;
+	int num_snapped_endpoints;
+	int num_iceroad_endpoints;
+
+	/* OSM PBF files whose nodes and ways are output after the converted
+	 * ones. The merged nodes get consecutive IDs from first_merged_id, and
+	 * merged_node_ids holds their original IDs in the same order. Merged
+	 * nodes that way endpoints are snapped at are kept in merge_snaps, in
+	 * the order of their original IDs. */
+	Pbf_Reader merge_readers[DR2OSM_MAX_INPUTS];
+	int num_merge_inputs;
+	Growable_Buffer merged_node_ids;
+	int first_merged_id;
+	Growable_Buffer merge_snaps;
+	int num_merged_nodes;
+	int num_merged_ways;
+	int num_snapped_merge_endpoints;
+
+	int num_ways;
+	int last_id;
+	jmp_buf out_of_memory;
+};
+
+/* Output streams collect output into blocks of STREAM_BLOCK_SIZE bytes, which
+ * go through a ring of Compression_Blocks: the thread writing to the stream
+ * fills them, worker threads of compressed streams compress them in any
+ * order and a writer thread writes them to the file in order, so the
+ * conversion only waits for the output when every block is in use. Plain
+ * streams have PLAIN_STREAM_BLOCKS blocks, which are written as they are. */
+#define STREAM_BLOCK_SIZE (1024 * 1024)
+#define PLAIN_STREAM_BLOCKS 4
+
+enum
+{
+	COMPRESSION_NONE,
+	COMPRESSION_GZIP,
+	COMPRESSION_ZSTD,
+};
+
+enum
+{
+	BLOCK_FREE,
+	BLOCK_FILLED,
+	BLOCK_COMPRESSING,
+	BLOCK_COMPRESSED,
+	BLOCK_WRITING,
+	BLOCK_WRITTEN,
+};
+
+typedef struct {
+	char *input;
+	size_t input_size;
+	char *output;
+	size_t output_size;
+	size_t output_capacity;
+	int state;
+
+	/* Progress of an asynchronous write of the output. */
+	int64_t file_offset;
+	size_t written;
+} Compression_Block;
+
+#if defined(USE_IO_URING)
+/* The submission and completion queues of an io_uring instance, mapped from
+ * the kernel. */
+typedef struct {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Io_Ring;
+#endif
+
+struct Dr2osm_Stream {
+	FILE *file;
+	int close_file;
+	int compression;
+	int failed;
+
+	/* The block currently being filled. */
+	char *buffer;
+	size_t used;
+
+	/* Time spent waiting for a free block. */
+	double stall_seconds;
+
+	Compression_Block *blocks;
+	int num_blocks;
+	int64_t next_fill_sequence;
+	int64_t next_write_sequence;
+	Thread *workers;
+	int num_workers;
+	Thread writer;
+	Mutex mutex;
+	Condition block_filled;
+	Condition block_compressed;
+	Condition block_freed;
+	int closing;
+
+#if defined(USE_IO_URING)
+	/* Seekable plain files are written with io_uring if the kernel supports
+	 * it. file_offset is where the next block goes. */
+	int use_io_ring;
+	Io_Ring io_ring;
+	int64_t next_submit_sequence;
+	int64_t file_offset;
+#endif
+
+	/* State of the sink writing to the stream, if it has any, which is freed
+	 * with the stream. */
+	void *sink_state;
+	void (*free_sink_state)(void *sink_state);
+
+	/* Only used while a region of a plain file stream is mapped, see
+	 * stream_map. */
+	char *mapping;
+	int64_t mapping_size;
+	int64_t mapped_end_offset;
+#if defined(_WIN32)
+	HANDLE mapping_handle;
+#endif
+};
+
+/* Destination of text formatted by the format_ functions in output_xml.c. At
+ * most capacity bytes are written to buffer, but size counts every byte. */
+typedef struct {
+	char *buffer;
+	size_t capacity;
+	size_t size;
+} Format_Buffer;
+
+/* O5M keeps a table of the last 15000 string pairs written, which later
+ * occurrences of the same pair refer to. Only pairs of up to 250 bytes, not
+ * counting the terminators, are entered into it. The writer finds repeated
+ * pairs with a direct-mapped hash table, which only remembers the most recent
+ * pair with each hash. */
+#define O5M_STRING_TABLE_SIZE 15000
+#define O5M_MAX_TABLE_PAIR_SIZE 250
+#define O5M_HASH_TABLE_SIZE (1 << 15)
+
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+} O5m_Buffer;
+
+typedef struct {
+	Dr2osm_Stream *output;
+	int failed;
+
+	/* The previous values of the delta coded fields. Readers share the id
+	 * between object types, so a reset is written before the first way. */
+	int writing_ways;
+	int64_t id;
+	int64_t node_ref;
+	int64_t lat;
+	int64_t lon;
+
+	char (*strings)[O5M_MAX_TABLE_PAIR_SIZE + 2];
+	int64_t num_strings;
+	int64_t string_hashes[O5M_HASH_TABLE_SIZE];
+
+	/* Datasets are prefixed with their size, so they are built here first. */
+	O5m_Buffer dataset;
+	O5m_Buffer refs;
+} O5m_Writer;
+
+/* A directed edge of a road graph being collected, between the OSM IDs of
+ * its nodes. */
+typedef struct {
+	int32_t source, target;
+	int32_t way_id;
+	uint32_t max_weight;
+	uint16_t speed_limit;
+	uint16_t max_height;
+	uint8_t highway;
+	uint8_t flags;
+} Graph_Edge;
+
+typedef struct {
+	Dr2osm_Stream *output;
+
+	/* The nodes in the order they were passed to the sink, and the index of
+	 * each node by its OSM ID. */
+	int32_t *node_ids;
+	double *lats, *lons;
+	int64_t num_nodes;
+	int64_t node_capacity;
+	int32_t *node_indices;
+	int64_t node_index_capacity;
+
+	Graph_Edge *edges;
+	int64_t num_edges;
+	int64_t edge_capacity;
+} Graph_Writer;
+
+/* State of an extract server, see dr2osm_serve. The processed network is kept
+ * in the converter, and the arrays below index it so that an extract only
+ * touches the ways it includes. */
+typedef struct {
+	Dr2osm_Converter *converter;
+
+	/* Offsets of the buffered ways in the way buffer and their
+	 * municipalities, by the index of the way. */
+	intptr_t *way_offsets;
+	int *way_municipalities;
+
+	/* WGS 84 latitude and longitude of each node, by node ID, so that PROJ is
+	 * not needed to answer requests. */
+	double *node_coordinates;
+
+	/* Grid over the nodes, and the indices of the ways referencing each node
+	 * in compressed sparse row form: the ways of node ID i are
+	 * node_ways[node_way_starts[i]] to node_ways[node_way_starts[i + 1] - 1]. */
+	Node_Grid grid;
+	int *node_way_starts;
+	int *node_ways;
+
+	/* Scratch space of a request: whether each way is in the extract and,
+	 * by node ID, whether each node is referenced by an included way. */
+	uint8_t *selected_ways;
+	uint8_t *selected_nodes;
+} Extract_Server;
+
+/* A range of buffered ways formatted directly into mapped output by a worker
+ * thread, see emit_ways_mapped. */
+typedef struct {
+	Dr2osm_Converter *converter;
+	const Dr2osm_Output *output;
+	const intptr_t *way_offsets;
+	int first_way;
+	int end_way;
+
+	/* Output of the sizing pass, and the position of the first way in the
+	 * mapped region for the fill pass. */
+	int64_t size;
+	char *destination;
+} Way_Fill_Job;
+
+typedef struct {
+	Dr2osm_Converter *converter;
 	int num_valid, num_invalid, num_total;
-	int default_speed_limits;
+
+	/* The SNAPSHOT_STAGE_ of the running query, the index of the Digiroad
+	 * input and the rowid of the row being processed. All rows of a rowid are
+	 * processed before a checkpoint is written. */
+	int stage;
+	int input;
+	int64_t rowid;
+
+	/* The number of rows the attribute joins of the Digiroad query returned
+	 * in addition to one per link. */
+	int64_t num_duplicate_rows;
+
+	/* The time is only checked every CHECKPOINT_CHECK_ROWS rows. */
+	int rows_until_check;
+	double next_checkpoint_time;
+
+	/* If not 0, the query runs on the thread of reader and the rows are
+	 * parsed into its buffer instead of the way buffer. */
+	Input_Reader *reader;
+
+	/* In the two-pass mode, the TWO_PASS_ constant of the pass the query
+	 * belongs to, otherwise 0. See stream_way. */
+	int pass;
+	const Dr2osm_Output *outputs;
+	int num_outputs;
+
+	/* First pass: if not 0, bit i of the byte of each node ID is set if
+	 * outputs[i] keeps a way referencing the node. */
+	Growable_Buffer *node_masks;
+
+	/* Second pass: the highest ID of the ways streamed so far and their
+	 * nodes, and whether a sink failed, which ends the query. */
+	int last_id;
+	int failed;
 } Query_Context;
 
+enum
+{
+	TWO_PASS_NODES = 1,
+	TWO_PASS_WAYS,
+};
+
+/* Reads one of several Digiroad inputs on its own thread and connection. The
+ * rows are parsed into ways, whose points are rounded and inserted into the
+ * node index, and published in batches to the converter thread, which gives
+ * the new nodes their IDs and buffers the ways in input order, so the output
+ * does not depend on the timing of the readers. The format of a parsed way:
+ *
+ * int64_t rowid
+ * int num_points, or -1 if the geometry is invalid and nothing follows
+ * uint32_t... node references of the points, see Node_Index, or if nodes are
+ *     deduplicated externally, int... x and y of the points
+ * attributes as in the way buffer */
+struct Input_Reader {
+	Query_Context context;
+	sqlite3 *db;
+	Growable_Buffer ways;
+	Growable_Buffer stretch_points;
+	Node_Cache node_cache;
+	jmp_buf out_of_memory;
+	Thread thread;
+	int started;
+
+	/* The end of the last complete way in ways. Running out of memory can
+	 * leave a way partly pushed after it, which is never published. */
+	intptr_t complete_offset;
+
+	Mutex mutex;
+	Condition published;
+	intptr_t published_offset;
+	int done;
+	int result;
+	int cancelled;
+};
+
+enum
+{
+	WAY_SOURCE_DIGIROAD,
+	WAY_SOURCE_MML_ICEROAD,
+};
+
+/* The attributes of a way as they appear in the source data. */
+typedef struct {
+	int source;
+	int class;
+	int type;
+	int direction;
+	int speed_limit;
+	int height_cm;
+	int weight_kg;
+
+	/* Statistics Finland code of the municipality of the way, or 0 if
+	 * unknown. */
+	int municipality;
+	const char *name;
+} Way_Attributes;
+
+/* The attributes of Digiroad links that are given as ranges along the link,
+ * see linear_reference.c. */
+enum
+{
+	RANGED_SPEED_LIMIT,
+	RANGED_HEIGHT,
+	RANGED_WEIGHT,
+	NUM_RANGED_ATTRIBUTES,
+};
+
+#define MAX_LINK_RANGES 32
+
+/* A value of a ranged attribute from start to end metres along a link. */
+typedef struct {
+	double start;
+	double end;
+	int value;
+} Attribute_Range;
+
+typedef struct {
+	Attribute_Range ranges[NUM_RANGED_ATTRIBUTES][MAX_LINK_RANGES];
+	int num_ranges[NUM_RANGED_ATTRIBUTES];
+} Link_Ranges;
+
+/* A stretch of a link along which the ranged attributes keep their values,
+ * which are 0 where unknown. */
+typedef struct {
+	double start;
+	double end;
+	int values[NUM_RANGED_ATTRIBUTES];
+} Link_Stretch;
+
+#define MAX_LINK_STRETCHES (1 + 2 * NUM_RANGED_ATTRIBUTES * MAX_LINK_RANGES)
+
+/* Storage for the tags of a way popped from the way buffer. Highway, route and
+ * oneway, maxspeed, name, maxheight, maxweight and the additional tags. */
+#define MAX_WAY_TAGS 16
+
+typedef struct {
+	Dr2osm_Tag tags[MAX_WAY_TAGS];
+	char maxspeed[16];
+	char maxheight[16];
+	char maxweight[16];
+} Way_Tag_Storage;
+
 typedef PACK_BEGIN {
 	uint8_t magic[2];
 	uint8_t version;
@@ -56,3 +734,11 @@ typedef PACK_BEGIN {
 } PACK_END Wkb_Line_String_Any;
 
 typedef int Row_Function(sqlite3_stmt *, Query_Context *);
+
+/* Buffers or streams a way with the num_points points of point_stride
+ * coordinates at points, or records an invalid geometry if points is 0.
+ * Returns nonzero on valid geometry, 0 on invalid geometry. */
+typedef int Way_Function(const double *points, int num_points,
+						 int point_stride, int reverse_node_order,
+						 const Way_Attributes *attributes,
+						 Query_Context *context);